@@ -0,0 +1,199 @@
+#ifndef LIQUIDATOR_BAM_INDEX_STATS_H_INCLUDED
+#define LIQUIDATOR_BAM_INDEX_STATS_H_INCLUDED
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace liquidator
+{
+
+// What a samtools .bai records about the reads of a reference in its pseudo bin: the virtual
+// file offsets of the reference's first read and of just after its last read, and how many of
+// its reads are mapped and how many are unmapped (placed next to their mapped mates).  Also the
+// virtual file offset of the first read overlapping the reference's last 16kb window, from the
+// linear index, so the end of the reference's reads can be reached without reading them all.
+struct ReferenceIndexStats
+{
+    bool has_reads = false;
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    uint64_t mapped = 0;
+    uint64_t unmapped = 0;
+    uint64_t last_window_begin = 0;
+};
+
+namespace detail
+{
+
+// samtools writes the stats of each reference as a pseudo bin with two "chunks"
+const uint32_t index_stats_bin = 37450;
+
+class IndexParser
+{
+public:
+    IndexParser(const std::vector<char>& contents)
+    :
+        m_position(contents.data()),
+        m_end(contents.data() + contents.size())
+    {}
+
+    // returns false if there aren't enough bytes left
+    template <typename T>
+    bool read(T& value)
+    {
+        if (size_t(m_end - m_position) < sizeof(T))
+        {
+            return false;
+        }
+        std::memcpy(&value, m_position, sizeof(T));
+        m_position += sizeof(T);
+        return true;
+    }
+
+    bool skip(uint64_t bytes)
+    {
+        if (uint64_t(m_end - m_position) < bytes)
+        {
+            return false;
+        }
+        m_position += bytes;
+        return true;
+    }
+
+private:
+    const char* m_position;
+    const char* const m_end;
+};
+
+}
+
+// Reads the stats of every reference from the bam's index, looking for the index just like
+// bam_index_load does (the bam path with .bai appended, or with .bam replaced by .bai).  Returns
+// false if there is no index, it is malformed, or a reference with reads lacks the pseudo bin
+// (which old versions of samtools didn't write).  The index is little endian, like the machine.
+// If windows isn't null, it is also set to the linear index of each reference: the virtual file
+// offset of the first read overlapping each 16kb window (0 for the windows before any read).
+inline bool read_index_stats(const std::string& bam_file_path, std::vector<ReferenceIndexStats>& stats,
+                             std::vector<std::vector<uint64_t>>* windows = nullptr)
+{
+    std::ifstream file(bam_file_path + ".bai", std::ios::binary);
+    if (!file && bam_file_path.size() > 4 && bam_file_path.compare(bam_file_path.size() - 4, 4, ".bam") == 0)
+    {
+        file.open(bam_file_path.substr(0, bam_file_path.size() - 4) + ".bai", std::ios::binary);
+    }
+    if (!file)
+    {
+        return false;
+    }
+    const std::vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    detail::IndexParser parser(contents);
+    char magic[4];
+    int32_t reference_count;
+    if (!parser.read(magic) || std::memcmp(magic, "BAI\1", 4) != 0 || !parser.read(reference_count) || reference_count < 0)
+    {
+        return false;
+    }
+
+    stats.assign(reference_count, ReferenceIndexStats());
+    if (windows != nullptr)
+    {
+        windows->assign(reference_count, std::vector<uint64_t>());
+    }
+    for (int32_t r = 0; r < reference_count; ++r)
+    {
+        ReferenceIndexStats& reference = stats[r];
+        int32_t bin_count;
+        if (!parser.read(bin_count))
+        {
+            return false;
+        }
+        bool has_stats = false;
+        for (int32_t i = 0; i < bin_count; ++i)
+        {
+            uint32_t bin;
+            int32_t chunk_count;
+            if (!parser.read(bin) || !parser.read(chunk_count) || chunk_count < 0)
+            {
+                return false;
+            }
+            if (bin == detail::index_stats_bin && chunk_count == 2)
+            {
+                if (!parser.read(reference.begin) || !parser.read(reference.end)
+                    || !parser.read(reference.mapped) || !parser.read(reference.unmapped))
+                {
+                    return false;
+                }
+                has_stats = true;
+            }
+            else if (!parser.skip(uint64_t(chunk_count)*2*sizeof(uint64_t)))
+            {
+                return false;
+            }
+        }
+
+        int32_t window_count;
+        if (!parser.read(window_count) || window_count < 0)
+        {
+            return false;
+        }
+        for (int32_t i = 0; i < window_count; ++i)
+        {
+            uint64_t window_begin;
+            if (!parser.read(window_begin))
+            {
+                return false;
+            }
+            if (window_begin != 0)
+            {
+                reference.last_window_begin = window_begin;
+            }
+            if (windows != nullptr)
+            {
+                (*windows)[r].push_back(window_begin);
+            }
+        }
+
+        reference.has_reads = bin_count > 0;
+        if (reference.has_reads && !has_stats)
+        {
+            return false;
+        }
+        if (reference.last_window_begin < reference.begin)
+        {
+            reference.last_window_begin = reference.begin;
+        }
+    }
+    return true;
+}
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -1,24 +1,42 @@
 #ifndef LIQUIDATOR_BAM_SCORER_H_INCLUDED
 #define LIQUIDATOR_BAM_SCORER_H_INCLUDED
 
+#include "bam_index_stats.h"
 #include "bamliquidator_regions.h"
+#include "bgzf_read_ahead.h"
+#include "chunk_pool.h"
+#include "metrics.h"
+#include "motif_set.h"
 #include "score_matrix.h"
 
 #include <samtools/bam.h>
 
 #include <boost/filesystem.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include <thread>
-#include <mutex>
-#include <deque>
+#include <vector>
 
-static const int MAX_QUEUED_READS = 200;
-static const int MAX_THREAD_CHUNK = 100000;
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/pipeline.h>
+#include <tbb/task_scheduler_init.h>
+
+// Reads are scored in chunks of MAX_THREAD_CHUNK (or of BGZF_CHUNK_BYTES when reading
+// the whole bam), with at most CHUNKS_PER_THREAD chunks per thread in flight at once,
+// so memory stays bounded while the output stage waits on a slow chunk.
+static const int MAX_THREAD_CHUNK = 10000;
+static const int CHUNKS_PER_THREAD = 4;
+
+// Windows with p-values below MAX_HIT_PVALUE are hits.
+static const double MAX_HIT_PVALUE = 0.0001;
+
+// Region reads are fetched in chunks of about REGION_CHUNK_LENGTH base pairs.
+static const int REGION_CHUNK_LENGTH = 100000;
 
 namespace liquidator
 {
@@ -39,6 +57,139 @@ inline bool reverse_complemented(const bam1_t& read)
     return read.core.flag & reverse_complemented_bit;
 }
 
+// A bam1_t that frees its data when destroyed, for keeping reads in vectors.
+struct BamAllocator
+{
+    // note: we are not calling bam_init1(), which was just calloc()ing,
+    // if that ever changes this will likely break
+    BamAllocator() : bam() { }
+
+    BamAllocator(BamAllocator&& other) noexcept : bam(other.bam)
+    {
+        other.bam.data = 0;
+    }
+
+    BamAllocator(const BamAllocator&) = delete;
+    BamAllocator& operator=(const BamAllocator&) = delete;
+
+    ~BamAllocator()
+    {
+        // note: we are not calling bam_destroy1(), which was just free()ing the
+        // bam and the bam data. since the vectors manage the bam memory,
+        // we just need to free the bam dat, but if samtools changes this will
+        // likely break
+        free(bam.data);
+    }
+
+    bam1_t bam;
+};
+
+// A chunk of reads read in order from a bam.
+struct BamReadChunk
+{
+    BamReadChunk() : size(0)
+    {
+        reads.reserve(MAX_THREAD_CHUNK);
+    }
+
+    // empties the chunk for reuse, keeping the reads' data buffers
+    void clear()
+    {
+        size = 0;
+    }
+
+    // returns the read after the last valid read, for reading into;
+    // increment size to keep it
+    bam1_t& next_read()
+    {
+        if (size == reads.size())
+        {
+            reads.emplace_back();
+        }
+        return reads[size].bam;
+    }
+
+    std::vector<BamAllocator> reads; // only the first size reads are valid
+    size_t size;
+};
+
+// Adds the chunk's reads to the reads fetched and bytes decoded metrics, if metrics are enabled.
+inline void count_fetched(const BamReadChunk& chunk)
+{
+    if (Metrics::enabled())
+    {
+        uint64_t bytes = 0;
+        for (size_t i=0; i < chunk.size; ++i)
+        {
+            bytes += sizeof(int32_t) + 32 + chunk.reads[i].bam.data_len; // block length, core and data
+        }
+        add_count(Counter::reads_fetched, chunk.size);
+        add_count(Counter::bam_bytes_decoded, bytes);
+    }
+}
+
+// A bam file and index, one per thread for fetching regions in parallel.
+class BamReader
+{
+public:
+    BamReader(const std::string& bam_file_path):
+        m_bam_file_path(bam_file_path)
+    {
+        init();
+    }
+
+    BamReader(const BamReader& other):
+        m_bam_file_path(other.m_bam_file_path)
+    {
+        init();
+    }
+
+    BamReader& operator=(const BamReader& other) = delete;
+
+    ~BamReader()
+    {
+        bam_index_destroy(m_index);
+        bam_close(m_file);
+    }
+
+    bamFile file() const { return m_file; }
+    const bam_index_t* index() const { return m_index; }
+
+private:
+    const std::string m_bam_file_path;
+    bamFile m_file;
+    bam_index_t* m_index;
+
+    void init()
+    {
+        StageTimer timer(Stage::index_load);
+        m_file = bam_open(m_bam_file_path.c_str(), "r");
+        if (m_file == 0)
+        {
+            throw std::runtime_error("failed to open " + m_bam_file_path);
+        }
+
+        m_index = bam_index_load(m_bam_file_path.c_str());
+        if (m_index == 0)
+        {
+            bam_close(m_file);
+            throw std::runtime_error("failed to load index for " + m_bam_file_path);
+        }
+    }
+};
+
+typedef tbb::enumerable_thread_specific<BamReader,
+                                        tbb::cache_aligned_allocator<BamReader>,
+                                        tbb::ets_key_per_instance>
+        ThreadBamReaders;
+
+// Reads are scored with a tbb pipeline: a serial stage reads chunks of the whole bam's
+// BGZF blocks, a parallel stage inflates them and a serial in order stage parses their
+// reads (or the first stage reads the unmapped reads, or hands out chunks of the sorted
+// and merged regions, for the parallel stage to fetch with its thread's BamReader), a
+// parallel stage scores each chunk into its own counts, hit list and fimo style text,
+// and a serial in order stage prints the text, writes the hit reads and merges the
+// counts -- so the output is the same regardless of the number of threads.
 class BamScorer
 {   
 public:
@@ -60,45 +211,59 @@ public:
         m_bam_output_file_path(bam_output_file_path),
         m_output(0),
         m_header(bam_header_read(m_input)),
-        m_index(bam_index_load(bam_input_file_path.c_str())),
+        m_index(load_index(bam_input_file_path)),
         m_matrices(matrices),
+        m_motifs(matrices, MAX_HIT_PVALUE),
         m_print_style(print_style),
         m_only_score_unmapped(only_score_unmapped),
-        m_read(0),
-        m_read_count(0),
-        m_unmapped_count(0),
-        m_read_hit_count(0),
-        m_unmapped_hit_count(0),
-        m_total_hit_count(0)
+        m_score_regions(!region_file_path.empty()),
+        m_next_interval(0)
     {
         if (m_input == 0 || m_header == 0 || m_index == 0)
         {
             throw std::runtime_error("failed to open " + bam_input_file_path);
         }
 
-        if (!bam_output_file_path.empty())
-        {
-            m_output = bam_open(bam_output_file_path.c_str(), "w");
-            bam_header_write(m_output, m_header);
-        }
-
-        if (m_print_style != None)
+        if (m_score_regions)
         {
-            std::cout << "#pattern name\tsequence name\tstart\tstop\tstrand\tscore\tp-value\tq-value\tmatched sequence" << std::endl;
+            m_readers.reset(new ThreadBamReaders(BamReader(bam_input_file_path)));
+            m_intervals = region_intervals(region_file_path);
         }
-
-        m_reading = true;
-        std::thread score_thread1(&BamScorer::score_thread_actual, this);
-        if (!region_file_path.empty())
+        else if (m_only_score_unmapped)
         {
-            score_regions(region_file_path);
+            plan_unmapped_scan(bam_input_file_path);
         }
-        else
+        if (!m_score_regions && !m_scan_unmapped)
         {
-            score_all_reads();
+            m_read_ahead.reset(new BgzfReadAhead(bam_input_file_path, bam_tell(m_input)));
         }
-        m_reading = false;
-        score_thread1.join();
+
+        start_output();
+        score_reads();
+    }
+
+    // Scores reads that the caller reads from a bam with the header, passing each chunk to score
+    // and then to write, so that one decode of the bam can be shared with other analyses (see
+    // bamliquidator_pass.m.cpp). The summary is printed when the scorer is destroyed, as usual.
+    BamScorer(bam_header_t* header,
+              const std::vector<ScoreMatrix>& matrices,
+              PrintStyle print_style,
+              bool only_score_unmapped,
+              const std::string& bam_output_file_path)
+    :
+        m_input(0),
+        m_bam_output_file_path(bam_output_file_path),
+        m_output(0),
+        m_header(header),
+        m_index(0),
+        m_matrices(matrices),
+        m_motifs(matrices, MAX_HIT_PVALUE),
+        m_print_style(print_style),
+        m_only_score_unmapped(only_score_unmapped),
+        m_score_regions(false),
+        m_next_interval(0)
+    {
+        start_output();
     }
 
     ~BamScorer()
@@ -109,28 +274,30 @@ public:
 
         if (!m_only_score_unmapped)
         {
-            print_percent("reads hit", m_read_hit_count, "total reads", m_read_count);
-            print_percent("mapped hit", m_read_hit_count - m_unmapped_hit_count, "mapped reads", m_read_count - m_unmapped_count);
+            print_percent("reads hit", m_counts.read_hit_count, "total reads", m_counts.read_count);
+            print_percent("mapped hit", m_counts.read_hit_count - m_counts.unmapped_hit_count, "mapped reads", m_counts.read_count - m_counts.unmapped_count);
         }
-        print_percent("unmapped hit", m_unmapped_hit_count, "unmapped reads", m_unmapped_count);
+        print_percent("unmapped hit", m_counts.unmapped_hit_count, "unmapped reads", m_counts.unmapped_count);
         if (!m_only_score_unmapped)
         {
-            print_percent("unmapped hit", m_unmapped_hit_count, "total hit", m_read_hit_count);
+            print_percent("unmapped hit", m_counts.unmapped_hit_count, "total hit", m_counts.read_hit_count);
         }
-        print_percent("unmapped reads", m_unmapped_count, "total reads", m_read_count);
-        std::cout << "# total hits: " << m_total_hit_count << " (average hits per hit read = " << double(m_total_hit_count)/m_read_hit_count << ")" << std::endl;
+        print_percent("unmapped reads", m_counts.unmapped_count, "total reads", m_counts.read_count);
+        std::cout << "# total hits: " << m_counts.total_hit_count << " (average hits per hit read = " << double(m_counts.total_hit_count)/m_counts.read_hit_count << ")" << std::endl;
 
-        bam_index_destroy(m_index);
-        bam_header_destroy(m_header);
-        bam_close(m_input);
+        if (m_input)
+        {
+            bam_index_destroy(m_index);
+            bam_header_destroy(m_header);
+            bam_close(m_input);
+        }
 
         if (m_output)
         {
             bam_close(m_output);
 
-            // Suprisingly the bam seems already sorted, even if regions provided
-            // in such a way that bam_write1 I expect is called out of order.
-            // At some point I expect that I will need to do some kind of explicit sort.
+            // The hits are written in input order, and regions are scored in sorted order,
+            // so the output bam is as sorted as the input bam.
             int index_rc = bam_index_build(m_bam_output_file_path.c_str());
             if (index_rc != 0)
             {
@@ -139,285 +306,593 @@ public:
         }
     }
 
-    void operator()(const std::string& motif_name,
-                    size_t start,
-                    size_t stop,
-                    const ScoreMatrix::Score& score)
+    struct Counts
     {
-        if (score.pvalue() < 0.0001)
+        size_t read_count = 0;
+        size_t unmapped_count = 0;
+        size_t read_hit_count = 0;
+        size_t unmapped_hit_count = 0;
+        size_t total_hit_count = 0;
+
+        Counts& operator+=(const Counts& other)
         {
-            ++m_total_hit_count;
-            if (m_print_style != None)
-            {
-                std::cout << motif_name << '\t';
-                if (m_print_style == MappedFimo)
-                {
-                    const char* chromosome = m_read->core.tid >= 0 ? m_header->target_name[m_read->core.tid] : "*";
-                    std::cout << (unmapped(*m_read) ? "un" : "") << "mapped:" << chromosome << ":" << (char*) m_read->data << '\t'
-                              << m_read->core.pos + start << '\t'
-                              << m_read->core.pos + stop << '\t'
-                              << (score.is_reverse_complement() ? '-' : '+') << '\t';
-                }
-                else // m_print_style == Fimo
-                {
-                    // fimo reading a fasta has no way of determining if a sequence is reverse or forward mapping,
-                    // so if read is reverse complemented then we should reverse the direction to get perfect fimo matching.
-                    bool fimo_reverse = score.is_reverse_complement();
-                    size_t fimo_start = start;
-                    size_t fimo_stop  = stop;
-                    if (reverse_complemented(*m_read))
-                    {
-                        fimo_reverse = !fimo_reverse;
-                        fimo_start = m_read->core.l_qseq - stop  + 1;
-                        fimo_stop  = m_read->core.l_qseq - start + 1;
-                    }
-                    std::cout << (char*) m_read->data << '\t'
-                              << fimo_start << '\t'
-                              << fimo_stop << '\t'
-                              << (fimo_reverse ? '-' : '+') << '\t';
-                }
+            read_count         += other.read_count;
+            unmapped_count     += other.unmapped_count;
+            read_hit_count     += other.read_hit_count;
+            unmapped_hit_count += other.unmapped_hit_count;
+            total_hit_count    += other.total_hit_count;
+            return *this;
+        }
+    };
+
+    // The results of scoring a chunk of reads, for writing in read order.
+    struct ChunkResults
+    {
+        Counts counts;
+        std::vector<size_t> hits; // indexes of the reads with at least one hit
+        std::string printed;      // fimo style lines for the hits, if printing
+
+        void clear()
+        {
+            counts = Counts();
+            hits.clear();
+            printed.clear();
+        }
+    };
 
-                std::cout.precision(6);
-                std::cout << score.score() << '\t';
-                std::cout.precision(3);
+    // Scores the chunk's reads into results; many chunks can be scored at once.
+    void score(const BamReadChunk& chunk, ChunkResults& results) const
+    {
+        ChunkScorer(*this, chunk, results).score_chunk();
+    }
 
-                std::cout << score.pvalue() << '\t'
-                          << '\t' // omit q-value for now
-                          << score << std::endl;
+    // Prints the results, writes the hit reads and adds to the summary counts.
+    // Must be called for each chunk in read order, one chunk at a time.
+    void write(const BamReadChunk& chunk, const ChunkResults& results)
+    {
+        m_counts += results.counts;
+        if (!results.printed.empty())
+        {
+            std::cout << results.printed;
+
+            // the summary printed by the destructor has always used the precision left by the last hit
+            std::cout.precision(3);
+        }
+        if (m_output)
+        {
+            for (size_t i : results.hits)
+            {
+                bam_write1(m_output, &chunk.reads[i].bam);
             }
         }
     }
 
 private:
 
-    struct BamAllocator
+    // A bam interval [begin, end) on chromosome tid, with the end of the previous
+    // interval on the same chromosome (or 0).
+    struct Interval
+    {
+        int tid;
+        int begin;
+        int end;
+        int previous_end;
+    };
+
+    // A chunk of reads passed through the pipeline, along with the scoring results
+    // that the output stage consumes in order. Region chunks start with just the
+    // intervals, and the reads are fetched by the parallel stage. Whole bam chunks
+    // start with just the compressed blocks, and the reads are parsed once inflated.
+    struct ReadChunk : BamReadChunk
     {
-        BamAllocator() { }
+        std::vector<Interval> intervals;
+        BgzfChunk blocks;
+        ChunkResults results;
 
-        ~BamAllocator()
+        void clear()
         {
-            // note: we are not calling bam_destroy1(), which was just free()ing the
-            // bam and the bam data. since the vectors manage the bam memory,
-            // we just need to free the bam dat, but if samtools changes this will
-            // likely break
-            free(bam.data);
+            BamReadChunk::clear();
+            intervals.clear();
+            blocks.clear();
+            results.clear();
         }
-
-        // note: we are not calling bam_init1(), which was just calloc()ing,
-        // if that ever changes this will likely break
-        bam1_t bam;
     };
-    
-    typedef std::shared_ptr < std::vector < BamAllocator > > BamVecPtr;
-    
-    void score_thread_actual()
-    {
-        BamVecPtr vec;
 
-        int scored_total = 0;
-        while(m_reading || m_queued_reads.size() > 0)
+    // ScoreConsumer for the reads of a single chunk; one per chunk, so the parallel
+    // scoring stage shares nothing but the (read only) matrices and header.
+    class ChunkScorer
+    {
+    public:
+        ChunkScorer(const BamScorer& scorer, const BamReadChunk& chunk, ChunkResults& results)
+        :
+            m_scorer(scorer),
+            m_chunk(chunk),
+            m_results(results),
+            m_scanner(scorer.m_motifs),
+            m_read(0),
+            m_sequence_decoded(false)
+        {}
+
+        void score_chunk()
         {
-            m_queue_mutex.lock();
-            if(m_queued_reads.empty())
+            for (size_t i = 0; i < m_chunk.size; ++i)
             {
-                m_queue_mutex.unlock();
-                //std::this_thread::yield();
-                continue;
+                score_read(i);
             }
+            m_results.printed = m_printed.str();
+        }
+
+        void operator()(const std::string& motif_name,
+                        size_t start,
+                        size_t stop,
+                        const ScoreMatrix::Score& score)
+        {
+            // only hits are scanned through to here, see MotifSet
+            if (score.pvalue() < MAX_HIT_PVALUE)
+            {
+                ++m_results.counts.total_hit_count;
+                if (m_scorer.m_print_style != None)
+                {
+                    if (!m_sequence_decoded)
+                    {
+                        decode_sequence();
+                    }
 
-            vec = m_queued_reads.front();
-            m_queued_reads.pop_front();
-            
-            m_queue_mutex.unlock();
+                    m_printed << motif_name << '\t';
+                    if (m_scorer.m_print_style == MappedFimo)
+                    {
+                        const char* chromosome = m_read->core.tid >= 0 ? m_scorer.m_header->target_name[m_read->core.tid] : "*";
+                        m_printed << (unmapped(*m_read) ? "un" : "") << "mapped:" << chromosome << ":" << (char*) m_read->data << '\t'
+                                  << m_read->core.pos + start << '\t'
+                                  << m_read->core.pos + stop << '\t'
+                                  << (score.is_reverse_complement() ? '-' : '+') << '\t';
+                    }
+                    else // m_print_style == Fimo
+                    {
+                        // fimo reading a fasta has no way of determining if a sequence is reverse or forward mapping,
+                        // so if read is reverse complemented then we should reverse the direction to get perfect fimo matching.
+                        bool fimo_reverse = score.is_reverse_complement();
+                        size_t fimo_start = start;
+                        size_t fimo_stop  = stop;
+                        if (reverse_complemented(*m_read))
+                        {
+                            fimo_reverse = !fimo_reverse;
+                            fimo_start = m_read->core.l_qseq - stop  + 1;
+                            fimo_stop  = m_read->core.l_qseq - start + 1;
+                        }
+                        m_printed << (char*) m_read->data << '\t'
+                                  << fimo_start << '\t'
+                                  << fimo_stop << '\t'
+                                  << (fimo_reverse ? '-' : '+') << '\t';
+                    }
+
+                    m_printed.precision(6);
+                    m_printed << score.score() << '\t';
+                    m_printed.precision(3);
+
+                    m_printed << score.pvalue() << '\t'
+                              << '\t' // omit q-value for now
+                              << score << '\n';
+                }
+            }
+        }
 
-            for(size_t i = 0; i < vec->size(); i++)
+    private:
+        void decode_sequence()
+        {
+            const uint8_t *s = bam1_seq(m_read);
+            for (int i = 0; i < m_read->core.l_qseq; ++i)
             {
-                scored_total++;
-                BamAllocator &raii_read = (*vec)[i];
-                score_read(&raii_read.bam);
+                m_sequence[i] = bam_nt16_rev_table[bam1_seqi(s, i)];
             }
+            m_sequence_decoded = true;
         }
-    }
-    
-    void score_all_reads()
-    {
-        // todo: the unmapped reads seem to all be at the very end of the loop.
-        //       to speed up scoring just the unmapped reads, we could probably skip to the last indexed read and start there.
-        //       although, that might be relying on undocumented behavior that could change in future releases, so maybe that is a bad idea.
-        //       also, there seems to be some mechanism for storing unmapped reads that correspond to a chromosome, so that is probably a doubly bad idea.
-        //       see https://www.biostars.org/p/86405/#86439
-
-        BamVecPtr vec(new std::vector < BamAllocator >);
-        size_t vec_count = 0;
-        vec->resize(MAX_THREAD_CHUNK);
-        memset(&((*vec)[0]), 0, MAX_THREAD_CHUNK * sizeof(BamAllocator));
-
-        int total_read = 0;
-        int vec_total = 0;
-        while(1)
-        {
-            bool break_main = false;
-            
-            m_queue_mutex.lock();
-            if(m_queued_reads.size() > MAX_QUEUED_READS)
+
+        void score_read(size_t read_index)
+        {
+            const bam1_t* read = &m_chunk.reads[read_index].bam;
+
+            ++m_results.counts.read_count;
+            if (unmapped(*read))
             {
-                m_queue_mutex.unlock();
-                //std::this_thread::yield();
-                continue;
+                ++m_results.counts.unmapped_count;
             }
-            m_queue_mutex.unlock();
-            
-            while(vec_count < MAX_THREAD_CHUNK)
+            else if (m_scorer.m_only_score_unmapped)
             {
-                int ret;
-                ret = bam_read1(m_input, &(*vec)[vec_count].bam);
-                if(ret < 0)
+                return;
+            }
+
+            const bam1_core_t *c = &read->core;
+            uint8_t *s = bam1_seq(read);
+
+            // [s, s+c->l_qseq) is the sequence, with two bases packed into each byte.
+            // The 4 bit codes are scored through nt16_alphabet_index, and the sequence
+            // characters are only decoded if a hit needs printing.
+
+            if (m_indexes.size() != size_t(c->l_qseq))
+            {
+                // assuming that all reads are uniform length, this will only happen once per chunk
+                m_indexes.resize(c->l_qseq);
+                m_sequence = std::string(c->l_qseq, ' ');
+            }
+            for (int i = 0; i < c->l_qseq; ++i)
+            {
+                m_indexes[i] = nt16_alphabet_index(bam1_seqi(s, i));
+            }
+            m_sequence_decoded = false;
+
+            const size_t hit_count_before_this_read = m_results.counts.total_hit_count;
+            m_read = read;
+            m_scanner.scan(m_indexes, [&](size_t matrix_index, size_t begin, unsigned scaled_score)
+            {
+                const ScoreMatrix& matrix = m_scorer.m_matrices[matrix_index];
+                const size_t end = begin + matrix.matrix().size();
+                (*this)(matrix.name(), begin + 1, end, matrix.make_score(m_sequence, begin, end, scaled_score));
+            });
+            if (m_results.counts.total_hit_count > hit_count_before_this_read)
+            {
+                ++m_results.counts.read_hit_count;
+                if (unmapped(*read))
                 {
-                    break_main = true;
-                    break;
+                    ++m_results.counts.unmapped_hit_count;
                 }
-                
-                vec_count++;
-                total_read++;
+                m_results.hits.push_back(read_index);
             }
+        }
 
-            // since the vector is allocated in big chunks, we need to remove the
-            // tail end of the vector when we reach EOF
-            if(vec_count != vec->size())
-                vec->erase(vec->begin() + vec_count, vec->end());
-            vec_total += vec->size();
-            m_queue_mutex.lock();
-            m_queued_reads.push_back(vec);
-            m_queue_mutex.unlock();
-            
-            vec.reset(new std::vector < BamAllocator >);
-            vec_count = 0;
-            vec->resize(MAX_THREAD_CHUNK);
-            memset(&((*vec)[0]), 0, MAX_THREAD_CHUNK * sizeof(BamAllocator));
-
-            if(break_main)
-            {
-                break;
-            }            
+        const BamScorer& m_scorer;
+        const BamReadChunk& m_chunk;
+        ChunkResults& m_results;
+        MotifSet::Scanner m_scanner;
+        const bam1_t* m_read;
+        std::vector<uint8_t> m_indexes;
+        std::string m_sequence; // only valid if m_sequence_decoded
+        bool m_sequence_decoded;
+        std::ostringstream m_printed;
+    };
+
+    // Opens the output bam and prints the fimo style header, if needed.
+    void start_output()
+    {
+        if (!m_bam_output_file_path.empty())
+        {
+            m_output = bam_open(m_bam_output_file_path.c_str(), "w");
+            bam_header_write(m_output, m_header);
         }
 
+        if (m_print_style != None)
+        {
+            std::cout << "#pattern name\tsequence name\tstart\tstop\tstrand\tscore\tp-value\tq-value\tmatched sequence" << std::endl;
+        }
     }
 
-    void score_regions(const std::string& region_file_path)
+    void score_reads()
     {
-        const std::string region_extension = boost::filesystem::extension(region_file_path).erase(0, 1);
-        for (const Region& region : parse_regions(region_file_path, region_extension, 0))
+        const size_t max_chunks_in_flight = CHUNKS_PER_THREAD * tbb::task_scheduler_init::default_num_threads();
+        bool reading = true;
+        ChunkPool<ReadChunk> chunks;
+
+        tbb::parallel_pipeline(max_chunks_in_flight,
+            tbb::make_filter<void, ReadChunk*>(tbb::filter::serial_in_order,
+                [&](tbb::flow_control& fc) -> ReadChunk*
+                {
+                    ReadChunk* chunk = 0;
+                    if (reading)
+                    {
+                        chunk = chunks.acquire();
+                        StageTimer timer(Stage::fetch);
+                        if (m_read_ahead)
+                        {
+                            reading = m_read_ahead->read(chunk->blocks);
+                        }
+                        else
+                        {
+                            reading = m_score_regions ? next_intervals(*chunk) : read_unmapped_reads(*chunk);
+                            count_fetched(*chunk);
+                        }
+                    }
+                    // skipped reads are counted without being kept, so a chunk may have just counts
+                    if (chunk == 0 || (chunk->size == 0 && chunk->intervals.empty() && chunk->blocks.block_ends.empty()
+                                       && chunk->results.counts.read_count == 0))
+                    {
+                        if (chunk)
+                        {
+                            chunks.release(chunk);
+                        }
+                        chunk = 0;
+                        fc.stop();
+                    }
+                    return chunk;
+                })
+            & tbb::make_filter<ReadChunk*, ReadChunk*>(tbb::filter::parallel,
+                [&](ReadChunk* chunk) -> ReadChunk*
+                {
+                    if (m_read_ahead)
+                    {
+                        StageTimer timer(Stage::inflate);
+                        BgzfReadAhead::inflate(chunk->blocks);
+                    }
+                    return chunk;
+                })
+            & tbb::make_filter<ReadChunk*, ReadChunk*>(tbb::filter::serial_in_order,
+                [&](ReadChunk* chunk) -> ReadChunk*
+                {
+                    if (m_read_ahead)
+                    {
+                        StageTimer timer(Stage::fetch);
+                        m_read_ahead->parse(chunk->blocks, *chunk);
+                        count_fetched(*chunk);
+                    }
+                    return chunk;
+                })
+            & tbb::make_filter<ReadChunk*, ReadChunk*>(tbb::filter::parallel,
+                [&](ReadChunk* chunk) -> ReadChunk*
+                {
+                    if (m_score_regions)
+                    {
+                        fetch_reads(*chunk);
+                    }
+                    StageTimer timer(Stage::score);
+                    score(*chunk, chunk->results);
+                    return chunk;
+                })
+            & tbb::make_filter<ReadChunk*, void>(tbb::filter::serial_in_order,
+                [&](ReadChunk* chunk)
+                {
+                    {
+                        StageTimer timer(Stage::write);
+                        write(*chunk, chunk->results);
+                    }
+                    chunks.release(chunk);
+                }));
+
+        if (m_read_ahead)
         {
-            // todo: don't I just need to parse_region once per chromosome to get the tid? perhaps there is a faster way to do this without parsing a whole region string?
-            // todo: consider adding a util function to do this and remove duplicate code in bamliquidator.cpp
-            std::stringstream coord;
-            coord << region.chromosome << ':' << region.start << '-' << region.stop;
+            m_read_ahead->finish();
+        }
+        std::cout.flush();
+    }
 
-            int ref,beg,end;
-            const int region_parse_rc = bam_parse_region(m_header, coord.str().c_str(), &ref, &beg, &end);
-            if (region_parse_rc != 0)
+    // Uses the index to score just the unmapped reads without reading every read. The index has
+    // the span of each reference's reads in the bam and how many of them are mapped and unmapped,
+    // so the references without unmapped reads (placed next to their mapped mates) are skipped,
+    // the rest are scanned by flag, and then everything after the last reference's reads is read,
+    // which is where the unplaced unmapped reads are. Reads are read normally without the stats.
+    void plan_unmapped_scan(const std::string& bam_input_file_path)
+    {
+        std::vector<ReferenceIndexStats> stats;
+        if (!read_index_stats(bam_input_file_path, stats) || int(stats.size()) != m_header->n_targets)
+        {
+            return;
+        }
+        for (const ReferenceIndexStats& reference : stats)
+        {
+            if (reference.has_reads)
             {
-                std::stringstream error_msg;
-                error_msg << "bam_parse_region failed with return code " << region_parse_rc;
-                throw std::runtime_error(error_msg.str());
+                m_references.push_back(reference);
             }
-            if(ref<0)
+        }
+        std::sort(m_references.begin(), m_references.end(), [](const ReferenceIndexStats& a, const ReferenceIndexStats& b) {
+            return a.begin < b.begin;
+        });
+        m_scan_unmapped = true;
+    }
+
+    // Fills the chunk with the next unmapped reads, returning false once there are none left. The
+    // mapped reads that are skipped are still counted, so the summary is the same as reading them.
+    bool read_unmapped_reads(ReadChunk& chunk)
+    {
+        while (chunk.size < MAX_THREAD_CHUNK)
+        {
+            if (!m_at_unplaced_reads && m_reference_reads_left == 0)
             {
-                // this bam doesn't have this chromosome
+                seek_next_reference(chunk.results.counts);
                 continue;
             }
-
-            const int fetch_rc = bam_fetch(m_input, m_index, ref, beg, end, this, bam_fetch_func);
-            if (fetch_rc != 0)
+            const int read_rc = read_if_unmapped(chunk.next_read());
+            if (read_rc < 0)
             {
-                std::stringstream error_msg;
-                error_msg << "bam_fetch failed with return code " << fetch_rc;
-                throw std::runtime_error(error_msg.str());
+                return false;
+            }
+            if (m_reference_reads_left > 0)
+            {
+                --m_reference_reads_left;
+            }
+            if (read_rc > 0)
+            {
+                ++chunk.size;
+            }
+            else if (chunk.next_read().core.tid < 0)
+            {
+                // a mapped read without a reference isn't in the index's counts
+                ++chunk.results.counts.read_count;
             }
         }
+        return true;
     }
 
-    void score_read(const bam1_t *read)
+    // Seeks to the next reference with unmapped reads, or to the end of the last reference's reads,
+    // adding the mapped reads of the references passed over to counts.
+    void seek_next_reference(Counts& counts)
     {
-        ++m_read_count;
-        if (unmapped(*read))
+        while (m_next_reference + 1 < m_references.size())
         {
-            ++m_unmapped_count;
+            const ReferenceIndexStats& reference = m_references[m_next_reference++];
+            counts.read_count += reference.mapped;
+            if (reference.unmapped > 0)
+            {
+                bam_seek(m_input, reference.begin, SEEK_SET);
+                m_reference_reads_left = reference.mapped + reference.unmapped;
+                return;
+            }
         }
-        else if (m_only_score_unmapped)
+
+        // The last reference is scanned through to the end of the bam, from its last window if
+        // all of its reads are mapped. Without any references the reads start after the header.
+        if (m_next_reference < m_references.size())
         {
-            return;
+            const ReferenceIndexStats& reference = m_references[m_next_reference++];
+            counts.read_count += reference.mapped;
+            bam_seek(m_input, reference.unmapped > 0 ? reference.begin : reference.last_window_begin, SEEK_SET);
+        }
+        m_at_unplaced_reads = true;
+    }
+
+    // Reads the next read's core, but the rest of the read only if it is unmapped, otherwise the
+    // rest is skipped without being parsed into the read. Besides skipping, this is just like
+    // bam_read1 (on a little endian machine). Returns 1 for an unmapped read, 0 for a skipped
+    // read, and -1 at the end of the bam.
+    int read_if_unmapped(bam1_t& read)
+    {
+        int32_t block_length;
+        uint32_t x[8];
+        if (bam_read(m_input, &block_length, 4) != 4 || bam_read(m_input, x, sizeof(x)) != sizeof(x))
+        {
+            return -1;
         }
+        bam1_core_t& core = read.core;
+        set_read_core(x, core);
 
-        const bam1_core_t *c = &read->core;
-        uint8_t *s = bam1_seq(read);
+        const int data_length = block_length - int(sizeof(x));
+        if (!unmapped(read))
+        {
+            m_skipped_data.resize(std::max<size_t>(m_skipped_data.size(), data_length));
+            return bam_read(m_input, m_skipped_data.data(), data_length) == data_length ? 0 : -1;
+        }
 
-        // [s, s+c->l_qseq) is the sequence, with two bases packed into each byte.
-        // I bet we could directly search that instead of first copying into a string
-        // but lets get something simple working first. An intermediate step could be
-        // to search integers without using bam_nt16_rev_table (and I wouldn't have
-        // to worry about the packing complexity).
+        reserve_read_data(read, data_length);
+        if (bam_read(m_input, read.data, read.data_len) != read.data_len)
+        {
+            return -1;
+        }
+        set_read_aux_length(read);
+        return 1;
+    }
 
-        if (m_sequence.size() != size_t(c->l_qseq))
+    // Gives the chunk the next REGION_CHUNK_LENGTH or so of intervals to fetch, returning false
+    // once there are no intervals left.
+    bool next_intervals(ReadChunk& chunk)
+    {
+        size_t length = 0;
+        while (m_next_interval < m_intervals.size() && length < REGION_CHUNK_LENGTH)
         {
-            // assuming that all reads are uniform length, this will only happen once
-            m_sequence = std::string(c->l_qseq, ' ');
+            const Interval& interval = m_intervals[m_next_interval++];
+            chunk.intervals.push_back(interval);
+            length += interval.end - interval.begin;
         }
-        for (int i = 0; i < c->l_qseq; ++i)
+        return m_next_interval < m_intervals.size();
+    }
+
+    // Fetches the reads for the chunk's intervals with this thread's own bam handle,
+    // skipping the reads that were already fetched for the previous interval.
+    void fetch_reads(ReadChunk& chunk)
+    {
+        const BamReader& reader = m_readers->local(); // opened (the first time) outside the fetch stage
+        StageTimer timer(Stage::fetch);
+        for (const Interval& interval : chunk.intervals)
         {
-            m_sequence[i] = bam_nt16_rev_table[bam1_seqi(s, i)];
+            bam_iter_t iterator = bam_iter_query(reader.index(), interval.tid, interval.begin, interval.end);
+            bam1_t* read = &chunk.next_read();
+            while (bam_iter_read(reader.file(), iterator, read) >= 0)
+            {
+                // the read overlaps this interval, so it also overlaps the previous interval exactly when it
+                // starts before the previous interval ends (the intervals are sorted and disjoint)
+                if (read->core.pos >= interval.previous_end)
+                {
+                    ++chunk.size;
+                    read = &chunk.next_read();
+                }
+            }
+            bam_iter_destroy(iterator);
         }
-        
-        const size_t hit_count_before_this_read = m_total_hit_count;
-        m_read = read;
-        for (const auto& matrix : m_matrices)
+        count_fetched(chunk);
+    }
+
+    // Sorts and merges the regions into disjoint intervals, split so no interval is longer than
+    // REGION_CHUNK_LENGTH, so each read overlapping the regions is scored exactly once.
+    std::vector<Interval> region_intervals(const std::string& region_file_path)
+    {
+        const std::string region_extension = boost::filesystem::extension(region_file_path).erase(0, 1);
+
+        std::vector<Interval> regions;
+        for (const Region& region : parse_regions(region_file_path, region_extension, 0))
         {
-            matrix.score(m_sequence, *this);
+            // todo: don't I just need to parse_region once per chromosome to get the tid? perhaps there is a faster way to do this without parsing a whole region string?
+            // todo: consider adding a util function to do this and remove duplicate code in bamliquidator.cpp
+            std::stringstream coord;
+            coord << region.chromosome << ':' << region.start << '-' << region.stop;
+
+            Interval interval;
+            const int region_parse_rc = bam_parse_region(m_header, coord.str().c_str(), &interval.tid, &interval.begin, &interval.end);
+            if (region_parse_rc != 0)
+            {
+                std::stringstream error_msg;
+                error_msg << "bam_parse_region failed with return code " << region_parse_rc;
+                throw std::runtime_error(error_msg.str());
+            }
+            if (interval.tid < 0)
+            {
+                // this bam doesn't have this chromosome
+                continue;
+            }
+            regions.push_back(interval);
         }
-        if (m_total_hit_count > hit_count_before_this_read)
+
+        std::sort(regions.begin(), regions.end(), [](const Interval& a, const Interval& b) {
+            return a.tid < b.tid || (a.tid == b.tid && a.begin < b.begin);
+        });
+
+        std::vector<Interval> intervals;
+        for (size_t i = 0; i < regions.size(); )
         {
-            ++m_read_hit_count;
-            if (unmapped(*read))
+            Interval merged = regions[i];
+            for (++i; i < regions.size() && regions[i].tid == merged.tid && regions[i].begin <= merged.end; ++i)
             {
-                ++m_unmapped_hit_count;
+                merged.end = std::max(merged.end, regions[i].end);
             }
-            if (m_output)
+
+            for (int begin = merged.begin; begin < merged.end; begin += REGION_CHUNK_LENGTH)
             {
-                // TODO: if we want to run multiple score threads in parallel, we will need to
-                // add an output queue similar to input queue here
-                bam_write1(m_output, read);
+                Interval interval = merged;
+                interval.begin = begin;
+                interval.end = std::min<int>(merged.end, begin + REGION_CHUNK_LENGTH);
+                interval.previous_end = (intervals.empty() || intervals.back().tid != interval.tid) ? 0 : intervals.back().end;
+                intervals.push_back(interval);
             }
         }
+        return intervals;
     }
 
-    static int bam_fetch_func(const bam1_t* read, void* handle)
+private:
+    static bam_index_t* load_index(const std::string& bam_file_path)
     {
-        // TODO: region reads are not yet threaded
-        BamScorer& scorer = *static_cast<BamScorer*>(handle);
-        scorer.score_read(read);
-        
-        return 0;
+        StageTimer timer(Stage::index_load);
+        return bam_index_load(bam_file_path.c_str());
     }
 
-private:
     bamFile m_input;
     const std::string m_bam_output_file_path;
     bamFile m_output;
     bam_header_t* m_header;
     bam_index_t* m_index;
     const std::vector<ScoreMatrix>& m_matrices;
+    const MotifSet m_motifs;
     const PrintStyle m_print_style;
     const bool m_only_score_unmapped;
-    const bam1_t* m_read;
-    size_t m_read_count;
-    size_t m_unmapped_count;
-    size_t m_read_hit_count;
-    size_t m_unmapped_hit_count;
-    size_t m_total_hit_count;
-    std::string m_sequence;
-    std::deque < BamVecPtr > m_queued_reads;
-    std::mutex m_queue_mutex;
-    bool m_reading;
+    const bool m_score_regions;
+    std::vector<Interval> m_intervals;
+    size_t m_next_interval;
+    std::unique_ptr<ThreadBamReaders> m_readers; // only for scoring regions
+    std::unique_ptr<BgzfReadAhead> m_read_ahead; // only for scoring the whole bam
+
+    // only for scanning unmapped reads with the index, see plan_unmapped_scan
+    bool m_scan_unmapped = false;
+    std::vector<ReferenceIndexStats> m_references; // the references with reads, in bam order
+    size_t m_next_reference = 0;
+    uint64_t m_reference_reads_left = 0;
+    bool m_at_unplaced_reads = false;
+    std::vector<char> m_skipped_data;
+    Counts m_counts;
 };
 
 }
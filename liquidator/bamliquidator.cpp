@@ -1,9 +1,10 @@
 #include "bamliquidator.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <samtools/sam.h>
 
-#include <deque>
+#include <algorithm>
 #include <stdexcept>
 #include <sstream>
 
@@ -30,21 +31,6 @@
    THE SOFTWARE. 
  */
 
-struct ReadItem
-{
-  unsigned int start;
-  /* read stop is start + strlen(seq)
-  this *stop* will only be used for computing density
-  will not be reported to js for bed plotting
-  the actual stop need to be determined by cigar
-  */
-  unsigned int stop;
-  uint32_t flag; // flag from bam
-  char strand;
-  std::vector<uint32_t> cigar;
-};
-
-
 int intMin(int a, int b)
 {
   if(a < b) return a;
@@ -57,44 +43,30 @@ int intMax(int a, int b)
   return b;
 }
 
-
-
-struct UserData
-{
-  std::deque<ReadItem> readItems;
-  char strand;
-  unsigned int extendlen;
-};
-
-
-
-
-static int bam_fetch_func(const bam1_t* b,void* data)
+// Sets start/stop to the span of the read used for computing density, returning false if
+// the read should not be counted for the strand.
+// The read stop is start + the read length (from the cigar) plus any extension.
+// This *stop* is only used for computing density -- the actual stop of the alignment
+// needs to be determined by the cigar.
+static bool density_span(const bam1_t* b, char strand, unsigned int extendlen,
+                         unsigned int& start, unsigned int& stop)
 {
-  if (b->core.tid < 0) return 0;
-
-  UserData *udata=(UserData *)data;
-
   const bam1_core_t* c = &b->core;
 
-  char strand= (c->flag&BAM_FREVERSE)?'-':'+';
-  if(udata->strand=='+')
+  const char read_strand = (c->flag&BAM_FREVERSE)?'-':'+';
+  if(strand=='+')
   {
-    if(strand!='+') return 0;
+    if(read_strand!='+') return false;
   }
-  else if(udata->strand=='-')
+  else if(strand=='-')
   {
-    if(strand!='-') return 0;
+    if(read_strand!='-') return false;
   }
 
-  ReadItem r;
-  r.strand=strand;
-
-  uint32_t* cigar = bam1_cigar(b);
+  const uint32_t* cigar = bam1_cigar(b);
 
   // get read length
   int i, readlen;
-  if (b->core.tid < 0) return 0;
   for (i = readlen = 0; i < c->n_cigar; ++i)
   {
     int op = cigar[i]&0xf;
@@ -102,35 +74,51 @@ static int bam_fetch_func(const bam1_t* b,void* data)
       readlen += cigar[i]>>4;
   }
 
-  r.cigar = std::vector<uint32_t>(cigar, cigar+c->n_cigar);
-
-  r.start=c->pos;
-  r.stop=c->pos+readlen;
-
-  //printf("%d\t%d\t%c\t", r.start, r.stop, strand);
+  start=c->pos;
+  stop=c->pos+readlen;
 
   // extend
-  if(udata->extendlen>0)
+  if(extendlen>0)
   {
-    if(strand=='+')
+    if(read_strand=='+')
     {
-      r.stop+=udata->extendlen;
+      stop+=extendlen;
     }
     else
     {
-      r.start=intMax(0,r.start-udata->extendlen);
+      start=intMax(0,start-extendlen);
     }
   }
 
-  //printf("%d\t%d\n", r.start, r.stop);
+  return true;
+}
 
-  r.flag=c->flag;
-  udata->readItems.push_back(r);
-  return 0;
+// With metrics enabled, fetch passes each read through this to count it before calling func,
+// adding the counts to the metrics once per fetch.
+struct CountedFetch
+{
+  void* data;
+  bam_fetch_f func;
+  uint64_t reads;
+  uint64_t bytes;
+};
+
+static int counted_fetch_func(const bam1_t* b, void* data)
+{
+  CountedFetch* counted = (CountedFetch*) data;
+  ++counted->reads;
+  counted->bytes += sizeof(int32_t) + 32 + b->data_len; // the block length, core and data, as in the bam
+  return counted->func(b, counted->data);
 }
 
-std::deque<ReadItem> bamQuery_region(const samfile_t* fp, const bam_index_t* idx, const std::string& coord, char strand, unsigned int extendlen)
+// Calls func for every read overlapping [start, stop) of the chromosome (with samtools
+// region semantics, so really [start-1, stop)), returning false if the bam doesn't
+// have the chromosome.
+static bool fetch(const samfile_t* fp, const bam_index_t* idx, const std::string& chromosome,
+                  unsigned int start, unsigned int stop, void* data, bam_fetch_f func)
 {
+  const std::string coord = chromosome + ':' + std::to_string(start) + '-' + std::to_string(stop);
+
   // will not fill chromidx
   int ref,beg,end;
   int rc = bam_parse_region(fp->header,coord.c_str(),&ref,&beg,&end);
@@ -142,15 +130,157 @@ std::deque<ReadItem> bamQuery_region(const samfile_t* fp, const bam_index_t* idx
   }
   if(ref<0)
   {
-    return std::deque<ReadItem>();
+    return false;
   }
-  UserData d;
-  d.strand=strand;
-  d.extendlen=extendlen;
-  bam_fetch(fp->x.bam,idx,ref,beg,end,&d,bam_fetch_func);
-  return d.readItems;
+
+  liquidator::StageTimer timer(liquidator::Stage::fetch);
+  if (liquidator::Metrics::enabled())
+  {
+    CountedFetch counted = {data, func, 0, 0};
+    bam_fetch(fp->x.bam,idx,ref,beg,end,&counted,counted_fetch_func);
+    liquidator::add_count(liquidator::Counter::reads_fetched, counted.reads);
+    liquidator::add_count(liquidator::Counter::bam_bytes_decoded, counted.bytes);
+  }
+  else
+  {
+    bam_fetch(fp->x.bam,idx,ref,beg,end,data,func);
+  }
+  return true;
+}
+
+struct UserData
+{
+  double* counts;
+  unsigned int start;
+  unsigned int pieceLength;
+  unsigned int spnum;
+  char strand;
+  unsigned int extendlen;
+
+  // spanned[i] is the number of reads that completely span piece i, stored as a
+  // difference array (so spanned[i] - spanned[i-1]) to keep each read constant time
+  std::vector<double> spanned;
+};
+
+static int bam_fetch_func(const bam1_t* b,void* data)
+{
+  if (b->core.tid < 0) return 0;
+
+  UserData *udata=(UserData *)data;
+
+  unsigned int read_start, read_stop;
+  if (!density_span(b, udata->strand, udata->extendlen, read_start, read_stop)) return 0;
+
+  // collapse this read onto the density counter.
+
+  // as Charles suggested, add the fraction of the read (overlapping with the bin)
+  // instead of just counting the read.  Since the pieces are uniform, the first and last
+  // pieces overlapping the read can be computed directly.
+  const unsigned int pieceLength = udata->pieceLength;
+  if (pieceLength == 0) return 0;
+  const int start = intMax(read_start, udata->start);
+  const int stop = intMin(read_stop, udata->start + pieceLength*udata->spnum);
+  if (start >= stop) return 0;
+
+  const unsigned int first = (start - udata->start) / pieceLength;
+  const unsigned int last = (stop - 1 - udata->start) / pieceLength;
+  if (first == last)
+  {
+    udata->counts[first] += stop-start;
+  }
+  else
+  {
+    udata->counts[first] += udata->start + pieceLength*(first+1) - start;
+    udata->counts[last] += stop - (udata->start + pieceLength*last);
+    if (last - first > 1)
+    {
+      udata->spanned[first+1] += 1;
+      udata->spanned[last] -= 1;
+    }
+  }
+  return 0;
+}
+
+struct BinsData
+{
+  std::vector<double> counts;
+  unsigned int first_bin;
+  unsigned int bin_size;
+  char strand;
+  unsigned int extendlen;
+};
+
+static int bam_fetch_bins_func(const bam1_t* b, void* data)
+{
+  BinsData *bdata=(BinsData *)data;
+  liquidate_read_bins(b, bdata->first_bin, bdata->counts.size(), bdata->bin_size, bdata->strand, bdata->extendlen,
+                      bdata->counts.data());
+  return 0;
 }
 
+struct StrandBinsData
+{
+  double* forward;
+  double* reverse;
+  unsigned int first_bin;
+  unsigned int bin_count;
+  unsigned int bin_size;
+  unsigned int extendlen;
+};
+
+static int bam_fetch_strand_bins_func(const bam1_t* b, void* data)
+{
+  StrandBinsData *sdata=(StrandBinsData *)data;
+  liquidate_read_strand_bins(b, sdata->first_bin, sdata->bin_count, sdata->bin_size, sdata->extendlen,
+                             sdata->forward, sdata->reverse);
+  return 0;
+}
+
+// A read fetched for liquidate_regions, with the span samtools uses for fetching it,
+// and the span used for computing density (for either strand)
+struct FetchedRead
+{
+  uint32_t pos;
+  uint32_t rend;
+  unsigned int start;
+  unsigned int stop;
+  char strand;
+};
+
+static FetchedRead fetched_read(const bam1_t* b, unsigned int extendlen)
+{
+  FetchedRead read;
+  density_span(b, '.', extendlen, read.start, read.stop);
+  read.pos = b->core.pos;
+  read.rend = b->core.n_cigar ? bam_calend(&b->core, bam1_cigar(b)) : read.pos + 1;
+  read.strand = (b->core.flag&BAM_FREVERSE)?'-':'+';
+  return read;
+}
+
+// Adds the read to the region, if fetching just the region would have fetched the read.
+static void count_read_in_region(const FetchedRead& read, LiquidatedRegion& region)
+{
+  // [region_begin, region_end) is how samtools parses the region (see fetch)
+  const uint32_t region_begin = region.start > 0 ? region.start - 1 : 0;
+  const uint32_t region_end = region.stop;
+  if (read.pos >= region_end || read.rend <= region_begin) return;
+  if (region.strand == '+' && read.strand != '+') return;
+  if (region.strand == '-' && read.strand != '-') return;
+
+  const int overlap_start = intMax(read.start, region.start);
+  const int overlap_stop = intMin(read.stop, region.stop);
+  if (overlap_start < overlap_stop)
+  {
+    region.count += overlap_stop - overlap_start;
+  }
+}
+
+static int bam_fetch_regions_func(const bam1_t* b, void* data)
+{
+  RegionsCounter *counter=(RegionsCounter *)data;
+  counter->count(b);
+  return 0;
+}
 
 std::vector<double> liquidate(const std::string& bamfile, const std::string& chromosome,
                               const unsigned int start, const unsigned int stop,
@@ -158,18 +288,21 @@ std::vector<double> liquidate(const std::string& bamfile, const std::string& chr
                               const unsigned int extendlen)
 {
 	samfile_t* fp=NULL;
-	fp=samopen(bamfile.c_str(),"rb",0);
-	if(fp == NULL)
-	{
-		throw std::runtime_error("samopen() error with " + bamfile);
-	}
-
   bam_index_t* bamidx=NULL;
-  bamidx=bam_index_load(bamfile.c_str());
-	if (bamidx == NULL)
-	{
-		throw std::runtime_error("bam_index_load() error with " + bamfile);
-	}
+  {
+    liquidator::StageTimer timer(liquidator::Stage::index_load);
+    fp=samopen(bamfile.c_str(),"rb",0);
+    if(fp == NULL)
+    {
+      throw std::runtime_error("samopen() error with " + bamfile);
+    }
+
+    bamidx=bam_index_load(bamfile.c_str());
+    if (bamidx == NULL)
+    {
+      throw std::runtime_error("bam_index_load() error with " + bamfile);
+    }
+  }
 
 	std::vector<double> counts = liquidate(fp, bamidx, chromosome, start, stop, strand, spnum, extendlen);
 
@@ -186,46 +319,211 @@ std::vector<double> liquidate(const samfile_t* fp, const bam_index_t* bamidx,
                               const unsigned int extendlen)
 {
   std::vector<double> data(spnum, 0);
-  
-  std::string coord;
-  {
-    std::stringstream ss;
-    ss << chromosome << ':' << start << '-' << stop;
-    coord = ss.str();
-  }
+  liquidate(fp, bamidx, chromosome, start, stop, strand, spnum, extendlen, data.data());
+  return data;
+}
 
-  /* fetch bed items for a region and compute density
-  only deal with coord, so use generic item
+void liquidate(const samfile_t* fp, const bam_index_t* bamidx,
+               const std::string& chromosome,
+               const unsigned int start, const unsigned int stop,
+               const char strand, const unsigned int spnum,
+               const unsigned int extendlen,
+               double* counts)
+{
+  /* fetch reads for a region and add their density straight into the counts,
+  so nothing is allocated per read
   */
   if (stop < start) throw std::runtime_error("liquidate called with stop < start");
   const unsigned pieceLength = (stop-start) / spnum;
 
-  unsigned startArr[spnum], stopArr[spnum];
-  for(unsigned int i=0; i<spnum; i++)
+  UserData d;
+  d.counts=counts;
+  d.start=start;
+  d.pieceLength=pieceLength;
+  d.spnum=spnum;
+  d.strand=strand;
+  d.extendlen=extendlen;
+  if (spnum > 2)
+  {
+    // only needed when a read can span a piece without starting or stopping in it
+    d.spanned.resize(spnum, 0);
+  }
+  fetch(fp, bamidx, chromosome, start, stop, &d, bam_fetch_func);
+
+  double spanned = 0;
+  for (size_t i=0; i < d.spanned.size(); ++i)
   {
-    startArr[i] = start + pieceLength*i;
-    stopArr[i] = start + pieceLength*(i+1);
+    spanned += d.spanned[i];
+    counts[i] += spanned*pieceLength;
   }
+}
+
+std::vector<double> liquidate_bins(const samfile_t* fp, const bam_index_t* bamidx,
+                                   const std::string& chromosome,
+                                   const unsigned int first_bin, const unsigned int bin_count,
+                                   const unsigned int bin_size, const char strand,
+                                   const unsigned int extendlen)
+{
+  if (bin_size == 0) throw std::runtime_error("liquidate_bins called with bin_size 0");
+
+  BinsData d;
+  d.counts = std::vector<double>(bin_count, 0);
+  d.first_bin = first_bin;
+  d.bin_size = bin_size;
+  d.strand = strand;
+  d.extendlen = extendlen;
+
+  if (bin_count == 0) return d.counts;
 
-  std::deque<ReadItem> items = bamQuery_region(fp,bamidx,coord,strand,extendlen);
+  // the union of the regions that liquidate() would fetch for each bin
+  fetch(fp, bamidx, chromosome, first_bin*bin_size, (first_bin+bin_count)*bin_size, &d, bam_fetch_bins_func);
+
+  return d.counts;
+}
+
+void liquidate_strand_bins(const samfile_t* fp, const bam_index_t* bamidx,
+                           const std::string& chromosome,
+                           const unsigned int first_bin, const unsigned int bin_count,
+                           const unsigned int bin_size, const unsigned int extendlen,
+                           double* forward, double* reverse)
+{
+  if (bin_size == 0) throw std::runtime_error("liquidate_strand_bins called with bin_size 0");
+  if (bin_count == 0) return;
+
+  StrandBinsData d;
+  d.forward = forward;
+  d.reverse = reverse;
+  d.first_bin = first_bin;
+  d.bin_count = bin_count;
+  d.bin_size = bin_size;
+  d.extendlen = extendlen;
+
+  // the same fetch as liquidate_bins
+  fetch(fp, bamidx, chromosome, first_bin*bin_size, (first_bin+bin_count)*bin_size, &d, bam_fetch_strand_bins_func);
+}
 
-  for(const ReadItem& item : items)
+void liquidate_regions(const samfile_t* fp, const bam_index_t* bamidx,
+                       const std::string& chromosome,
+                       LiquidatedRegion* regions, const size_t region_count,
+                       const unsigned int extendlen)
+{
+  if (region_count == 0) return;
+
+  unsigned int start = regions[0].start;
+  unsigned int stop = regions[0].stop;
+  for (size_t i=0; i < region_count; ++i)
+  {
+    if (regions[i].stop < regions[i].start) throw std::runtime_error("liquidate_regions called with stop < start");
+    if (regions[i].start < start) throw std::runtime_error("liquidate_regions called with unsorted regions");
+    stop = std::max(stop, regions[i].stop);
+  }
+
+  // The fetched reads are sorted by pos, so each is counted as it is fetched into just the regions
+  // still open, and nothing is kept per read no matter how many reads the regions span.
+  RegionsCounter counter(regions, region_count, extendlen);
+  fetch(fp, bamidx, chromosome, start, stop, &counter, bam_fetch_regions_func);
+}
+
+void liquidate_read_bins(const bam1_t* b, const unsigned int first_bin, const unsigned int bin_count,
+                         const unsigned int bin_size, const char strand, const unsigned int extendlen,
+                         double* counts)
+{
+  if (b->core.tid < 0 || bin_count == 0) return;
+
+  unsigned int start, stop;
+  if (!density_span(b, strand, extendlen, start, stop)) return;
+
+  // Fetching a single bin [bin_start, bin_stop) fetches the reads overlapping
+  // [bin_start-1, bin_stop), with samtools treating the read as spanning
+  // [pos, rend) where rend is computed just like below.  Only the bins
+  // that would have fetched this read may count it, otherwise an extended read
+  // would be counted in bins that its alignment doesn't reach.
+  const uint32_t pos = b->core.pos;
+  const uint32_t rend = b->core.n_cigar ? bam_calend(&b->core, bam1_cigar(b)) : pos + 1;
+  if (rend == 0) return;
+
+  const unsigned int last_bin = first_bin + bin_count - 1;
+  const unsigned int fetched_first = std::max(pos / bin_size, first_bin);
+  const unsigned int fetched_last = std::min(rend / bin_size, last_bin);
+
+  for (unsigned int bin = fetched_first; bin <= fetched_last; ++bin)
   {
-    // collapse this bed item onto the density counter
-    for(unsigned int i=0; i<spnum; i++)
+    const int overlap_start = intMax(start, bin*bin_size);
+    const int overlap_stop = intMin(stop, (bin+1)*bin_size);
+    if (overlap_start < overlap_stop)
     {
-      if(item.start > stopArr[i]) continue;
-      if(item.stop < startArr[i]) break;
-      int start=intMax(item.start,startArr[i]);
-      int stop=intMin(item.stop,stopArr[i]);
-      if(start<stop)
-      {
-        // as Charles suggested, add the fraction of the read (overlapping with the bin)
-        // instead of just counting the read
-        data[i] += stop-start;
-      }
+      counts[bin - first_bin] += overlap_stop - overlap_start;
     }
   }
+}
 
-  return data;
+void liquidate_read_strand_bins(const bam1_t* b, const unsigned int first_bin, const unsigned int bin_count,
+                                const unsigned int bin_size, const unsigned int extendlen,
+                                double* forward, double* reverse)
+{
+  const bool is_reverse = b->core.flag&BAM_FREVERSE;
+  liquidate_read_bins(b, first_bin, bin_count, bin_size, is_reverse ? '-' : '+', extendlen,
+                      is_reverse ? reverse : forward);
+}
+
+bool liquidate_read_span(const bam1_t* b, const unsigned int extendlen,
+                         char& strand, unsigned int& start, unsigned int& stop)
+{
+  if (b->core.tid < 0) return false;
+
+  strand = (b->core.flag&BAM_FREVERSE)?'-':'+';
+  return density_span(b, '.', extendlen, start, stop);
+}
+
+RegionsCounter::RegionsCounter(LiquidatedRegion* regions, const size_t region_count,
+                               const unsigned int extendlen):
+  regions(regions),
+  region_count(region_count),
+  extendlen(extendlen),
+  next_region(0),
+  last_pos(0)
+{
+  for (size_t i=0; i < region_count; ++i)
+  {
+    if (regions[i].stop < regions[i].start) throw std::runtime_error("RegionsCounter created with stop < start");
+    if (i > 0 && regions[i].start < regions[i-1].start) throw std::runtime_error("RegionsCounter created with unsorted regions");
+    regions[i].count = 0;
+  }
+}
+
+void RegionsCounter::count(const bam1_t* b)
+{
+  if (b->core.tid < 0) return;
+
+  const FetchedRead read = fetched_read(b, extendlen);
+  if (read.pos < last_pos) throw std::runtime_error("RegionsCounter given reads that are not sorted by position");
+  last_pos = read.pos;
+
+  // Since the reads are sorted by pos, a region ending at or before this read can't be fetched
+  // for this or any later read.  The regions not yet open start after every read so far
+  // ends (see count_read_in_region), so only the open regions need checking.
+  for (size_t i=0; i < open_regions.size(); )
+  {
+    if (regions[open_regions[i]].stop <= read.pos)
+    {
+      open_regions[i] = open_regions.back();
+      open_regions.pop_back();
+    }
+    else
+    {
+      ++i;
+    }
+  }
+  for (; next_region < region_count && regions[next_region].start <= read.rend; ++next_region)
+  {
+    if (regions[next_region].stop > read.pos)
+    {
+      open_regions.push_back(next_region);
+    }
+  }
+
+  for (size_t i : open_regions)
+  {
+    count_read_in_region(read, regions[i]);
+  }
 }
@@ -44,6 +44,128 @@ std::vector<double> liquidate(const samfile_t* bamfile, const bam_index_t* bamid
                               char strand, unsigned int spnum,
                               unsigned int extendlen);
 
+/**
+ * Same as above function, except the read counts are added to counts (which must have room
+ * for spnum values) instead of being returned.  No memory is allocated per read, so this
+ * variant should be preferred when calling liquidate many times, e.g. once per region.
+ */
+void liquidate(const samfile_t* bamfile, const bam_index_t* bamidx,
+               const std::string& chromosome,
+               unsigned int start, unsigned int stop,
+               char strand, unsigned int spnum,
+               unsigned int extendlen,
+               double* counts);
+
+/**
+ * Count the reads in bin_count consecutive bins, each bin_size base pairs long, starting
+ * at bin number first_bin of the chromosome (so the first bin starts at first_bin*bin_size).
+ * The counts are exactly the same as calling the above function with spnum 1 once per bin,
+ * but the reads are fetched from the bamfile once for all of the bins instead of once per
+ * bin, which is much faster when the bins are small.  This function has the same thread
+ * safety as the above function.
+ *
+ * @return the read counts, one per bin (all zeros if the bamfile lacks the chromosome)
+ */
+std::vector<double> liquidate_bins(const samfile_t* bamfile, const bam_index_t* bamidx,
+                                   const std::string& chromosome,
+                                   unsigned int first_bin, unsigned int bin_count,
+                                   unsigned int bin_size, char strand,
+                                   unsigned int extendlen);
+
+/**
+ * Same as liquidate_bins, except the forward ('+') and reverse ('-') strand counts are both
+ * counted from a single fetch, into forward and reverse (which must each have room for
+ * bin_count values, and are added to).  The counts for both strands ('.') are forward + reverse.
+ * This variant should be preferred when more than one strand is needed, since each fetch
+ * decodes every read in the range.
+ */
+void liquidate_strand_bins(const samfile_t* bamfile, const bam_index_t* bamidx,
+                           const std::string& chromosome,
+                           unsigned int first_bin, unsigned int bin_count,
+                           unsigned int bin_size, unsigned int extendlen,
+                           double* forward, double* reverse);
+
+/**
+ * The strand argument value of bamliquidator_bins, bamliquidator_regions and bamliquidator_pass
+ * that counts the forward, reverse and both strands at once (see liquidate_strand_bins).
+ */
+const char all_strands = '*';
+
+// A region counted by liquidate_regions
+struct LiquidatedRegion
+{
+  unsigned int start;
+  unsigned int stop;
+  char strand;
+  double count;
+};
+
+/**
+ * Sets the count of each region to the read count for the region's [start, stop) and strand.
+ * The counts are exactly the same as calling liquidate with spnum 1 once per region, but
+ * the reads are fetched from the bamfile once for the whole span of the regions instead of
+ * once per region, which is much faster when the regions overlap or are close together.
+ * Each read is counted as it is fetched (see RegionsCounter), so memory doesn't grow with
+ * the number of reads in the span.
+ * Regions must be sorted by start.  This function has the same thread safety as liquidate.
+ */
+void liquidate_regions(const samfile_t* bamfile, const bam_index_t* bamidx,
+                       const std::string& chromosome,
+                       LiquidatedRegion* regions, size_t region_count,
+                       unsigned int extendlen);
+
+/**
+ * Adds a single read to bin_count consecutive bins starting at bin number first_bin, exactly
+ * as liquidate_bins counts each read that it fetches.  This is for reads that are read some
+ * other way than fetching them, e.g. all the reads of a bam read once for many analyses,
+ * where the caller passes each read to the bins of its chromosome.
+ */
+void liquidate_read_bins(const bam1_t* read, unsigned int first_bin, unsigned int bin_count,
+                         unsigned int bin_size, char strand, unsigned int extendlen,
+                         double* counts);
+
+/**
+ * Adds a single read to either the forward or reverse bins (depending on the read's strand),
+ * exactly as liquidate_strand_bins counts each read that it fetches.
+ */
+void liquidate_read_strand_bins(const bam1_t* read, unsigned int first_bin, unsigned int bin_count,
+                                unsigned int bin_size, unsigned int extendlen,
+                                double* forward, double* reverse);
+
+/**
+ * Sets strand ('+' or '-'), start and stop to the strand and span [start, stop) of the read that
+ * liquidate adds the overlap of to its counts, returning false if liquidate would never count the
+ * read (it isn't on a chromosome).  This is for building a coverage index from every read (see
+ * bamliquidator_coverage.h).
+ */
+bool liquidate_read_span(const bam1_t* read, unsigned int extendlen,
+                         char& strand, unsigned int& start, unsigned int& stop);
+
+/**
+ * Counts reads one at a time into regions on a single chromosome, exactly as liquidate_regions
+ * counts the reads that it fetches, for reads that are read some other way than fetching them
+ * (like liquidate_read_bins).  The regions must be sorted by start, and the reads (all on the
+ * regions' chromosome) must be counted in order of position, as they are in a sorted bam.
+ */
+class RegionsCounter
+{
+public:
+  // sets the count of each region to 0, the counts are added to as reads are counted
+  RegionsCounter(LiquidatedRegion* regions, size_t region_count, unsigned int extendlen);
+
+  void count(const bam1_t* read);
+
+private:
+  LiquidatedRegion* regions;
+  size_t region_count;
+  unsigned int extendlen;
+
+  // the regions that may be fetched for the next read, with next_region the first that isn't yet open
+  std::vector<size_t> open_regions;
+  size_t next_region;
+  uint32_t last_pos;
+};
+
 /* The MIT License (MIT) 
 
    Copyright (c) 2013 Xin Zhong and Charles Lin
@@ -1,10 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include <vector>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/pipeline.h>
+#include <tbb/task_scheduler_init.h>
 
 #include "bamliquidator.h"
+#include "bamliquidator_coverage.h"
+#include "chunk_pool.h"
+#include "metrics.h"
 
 /* The MIT License (MIT) 
 
@@ -29,58 +41,312 @@
    THE SOFTWARE. 
  */
 
-int parseArgs(std::string& bamfile, std::string& chromosome, 
-              unsigned int& start, unsigned int& stop,
-              char& strand, unsigned int& spnum,
-              unsigned int& extendlen,
-              const int argc, char* argv[])
+int parseQuery(std::string& chromosome,
+               unsigned int& start, unsigned int& stop,
+               char& strand, unsigned int& spnum,
+               unsigned int& extendlen,
+               char* fields[6])
 {
-  if(argc!=8)
-  {
-    printf("[ bamliquidator ] output to stdout\n1. bam file (.bai file has to be at same location)\n2. chromosome\n3. start\n4. stop\n5. strand +/-, use dot (.) for both strands\n6. number of summary points\n7. extension length\n\nNote that each summary point is floor((stop-start)/(number of summary points)) long,\nand if it doesn't divide evenly then the range is truncated.\n");
-    return 1;
-  }
-
-  bamfile=argv[1];
-  chromosome=argv[2];
+  chromosome=fields[0];
 
   char* tail=NULL;
-  start=strtol(argv[3],&tail,10);
+  start=strtol(fields[1],&tail,10);
   if(tail[0]!='\0')
   {
-    fprintf(stderr, "wrong start (%s)\n", argv[3]);
+    fprintf(stderr, "wrong start (%s)\n", fields[1]);
     return 1;
   }
-  stop=strtol(argv[4],&tail,10);
+  stop=strtol(fields[2],&tail,10);
   if(tail[0]!='\0' || stop<=start)
   {
-    fprintf(stderr, "wrong stop (%s)\n", argv[4]);
+    fprintf(stderr, "wrong stop (%s)\n", fields[2]);
     return 1;
   }
-  strand=argv[5][0];
+  strand=fields[3][0];
   if(strand!='+' && strand!='-' && strand!='.')
   {
     fputs("wrong strand, must be +/-/.\n",stderr);
     return 1;
   }
-  spnum=strtol(argv[6],&tail,10);
+  spnum=strtol(fields[4],&tail,10);
   if(tail[0]!='\0' || spnum<=0)
   {
-    fprintf(stderr, "wrong spnum (%s)\n", argv[6]);
+    fprintf(stderr, "wrong spnum (%s)\n", fields[4]);
     return 1;
   }
-  extendlen=(unsigned short)strtol(argv[7],&tail,10);
+  extendlen=(unsigned short)strtol(fields[5],&tail,10);
   if(tail[0]!='\0')
   {
-    fprintf(stderr, "wrong extension length (%s)\n", argv[7]);
+    fprintf(stderr, "wrong extension length (%s)\n", fields[5]);
     return 1;
   }
 
   return 0;
 }
 
+void printUsage()
+{
+  printf("[ bamliquidator ] output to stdout\n1. bam file (.bai file has to be at same location)\n2. chromosome\n3. start\n4. stop\n5. strand +/-, use dot (.) for both strands\n6. number of summary points\n7. extension length\n\nNote that each summary point is floor((stop-start)/(number of summary points)) long,\nand if it doesn't divide evenly then the range is truncated.\n\nTo answer many queries without reopening the bam files, use\n  bamliquidator --batch number_of_threads query_file bam_file1 [bam_file2 ...]\nwhere each line of query_file (or stdin if query_file is -) is\n  chromosome start stop strand number_of_summary_points extension_length\nFor every query, one line per bam file (in argument order) is written with the\ntab separated counts.  Number of threads <= 0 means one per logical cpu.\n\nA coverage index (a file ending with .lcov written by bamliquidator_coverage) can be\ngiven in place of any bam file, to answer the queries without reading the bam.\n");
+}
+
+int parseArgs(std::string& bamfile, std::string& chromosome, 
+              unsigned int& start, unsigned int& stop,
+              char& strand, unsigned int& spnum,
+              unsigned int& extendlen,
+              const int argc, char* argv[])
+{
+  if(argc!=8)
+  {
+    printUsage();
+    return 1;
+  }
+
+  bamfile=argv[1];
+  return parseQuery(chromosome, start, stop, strand, spnum, extendlen, argv+2);
+}
+
+// The opened bam files and indexes, which can't be shared between threads.  Coverage index
+// paths are skipped (with null files and indexes), since coverage indexes can be shared.
+class BamFiles
+{
+public:
+  BamFiles(const std::vector<std::string>& paths):
+    paths(paths)
+  {
+    init();
+  }
+
+  BamFiles(const BamFiles& other):
+    paths(other.paths)
+  {
+    init();
+  }
+
+  BamFiles& operator=(const BamFiles& other) = delete;
+
+  ~BamFiles()
+  {
+    for (size_t i=0; i < files.size(); ++i)
+    {
+      if (files[i] == NULL) continue;
+      bam_index_destroy(indexes[i]);
+      samclose(files[i]);
+    }
+  }
+
+  size_t size() const { return files.size(); }
+
+  const samfile_t* file(size_t i) const { return files[i]; }
+  const bam_index_t* index(size_t i) const { return indexes[i]; }
+
+private:
+  const std::vector<std::string> paths;
+  std::vector<samfile_t*> files;
+  std::vector<bam_index_t*> indexes;
+
+  void init()
+  {
+    liquidator::StageTimer timer(liquidator::Stage::index_load);
+    for (const std::string& path : paths)
+    {
+      if (liquidator::is_coverage_index_path(path))
+      {
+        files.push_back(NULL);
+        indexes.push_back(NULL);
+        continue;
+      }
+
+      samfile_t* fp = samopen(path.c_str(),"rb",0);
+      if(fp == NULL)
+      {
+        throw std::runtime_error("samopen() error with " + path);
+      }
+      files.push_back(fp);
+
+      bam_index_t* bamidx = bam_index_load(path.c_str());
+      if (bamidx == NULL)
+      {
+        throw std::runtime_error("bam_index_load() error with " + path);
+      }
+      indexes.push_back(bamidx);
+    }
+  }
+};
+
+typedef tbb::enumerable_thread_specific<BamFiles,
+                                        tbb::cache_aligned_allocator<BamFiles>,
+                                        tbb::ets_key_per_instance>
+        ThreadBamFiles;
+
+struct Query
+{
+  std::string chromosome;
+  unsigned int start;
+  unsigned int stop;
+  char strand;
+  unsigned int spnum;
+  unsigned int extendlen;
+
+  // spnum counts for the first bam, followed by spnum counts for the second bam, etc.
+  std::vector<double> counts;
+
+  void clear()
+  {
+    counts.clear();
+  }
+};
+
+// Reads the next query, returning false at the end of the input.
+bool readQuery(std::istream& input, size_t& line_number, Query& query)
+{
+  for (std::string line; std::getline(input, line); )
+  {
+    ++line_number;
+
+    std::vector<char> buffer(line.begin(), line.end());
+    buffer.push_back('\0');
+    char* fields[6];
+    int field_count = 0;
+    char* save = NULL;
+    for (char* field = strtok_r(buffer.data(), " \t\r", &save);
+         field != NULL;
+         field = strtok_r(NULL, " \t\r", &save))
+    {
+      if (field_count == 6)
+      {
+        field_count = 7;
+        break;
+      }
+      fields[field_count++] = field;
+    }
+    if (field_count == 0) continue; // skip blank lines
+
+    if (field_count != 6
+        || parseQuery(query.chromosome, query.start, query.stop, query.strand, query.spnum,
+                      query.extendlen, fields) != 0)
+    {
+      throw std::runtime_error("invalid query on line " + std::to_string(line_number) + ": " + line);
+    }
+    return true;
+  }
+  return false;
+}
+
+// Answers every query from the input for every bam file, reusing the opened bam files
+// and indexes.  Queries are answered in parallel, with the results written to stdout in
+// the order of the queries (flushed after each query, so interactive callers can wait
+// for the answer before sending the next query).
+int batch(const int argc, char* argv[])
+{
+  if (argc < 5)
+  {
+    printUsage();
+    return 1;
+  }
+
+  const int number_of_threads = atoi(argv[2]);
+  const std::string query_file_path = argv[3];
+  const std::vector<std::string> bam_file_paths(argv + 4, argv + argc);
+
+  tbb::task_scheduler_init init( number_of_threads <= 0
+                               ? tbb::task_scheduler_init::automatic
+                               : number_of_threads);
+
+  std::ifstream query_file;
+  if (query_file_path != "-")
+  {
+    query_file.open(query_file_path.c_str());
+    if (!query_file)
+    {
+      fprintf(stderr, "failed to open query file %s\n", query_file_path.c_str());
+      return 1;
+    }
+  }
+  std::istream& input = query_file_path == "-" ? std::cin : query_file;
+
+  ThreadBamFiles bam_files((BamFiles(bam_file_paths)));
+  std::vector<std::unique_ptr<liquidator::CoverageIndex>> coverage_indexes(bam_file_paths.size());
+  for (size_t i=0; i < bam_file_paths.size(); ++i)
+  {
+    if (liquidator::is_coverage_index_path(bam_file_paths[i]))
+    {
+      coverage_indexes[i].reset(new liquidator::CoverageIndex(bam_file_paths[i]));
+    }
+  }
+  size_t line_number = 0;
+  liquidator::ChunkPool<Query> queries;
+
+  // more queries in flight than threads, so a slow query doesn't stall the others
+  const size_t max_queries_in_flight = 4 * (number_of_threads <= 0
+                                           ? tbb::task_scheduler_init::default_num_threads()
+                                           : number_of_threads);
+  tbb::parallel_pipeline(max_queries_in_flight,
+    tbb::make_filter<void, Query*>(tbb::filter::serial_in_order,
+      [&](tbb::flow_control& fc) -> Query*
+      {
+        Query* query = queries.acquire();
+        if (!readQuery(input, line_number, *query))
+        {
+          queries.release(query);
+          fc.stop();
+          return NULL;
+        }
+        return query;
+      })
+    & tbb::make_filter<Query*, Query*>(tbb::filter::parallel,
+      [&](Query* query) -> Query*
+      {
+        const BamFiles& files = bam_files.local();
+        query->counts.assign(query->spnum * files.size(), 0);
+        for (size_t i=0; i < files.size(); ++i)
+        {
+          if (coverage_indexes[i])
+          {
+            coverage_indexes[i]->liquidate(query->chromosome, query->start, query->stop, query->strand,
+                                           query->spnum, query->extendlen, &query->counts[i*query->spnum]);
+          }
+          else
+          {
+            liquidate(files.file(i), files.index(i), query->chromosome, query->start, query->stop,
+                      query->strand, query->spnum, query->extendlen, &query->counts[i*query->spnum]);
+          }
+        }
+        return query;
+      })
+    & tbb::make_filter<Query*, void>(tbb::filter::serial_in_order,
+      [&](Query* query)
+      {
+        liquidator::StageTimer timer(liquidator::Stage::write);
+        liquidator::add_count(liquidator::Counter::queries, 1);
+        for (size_t i=0; i < query->counts.size(); ++i)
+        {
+          printf("%d%c", (int) query->counts[i], (i+1) % query->spnum == 0 ? '\n' : '\t');
+        }
+        fflush(stdout);
+        queries.release(query);
+      }));
+
+  liquidator::write_metrics("bamliquidator");
+  return 0;
+}
+
 int main(int argc, char* argv[])
 {
+  liquidator::Metrics::start();
+
+  if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+  {
+    try
+    {
+      return batch(argc, argv);
+    }
+    catch(const std::exception& e)
+    {
+      fprintf(stderr, "%s\n", e.what());
+      return 1;
+    }
+  }
+
   std::string bamfile;
   std::string chromosome;
   unsigned int start = 0;
@@ -93,13 +359,30 @@ int main(int argc, char* argv[])
     return 1;
   }
 
-  const std::vector<double> counts = liquidate(bamfile, chromosome, start, stop,
-    strand, spnum, extendlen);
+  std::vector<double> counts(spnum, 0);
+  try
+  {
+    if (liquidator::is_coverage_index_path(bamfile))
+    {
+      liquidator::CoverageIndex(bamfile).liquidate(chromosome, start, stop, strand, spnum, extendlen, counts.data());
+    }
+    else
+    {
+      counts = liquidate(bamfile, chromosome, start, stop, strand, spnum, extendlen);
+    }
+  }
+  catch(const std::exception& e)
+  {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
 
   for(double count : counts)
   {
     printf("%d\n", (int) count);
   }
 
+  liquidator::add_count(liquidator::Counter::queries, 1);
+  liquidator::write_metrics("bamliquidator");
   return 0;
 }
@@ -0,0 +1,118 @@
+#ifndef PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_BINS_H
+#define PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_BINS_H
+
+#include "metrics.h"
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace liquidator
+{
+
+// this CountH5Record must match exactly the structure in HDF5
+// -- see bamliquidator_batch.py function create_count_table
+struct CountH5Record
+{
+  uint32_t bin_number;
+  char cell_type[16];
+  char chromosome[64];
+  uint64_t count;
+  uint32_t bam_file_key;
+};
+
+// The forward and reverse strand counts of a bin, written alongside its CountH5Record (with the
+// counts of both strands) when all strands are counted at once.
+// This StrandCountH5Record must match exactly the structure in HDF5
+// -- see bamliquidator_batch.py function create_strand_counts_table
+struct StrandCountH5Record
+{
+  uint32_t bin_number;
+  char cell_type[16];
+  char chromosome[64];
+  uint64_t forward_count;
+  uint64_t reverse_count;
+  uint32_t bam_file_key;
+};
+
+inline StrandCountH5Record strand_record(const CountH5Record& record, uint64_t forward_count, uint64_t reverse_count)
+{
+  StrandCountH5Record strand_record;
+  strand_record.bin_number = record.bin_number;
+  std::memcpy(strand_record.cell_type, record.cell_type, sizeof(strand_record.cell_type));
+  std::memcpy(strand_record.chromosome, record.chromosome, sizeof(strand_record.chromosome));
+  strand_record.forward_count = forward_count;
+  strand_record.reverse_count = reverse_count;
+  strand_record.bam_file_key = record.bam_file_key;
+  return strand_record;
+}
+
+inline void write(hid_t& file,
+                  const std::vector<CountH5Record>& records)
+{
+  StageTimer timer(Stage::write);
+
+  const size_t record_size = sizeof(CountH5Record);
+
+  size_t record_offset[] = { HOFFSET(CountH5Record, bin_number), 
+                             HOFFSET(CountH5Record, cell_type),
+                             HOFFSET(CountH5Record, chromosome),
+                             HOFFSET(CountH5Record, count),
+                             HOFFSET(CountH5Record, bam_file_key) };
+
+  size_t field_sizes[] = { sizeof(CountH5Record::bin_number),
+                           sizeof(CountH5Record::cell_type),
+                           sizeof(CountH5Record::chromosome),
+                           sizeof(CountH5Record::count),
+                           sizeof(CountH5Record::bam_file_key) };
+
+  herr_t status = H5TBappend_records(file, "bin_counts", records.size(), record_size,
+                                     record_offset, field_sizes, records.data());
+  if (status != 0)
+  {
+    std::stringstream ss;
+    ss << "Failed to append records, status = " << status;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+inline void write(hid_t& file,
+                  const std::vector<StrandCountH5Record>& records)
+{
+  StageTimer timer(Stage::write);
+
+  const size_t record_size = sizeof(StrandCountH5Record);
+
+  size_t record_offset[] = { HOFFSET(StrandCountH5Record, bin_number),
+                             HOFFSET(StrandCountH5Record, cell_type),
+                             HOFFSET(StrandCountH5Record, chromosome),
+                             HOFFSET(StrandCountH5Record, forward_count),
+                             HOFFSET(StrandCountH5Record, reverse_count),
+                             HOFFSET(StrandCountH5Record, bam_file_key) };
+
+  size_t field_sizes[] = { sizeof(StrandCountH5Record::bin_number),
+                           sizeof(StrandCountH5Record::cell_type),
+                           sizeof(StrandCountH5Record::chromosome),
+                           sizeof(StrandCountH5Record::forward_count),
+                           sizeof(StrandCountH5Record::reverse_count),
+                           sizeof(StrandCountH5Record::bam_file_key) };
+
+  herr_t status = H5TBappend_records(file, "bin_strand_counts", records.size(), record_size,
+                                     record_offset, field_sizes, records.data());
+  if (status != 0)
+  {
+    std::stringstream ss;
+    ss << "Failed to append strand records, status = " << status;
+    throw std::runtime_error(ss.str());
+  }
+}
+
+
+}
+
+#endif
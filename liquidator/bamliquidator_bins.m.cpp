@@ -1,9 +1,15 @@
 #include "bamliquidator.h"
+#include "bamliquidator_bins.h"
+#include "bamliquidator_shards.h"
 #include "liquidator_util.h"
+#include "metrics.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -15,52 +21,12 @@
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
-#include <tbb/blocked_range.h>
 #include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
+#include <tbb/pipeline.h>
 #include <tbb/task_scheduler_init.h>
 
 using namespace liquidator;
 
-// this CountH5Record must match exactly the structure in HDF5
-// -- see bamliquidator_batch.py function create_count_table
-struct CountH5Record
-{
-  uint32_t bin_number;
-  char cell_type[16];
-  char chromosome[64];
-  uint64_t count;
-  uint32_t bam_file_key;
-};
-
-
-void write(hid_t& file,
-           const std::vector<CountH5Record>& records)
-{
-  const size_t record_size = sizeof(CountH5Record);
-
-  size_t record_offset[] = { HOFFSET(CountH5Record, bin_number), 
-                             HOFFSET(CountH5Record, cell_type),
-                             HOFFSET(CountH5Record, chromosome),
-                             HOFFSET(CountH5Record, count),
-                             HOFFSET(CountH5Record, bam_file_key) };
-
-  size_t field_sizes[] = { sizeof(CountH5Record::bin_number),
-                           sizeof(CountH5Record::cell_type),
-                           sizeof(CountH5Record::chromosome),
-                           sizeof(CountH5Record::count),
-                           sizeof(CountH5Record::bam_file_key) };
-
-  herr_t status = H5TBappend_records(file, "bin_counts", records.size(), record_size,
-                                     record_offset, field_sizes, records.data());
-  if (status != 0)
-  {
-    std::stringstream ss;
-    ss << "Failed to append records, status = " << status;
-    throw std::runtime_error(ss.str());
-  }
-}
-
 class Liquidator 
 {
 public:
@@ -88,15 +54,16 @@ public:
     samclose(fp);
   }
 
-  double liquidate(const std::string& chromosome, int start, int stop, char strand, unsigned int extension)
+  std::vector<double> liquidate_bins(const std::string& chromosome, unsigned int first_bin, unsigned int bin_count,
+                                     unsigned int bin_size, char strand, unsigned int extension)
   {
-    std::vector<double> counts = ::liquidate(fp, bamidx, chromosome, start, stop, strand, 1, extension);
-    if (counts.size() != 1)
-    {
-      throw std::runtime_error("liquidate failed to provide exactly one count (count is " +
-        boost::lexical_cast<std::string>(counts.size()) + ")");
-    }
-    return counts[0];
+    return ::liquidate_bins(fp, bamidx, chromosome, first_bin, bin_count, bin_size, strand, extension);
+  }
+
+  void liquidate_strand_bins(const std::string& chromosome, unsigned int first_bin, unsigned int bin_count,
+                             unsigned int bin_size, unsigned int extension, double* forward, double* reverse)
+  {
+    ::liquidate_strand_bins(fp, bamidx, chromosome, first_bin, bin_count, bin_size, extension, forward, reverse);
   }
 
 private:
@@ -106,6 +73,7 @@ private:
 
   void init()
   {
+    StageTimer timer(Stage::index_load);
     fp = samopen(bam_file_path.c_str(),"rb",0);
     if(fp == NULL)
     {
@@ -128,95 +96,217 @@ typedef tbb::enumerable_thread_specific<Liquidator,
         Liquidators;
 
 
-void liquidate_bins(std::vector<CountH5Record>& counts, const std::string& bam_file_path,
-                    size_t region_begin, size_t region_end, const size_t bin_size,
-                    unsigned int extension, const char strand,
-                    Liquidators& liquidators)
+// Roughly how many base pairs are counted by a single sweep over the reads.
+// Large enough that the extra fetch for reads crossing slice edges is negligible,
+// and small enough that the slices keep all the threads busy.
+const size_t slice_length = 4000000;
+
+// At most this many slices per thread are counted but not yet written, so memory use
+// is bounded by the threads instead of growing with the whole genome.
+const int SLICES_PER_THREAD = 4;
+
+struct BamFile
+{
+  std::string path;
+  unsigned int key;
+  std::string cell_type;
+};
+
+// A slice is the records of consecutive bins on a single chromosome of a single bam, along with
+// their strand records when counting all strands.
+struct Slice
+{
+  std::vector<CountH5Record> records;
+  std::vector<StrandCountH5Record> strand_records;
+
+  // the bam's liquidators, which are destroyed (closing the bam) along with its last slice
+  std::shared_ptr<Liquidators> liquidators;
+};
+
+// Hands out the slices of the bin spans of each bam in order, with each record's count still 0.
+class SliceGenerator
 {
-  Liquidator& liquidator = liquidators.local();
+public:
+  SliceGenerator(const std::vector<BamFile>& bam_files,
+                 const std::vector<BinSpan>& spans,
+                 const unsigned int bin_size):
+    bam_files(bam_files),
+    spans(spans),
+    max_bins(std::max<size_t>(1, slice_length / bin_size)),
+    bam_index(0),
+    span_index(0),
+    span_offset(0)
+  {
+    empty_record.bin_number = 0;
+    empty_record.count      = 0;
+    copy(empty_record.chromosome, "", sizeof(CountH5Record::chromosome));
+  }
 
-  for (size_t i=region_begin; i < region_end; ++i)
+  // returns nullptr once every span of every bam has been sliced
+  Slice* next()
   {
-    try
+    for (; bam_index < bam_files.size(); ++bam_index, span_index = 0, liquidators.reset())
     {
-      const size_t start = counts[i].bin_number * bin_size;
-      const size_t stop = start + bin_size;
-      counts[i].count = liquidator.liquidate(counts[i].chromosome,
-                                              start, 
-                                              stop, 
-                                              strand,
-                                              extension);
-    } catch(const std::exception& e)
-    {
-      Logger::warn() << "Skipping " << counts[i].chromosome
-                     << " bin " << i << " due to error: " << e.what();
+      for (; span_index < spans.size(); ++span_index, span_offset = 0)
+      {
+        const BinSpan& span = spans[span_index];
+        const size_t next_bin = span.first_bin + span_offset;
+        if (next_bin < span.end_bin)
+        {
+          if (!liquidators)
+          {
+            start_bam(bam_files[bam_index]);
+          }
+          const size_t slice_bins = std::min(max_bins, span.end_bin - next_bin);
+          Slice* slice = new Slice;
+          slice->records.assign(slice_bins, empty_record);
+          for (size_t i=0; i < slice_bins; ++i)
+          {
+            slice->records[i].bin_number = next_bin + i;
+            copy(slice->records[i].chromosome, span.chromosome, sizeof(CountH5Record::chromosome));
+          }
+          slice->liquidators = liquidators;
+          span_offset += slice_bins;
+          return slice;
+        }
+      }
     }
+    return nullptr;
   }
-}
-
-void batch_liquidate(std::vector<CountH5Record>& counts,
-                     const unsigned int bin_size,
-                     const unsigned int extension,
-                     const char strand,
-                     const std::string& bam_file_path)
-{
-  Liquidators liquidators((Liquidator(bam_file_path))); 
 
-  tbb::parallel_for(
-    tbb::blocked_range<int>(0, counts.size(), 1),
-    [&](const tbb::blocked_range<int>& range)
-    {
-      liquidate_bins(counts, bam_file_path, range.begin(), range.end(), bin_size, extension, strand, liquidators);
-    },
-    tbb::auto_partitioner());
-}
+private:
+  const std::vector<BamFile>& bam_files;
+  const std::vector<BinSpan>& spans;
+  const size_t max_bins;
+  CountH5Record empty_record;
+  std::shared_ptr<Liquidators> liquidators;
+  size_t bam_index;
+  size_t span_index;
+  size_t span_offset; // how many bins of the span have been sliced
 
-std::vector<CountH5Record> count_placeholders(
-  const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
-  const std::string& cell_type,
-  const unsigned int bam_file_key,
-  const unsigned int bin_size)
-{
-  size_t num_records = 0;
-  for (auto& chr_length : chromosome_lengths)
+  void start_bam(const BamFile& bam_file)
   {
-    int bins = std::ceil(chr_length.second / (double) bin_size);
-    num_records += bins; 
+    liquidators = std::make_shared<Liquidators>(Liquidator(bam_file.path));
+    empty_record.bam_file_key = bam_file.key;
+    copy(empty_record.cell_type, bam_file.cell_type, sizeof(CountH5Record::cell_type));
   }
+};
 
-  CountH5Record empty_record;
-  empty_record.bam_file_key = bam_file_key;
-  empty_record.bin_number = 0;
-  empty_record.count      = 0;
-  copy(empty_record.cell_type, cell_type, sizeof(CountH5Record::cell_type));
-  copy(empty_record.chromosome, "", sizeof(CountH5Record::chromosome));
+void liquidate_bins(Slice& slice, const size_t bin_size,
+                    unsigned int extension, const char strand)
+{
+  Liquidator& liquidator = slice.liquidators->local();
+  std::vector<CountH5Record>& records = slice.records;
 
-  std::vector<CountH5Record> records(num_records, empty_record);
+  if (strand == all_strands)
+  {
+    // zero counts up front, so a skipped slice still writes the same rows to both tables
+    slice.strand_records.resize(records.size());
+    for (size_t i=0; i < records.size(); ++i)
+    {
+      slice.strand_records[i] = strand_record(records[i], 0, 0);
+    }
+  }
 
-  size_t i=0;
-  for (auto& chr_length : chromosome_lengths)
+  try
   {
-    int bins = std::ceil(chr_length.second / (double) bin_size);
-    for (int j=0; j < bins; ++j, ++i)
+    if (strand == all_strands)
     {
-      records[i].bin_number = j;
-      copy(records[i].chromosome, chr_length.first, sizeof(CountH5Record::chromosome));
+      std::vector<double> forward(records.size(), 0), reverse(records.size(), 0);
+      liquidator.liquidate_strand_bins(records.front().chromosome, records.front().bin_number, records.size(),
+                                       bin_size, extension, forward.data(), reverse.data());
+      for (size_t i=0; i < records.size(); ++i)
+      {
+        records[i].count = forward[i] + reverse[i];
+        slice.strand_records[i] = strand_record(records[i], forward[i], reverse[i]);
+      }
     }
+    else
+    {
+      const std::vector<double> slice_counts = liquidator.liquidate_bins(records.front().chromosome,
+                                                                         records.front().bin_number,
+                                                                         records.size(),
+                                                                         bin_size,
+                                                                         strand,
+                                                                         extension);
+      for (size_t i=0; i < records.size(); ++i)
+      {
+        records[i].count = slice_counts[i];
+      }
+    }
+  } catch(const std::exception& e)
+  {
+    Logger::warn() << "Skipping " << records.front().chromosome
+                   << " bins " << records.front().bin_number << " through " << records.back().bin_number
+                   << " due to error: " << e.what();
   }
+}
 
-  return records;
+// Counts the slices in parallel and appends each to the table as soon as it and all the
+// slices before it are counted, so the table rows are in the same order as counting
+// everything up front and writing once, but the writing overlaps the counting.  The slices
+// of all the bams go through the same pipeline, so the threads stay busy across the ends
+// of the bams instead of waiting on each bam's last slices (and a process per bam).
+void liquidate_and_write(hid_t& file,
+                         const std::vector<BamFile>& bam_files,
+                         const std::vector<BinSpan>& spans,
+                         const unsigned int bin_size,
+                         const unsigned int extension,
+                         const char strand)
+{
+  SliceGenerator generator(bam_files, spans, bin_size);
+
+  // Each slice streams its chromosome's reads once, so parallelizing across slices avoids
+  // the seek and decode of every read for every single bin.
+  const size_t max_slices_in_flight = SLICES_PER_THREAD * tbb::task_scheduler_init::default_num_threads();
+  tbb::parallel_pipeline(max_slices_in_flight,
+    tbb::make_filter<void, Slice*>(tbb::filter::serial_in_order,
+      [&](tbb::flow_control& fc) -> Slice*
+      {
+        Slice* slice = generator.next();
+        if (slice == nullptr)
+        {
+          fc.stop();
+        }
+        return slice;
+      })
+    & tbb::make_filter<Slice*, Slice*>(tbb::filter::parallel,
+      [&](Slice* slice) -> Slice*
+      {
+        liquidate_bins(*slice, bin_size, extension, strand);
+        return slice;
+      })
+    & tbb::make_filter<Slice*, void>(tbb::filter::serial_in_order,
+      [&](Slice* slice)
+      {
+        std::unique_ptr<Slice> owner(slice);
+        write(file, slice->records);
+        if (!slice->strand_records.empty())
+        {
+          write(file, slice->strand_records);
+        }
+      }));
 }
 
 int main(int argc, char* argv[])
 {
+  Metrics::start();
+
   try
   {
+    const std::string shard = extract_shard_option(argc, argv);
     if (argc < 13 || argc % 2 != 1)
     {
       std::cerr << "usage: " << argv[0] 
-        << " number_of_threads cell_type bin_size extension strand bam_file bam_file_key hdf5_file log_file write_warnings_to_stderr chr1 length1 ... \n"
+        << " [--shard shard] number_of_threads cell_type bin_size extension strand bam_file bam_file_key hdf5_file log_file write_warnings_to_stderr chr1 length1 ... \n"
         << "\ne.g. " << argv[0] << " mm1s 100000 0 . /ifs/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam "
         << "137 counts.hdf5 output/log.txt 1 chr1 247249719 chr2 242951149 chr3 199501827"
+        << "\nbam_file and bam_file_key may be comma separated lists, e.g. a.bam,b.bam and 3,4, to liquidate many bam"
+        << "\nfiles (with the same chromosomes) in one process.  cell_type may then also be a list, one per bam file."
+        << "\nshard is index/count (e.g. 3/8 for the 4th of 8 pieces balanced using the bam index) or comma separated"
+        << "\nchromosome ranges (e.g. chr1:0-100000000,chr2), to count just that piece of a single bam file."
+        << "\nstrand value of " << all_strands << " means count the forward, reverse and both strands with a single fetch of the"
+        << "\nreads, writing both strand counts to bin_counts and forward and reverse counts to bin_strand_counts."
         << "\nnumber of threads <= 0 means use a number of threads equal to the number of logical cpus."
         << "\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
         << "\nhttps://github.com/BradnerLab/pipeline/wiki for more information"
@@ -225,17 +315,33 @@ int main(int argc, char* argv[])
     }
 
     const int number_of_threads = boost::lexical_cast<int>(argv[1]);
-    const std::string cell_type = argv[2];
     const unsigned int bin_size = boost::lexical_cast<unsigned int>(argv[3]);
     const unsigned int extension = boost::lexical_cast<unsigned int>(argv[4]);
     const char strand = boost::lexical_cast<char>(argv[5]);
-    const std::string bam_file_path = argv[6];
-    const unsigned int bam_file_key = boost::lexical_cast<unsigned int>(argv[7]);
+    const std::vector<std::pair<std::string, unsigned int>> bam_files_and_keys = extract_bam_files(argv[6], argv[7]);
+    // likewise a single bam's cell type isn't split (see extract_bam_files)
+    const std::vector<std::string> cell_types = bam_files_and_keys.size() == 1
+                                              ? std::vector<std::string>(1, argv[2])
+                                              : split_list_argument(argv[2]);
     const std::string hdf5_file_path = argv[8];
     const std::string log_file_path = argv[9];
     const bool write_warnings_to_stderr = boost::lexical_cast<bool>(argv[10]);
     const std::vector<std::pair<std::string, size_t>> chromosome_lengths = extract_chromosome_lengths(argc, argv, 11);
 
+    if (cell_types.size() != 1 && cell_types.size() != bam_files_and_keys.size())
+    {
+      throw std::runtime_error("expected a single cell type or one for each bam file, but got " + std::string(argv[2]));
+    }
+    std::vector<BamFile> bam_files;
+    for (size_t i=0; i < bam_files_and_keys.size(); ++i)
+    {
+      BamFile bam_file;
+      bam_file.path = bam_files_and_keys[i].first;
+      bam_file.key = bam_files_and_keys[i].second;
+      bam_file.cell_type = cell_types.size() == 1 ? cell_types[0] : cell_types[i];
+      bam_files.push_back(bam_file);
+    }
+
     tbb::task_scheduler_init init( number_of_threads <= 0 
                                  ? tbb::task_scheduler_init::automatic
                                  : number_of_threads); 
@@ -248,6 +354,13 @@ int main(int argc, char* argv[])
       return 2;
     }
 
+    if (!shard.empty() && bam_files.size() != 1)
+    {
+      Logger::error() << "Only a single bam file can be sharded";
+      return 2;
+    }
+    const std::vector<BinSpan> spans = bin_spans(chromosome_lengths, bin_size, shard, bam_files.front().path);
+
     hid_t h5file = H5Fopen(hdf5_file_path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
     if (h5file < 0)
     {
@@ -255,11 +368,10 @@ int main(int argc, char* argv[])
       return 3;
     }
 
-    std::vector<CountH5Record> counts = count_placeholders(chromosome_lengths, cell_type, bam_file_key, bin_size);
-    batch_liquidate(counts, bin_size, extension, strand, bam_file_path);
-    write(h5file, counts);
+    liquidate_and_write(h5file, bam_files, spans, bin_size, extension, strand);
 
     H5Fclose(h5file);
+    log_metrics("bamliquidator_bins");
 
     return 0;
   }
@@ -0,0 +1,504 @@
+#ifndef PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_COVERAGE_H
+#define PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_COVERAGE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace liquidator
+{
+
+/*
+ * A coverage index is a sidecar file for a bam that answers liquidate queries without fetching
+ * any reads.  For each chromosome and strand it stores the cumulative coverage
+ *
+ *   C(x) = sum over reads of the length of [read start, read stop) overlapping [0, x)
+ *
+ * (with the same read spans, including the extension, that liquidate uses) at every multiple
+ * of the index resolution, so the count liquidate computes for [start, stop) is just
+ * C(stop) - C(start).  C is piecewise linear, so positions between multiples of the resolution
+ * are linearly interpolated.  The counts then equal liquidate's exactly when the extension is 0
+ * and the summary point boundaries are multiples of the resolution, so exact answers for any
+ * query need resolution 1, which for hg19 is an index of about 26 GB (and 24 bytes of memory
+ * per base pair of the largest chromosome while building it).  With an extension liquidate
+ * skips reads whose alignments don't reach the queried range even though their extensions do,
+ * which the index counts.
+ *
+ * C is stored as a uint64_t checkpoint every coverage_index_checkpoint_cells values and a
+ * uint32_t offset from the last checkpoint for every value, i.e. about 4 bytes per value
+ * instead of 8.  A chromosome with more coverage in a checkpoint's cells than a uint32_t
+ * holds (only possible with a low resolution and deep coverage) is stored "wide", as just the
+ * uint64_t values of C.
+ *
+ * The file is little endian like the machine, laid out to be memory mapped:
+ *   CoverageIndexHeader
+ *   for each chromosome, the cell_count+1 values of C for the forward strand, then the same
+ *   for the reverse strand, where cell_count covers the chromosome and any reads extending
+ *   past its end.  Each strand is the checkpoints then the offsets, padded to a multiple of 8
+ *   bytes, or the uint64_t values when the chromosome is wide (see coverage_index_strand_bytes).
+ *   CoverageIndexChromosome for each chromosome, starting at the header's table_offset
+ *   the chromosome names, each name_length chars without a terminating null
+ */
+
+const char coverage_index_magic[8] = {'L', 'I', 'Q', 'C', 'O', 'V', '\0', '\0'};
+const uint32_t coverage_index_version = 2;
+const std::string coverage_index_extension = ".lcov";
+const uint64_t coverage_index_checkpoint_cells = 64;
+
+struct CoverageIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t resolution;
+  uint32_t extendlen;
+  uint32_t chromosome_count;
+  uint64_t table_offset;
+};
+
+struct CoverageIndexChromosome
+{
+  uint64_t name_offset;
+  uint64_t data_offset;
+  uint64_t cell_count;
+  uint32_t name_length;
+  uint32_t length;
+  uint32_t wide;    // 1 if the values of C are stored as is, 0 if as checkpoints and offsets
+  uint32_t padding;
+};
+
+inline uint64_t coverage_index_checkpoint_count(uint64_t values)
+{
+  return (values + coverage_index_checkpoint_cells - 1)/coverage_index_checkpoint_cells;
+}
+
+// The bytes of a strand's values of C in the file.
+inline uint64_t coverage_index_strand_bytes(uint64_t values, bool wide)
+{
+  if (wide) return values*sizeof(uint64_t);
+  return coverage_index_checkpoint_count(values)*sizeof(uint64_t) + (values*sizeof(uint32_t) + 7)/8*8;
+}
+
+// The conventional path of the index of a bam for an extension length, since the extension
+// length is part of what is indexed, e.g. "x.bam.e200.lcov".
+inline std::string coverage_index_path(const std::string& bam_file_path, unsigned int extendlen)
+{
+  return bam_file_path + ".e" + std::to_string(extendlen) + coverage_index_extension;
+}
+
+inline bool is_coverage_index_path(const std::string& path)
+{
+  return path.size() > coverage_index_extension.size()
+      && path.compare(path.size() - coverage_index_extension.size(), coverage_index_extension.size(),
+                      coverage_index_extension) == 0;
+}
+
+/**
+ * Writes a coverage index from the density span of every read, which must be added one
+ * chromosome at a time in order of chromosome (as they are in a sorted bam).  The index is
+ * written to a temporary file that is only renamed to path by finish, so a failed build doesn't
+ * leave an index behind.  Memory use is 24 bytes per cell of the largest chromosome (a cell
+ * being resolution base pairs), and the index is about 8 bytes per cell of the genome.
+ */
+class CoverageIndexWriter
+{
+public:
+  CoverageIndexWriter(const std::string& path, const std::vector<std::string>& chromosomes,
+                      const std::vector<uint32_t>& lengths, unsigned int resolution,
+                      unsigned int extendlen):
+    m_path(path),
+    m_temporary_path(path + ".tmp"),
+    m_lengths(lengths),
+    m_resolution(resolution),
+    m_chromosome(0),
+    m_output(m_temporary_path.c_str(), std::ios::binary | std::ios::trunc)
+  {
+    if (resolution == 0) throw std::runtime_error("coverage index resolution cannot be 0");
+    if (chromosomes.size() != lengths.size()) throw std::runtime_error("coverage index needs a length per chromosome");
+    if (!m_output) throw std::runtime_error("failed to open " + m_temporary_path);
+
+    m_header.chromosome_count = chromosomes.size();
+    std::memcpy(m_header.magic, coverage_index_magic, sizeof(m_header.magic));
+    m_header.version = coverage_index_version;
+    m_header.resolution = resolution;
+    m_header.extendlen = extendlen;
+    m_header.table_offset = 0; // written by finish
+    m_output.write((const char*) &m_header, sizeof(m_header));
+
+    m_table.resize(chromosomes.size());
+    m_names = chromosomes;
+
+    start_chromosome();
+  }
+
+  // Adds the span [start, stop) of a read on the chromosome (an index into the constructor's
+  // chromosomes) and strand ('+' or '-').
+  void add(size_t chromosome, char strand, unsigned int start, unsigned int stop)
+  {
+    if (chromosome < m_chromosome) throw std::runtime_error("coverage index given reads that are not sorted by chromosome");
+    if (chromosome >= m_lengths.size()) throw std::runtime_error("coverage index given a read on an unknown chromosome");
+    while (m_chromosome < chromosome)
+    {
+      finish_chromosome();
+    }
+
+    // C(k*resolution) gains k*resolution - start for the cells from the first multiple of
+    // the resolution after start, and gains stop - start for the cells from the first multiple
+    // at or after stop, so the read is a constant number of differences.
+    if (start >= stop) return;
+    const size_t first = start/m_resolution + 1;
+    const size_t last = (uint64_t(stop) + m_resolution - 1)/m_resolution;
+    if (last > m_cell_count)
+    {
+      resize(last);
+    }
+    Strand& s = m_strands[strand == '-'];
+    s.slope[first] += 1;
+    s.offset[first] -= start;
+    s.slope[last] -= 1;
+    s.offset[last] += stop;
+  }
+
+  // Writes the rest of the index and renames it to the path.
+  void finish()
+  {
+    while (m_chromosome < m_lengths.size())
+    {
+      finish_chromosome();
+    }
+
+    m_header.table_offset = m_output.tellp();
+    uint64_t name_offset = m_header.table_offset + m_table.size()*sizeof(CoverageIndexChromosome);
+    for (size_t i=0; i < m_table.size(); ++i)
+    {
+      m_table[i].name_offset = name_offset;
+      m_table[i].name_length = m_names[i].size();
+      m_table[i].length = m_lengths[i];
+      name_offset += m_names[i].size();
+    }
+    m_output.write((const char*) m_table.data(), m_table.size()*sizeof(CoverageIndexChromosome));
+    for (const std::string& name : m_names)
+    {
+      m_output.write(name.data(), name.size());
+    }
+    m_output.seekp(0);
+    m_output.write((const char*) &m_header, sizeof(m_header));
+    m_output.close();
+    if (!m_output) throw std::runtime_error("failed to write " + m_temporary_path);
+    if (std::rename(m_temporary_path.c_str(), m_path.c_str()) != 0)
+    {
+      throw std::runtime_error("failed to rename " + m_temporary_path + " to " + m_path + ": " + std::strerror(errno));
+    }
+  }
+
+private:
+  // differences in the number of reads C is rising for, and in C's constant term, by cell
+  struct Strand
+  {
+    std::vector<int32_t> slope;
+    std::vector<int64_t> offset;
+  };
+
+  const std::string m_path;
+  const std::string m_temporary_path;
+  const std::vector<uint32_t> m_lengths;
+  const uint64_t m_resolution;
+  size_t m_chromosome;
+  uint64_t m_cell_count;
+  Strand m_strands[2];
+  std::ofstream m_output;
+  CoverageIndexHeader m_header;
+  std::vector<CoverageIndexChromosome> m_table;
+  std::vector<std::string> m_names;
+
+  void start_chromosome()
+  {
+    for (Strand& s : m_strands)
+    {
+      s.slope.clear();
+      s.offset.clear();
+    }
+    m_cell_count = 0;
+    if (m_chromosome < m_lengths.size())
+    {
+      resize((uint64_t(m_lengths[m_chromosome]) + m_resolution - 1)/m_resolution);
+    }
+  }
+
+  void resize(uint64_t cell_count)
+  {
+    m_cell_count = cell_count;
+    for (Strand& s : m_strands)
+    {
+      s.slope.resize(cell_count + 1, 0);
+      s.offset.resize(cell_count + 1, 0);
+    }
+  }
+
+  void finish_chromosome()
+  {
+    bool wide = false;
+    for (Strand& s : m_strands)
+    {
+      int64_t slope = 0, offset = 0;
+      for (size_t k=0; k < s.offset.size(); ++k)
+      {
+        slope += s.slope[k];
+        offset += s.offset[k];
+        s.offset[k] = slope*int64_t(k*m_resolution) + offset; // C(k*resolution)
+        wide = wide || s.offset[k] - s.offset[k - k % coverage_index_checkpoint_cells] > int64_t(UINT32_MAX);
+      }
+    }
+
+    m_table[m_chromosome].data_offset = m_output.tellp();
+    m_table[m_chromosome].cell_count = m_cell_count;
+    m_table[m_chromosome].wide = wide;
+    m_table[m_chromosome].padding = 0;
+    for (const Strand& s : m_strands)
+    {
+      write_values(s.offset, wide);
+    }
+    ++m_chromosome;
+    start_chromosome();
+  }
+
+  // writes the values of C for a strand, as checkpoints and offsets unless wide
+  void write_values(const std::vector<int64_t>& values, bool wide)
+  {
+    if (wide)
+    {
+      m_output.write((const char*) values.data(), values.size()*sizeof(int64_t));
+      return;
+    }
+
+    std::vector<uint64_t> checkpoints;
+    checkpoints.reserve(coverage_index_checkpoint_count(values.size()));
+    for (size_t k=0; k < values.size(); k += coverage_index_checkpoint_cells)
+    {
+      checkpoints.push_back(values[k]);
+    }
+    m_output.write((const char*) checkpoints.data(), checkpoints.size()*sizeof(uint64_t));
+
+    // the offsets are converted a buffer at a time, so that building doesn't take more memory
+    uint32_t offsets[4096];
+    static_assert(sizeof(offsets)/sizeof(offsets[0]) % coverage_index_checkpoint_cells == 0,
+                  "a buffer of offsets must start at a checkpoint");
+    for (size_t begin=0; begin < values.size(); begin += sizeof(offsets)/sizeof(offsets[0]))
+    {
+      const size_t end = std::min(values.size(), begin + sizeof(offsets)/sizeof(offsets[0]));
+      for (size_t k=begin; k < end; ++k)
+      {
+        offsets[k - begin] = values[k] - checkpoints[k / coverage_index_checkpoint_cells];
+      }
+      m_output.write((const char*) offsets, (end - begin)*sizeof(uint32_t));
+    }
+    const char padding[8] = {};
+    m_output.write(padding, coverage_index_strand_bytes(values.size(), false)
+                            - checkpoints.size()*sizeof(uint64_t) - values.size()*sizeof(uint32_t));
+  }
+};
+
+/**
+ * A memory mapped coverage index (see above), which is thread safe since it is read only.
+ * Throws if the file can't be mapped or isn't a valid coverage index.
+ */
+class CoverageIndex
+{
+public:
+  explicit CoverageIndex(const std::string& path):
+    m_path(path),
+    m_data(nullptr),
+    m_size(0)
+  {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("failed to open coverage index " + path);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < off_t(sizeof(CoverageIndexHeader)))
+    {
+      close(fd);
+      throw std::runtime_error("invalid coverage index " + path);
+    }
+    m_size = file_stat.st_size;
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("failed to map coverage index " + path);
+    m_data = (const char*) data;
+
+    try
+    {
+      parse();
+    }
+    catch(...)
+    {
+      munmap((void*) m_data, m_size);
+      throw;
+    }
+  }
+
+  CoverageIndex(const CoverageIndex&) = delete;
+  CoverageIndex& operator=(const CoverageIndex&) = delete;
+
+  ~CoverageIndex()
+  {
+    munmap((void*) m_data, m_size);
+  }
+
+  unsigned int resolution() const { return m_header->resolution; }
+  unsigned int extendlen() const { return m_header->extendlen; }
+
+  /**
+   * Adds the counts for the query to counts (which must have room for spnum values), just
+   * like liquidate does for a bam with the index's extension length.  Nothing is counted for
+   * a chromosome the index lacks, like a bam lacking it.  Throws if extendlen isn't the index's.
+   */
+  void liquidate(const std::string& chromosome, unsigned int start, unsigned int stop,
+                 char strand, unsigned int spnum, unsigned int extendlen, double* counts) const
+  {
+    if (stop < start) throw std::runtime_error("liquidate called with stop < start");
+    if (extendlen != m_header->extendlen)
+    {
+      throw std::runtime_error("coverage index " + m_path + " is for extension length "
+                               + std::to_string(m_header->extendlen) + ", not " + std::to_string(extendlen));
+    }
+    const auto it = m_chromosomes.find(chromosome);
+    if (it == m_chromosomes.end()) return;
+
+    const unsigned int pieceLength = (stop-start) / spnum;
+    double previous = coverage(it->second, strand, start);
+    for (unsigned int i=0; i < spnum; ++i)
+    {
+      const double next = coverage(it->second, strand, start + uint64_t(pieceLength)*(i+1));
+      counts[i] += next - previous;
+      previous = next;
+    }
+  }
+
+private:
+  // a strand's values of C
+  struct Values
+  {
+    const uint64_t* checkpoints; // every value of C when offsets is null (a wide chromosome)
+    const uint32_t* offsets;
+
+    uint64_t operator[](uint64_t k) const
+    {
+      return offsets ? checkpoints[k / coverage_index_checkpoint_cells] + offsets[k] : checkpoints[k];
+    }
+  };
+
+  struct Chromosome
+  {
+    Values forward;
+    Values reverse;
+    uint64_t cell_count;
+  };
+
+  const std::string m_path;
+  const char* m_data;
+  size_t m_size;
+  const CoverageIndexHeader* m_header;
+  std::map<std::string, Chromosome> m_chromosomes;
+
+  void parse()
+  {
+    m_header = (const CoverageIndexHeader*) m_data;
+    if (std::memcmp(m_header->magic, coverage_index_magic, sizeof(coverage_index_magic)) != 0
+        || m_header->version != coverage_index_version || m_header->resolution == 0
+        || m_header->table_offset % sizeof(uint64_t) != 0 || m_header->table_offset > m_size
+        || (m_size - m_header->table_offset)/sizeof(CoverageIndexChromosome) < m_header->chromosome_count)
+    {
+      throw std::runtime_error("invalid coverage index " + m_path);
+    }
+
+    const CoverageIndexChromosome* table = (const CoverageIndexChromosome*) (m_data + m_header->table_offset);
+    for (uint32_t i=0; i < m_header->chromosome_count; ++i)
+    {
+      Chromosome chromosome;
+      chromosome.cell_count = table[i].cell_count;
+      const uint64_t values = chromosome.cell_count + 1;
+      const bool wide = table[i].wide;
+      const uint64_t strand_bytes = coverage_index_strand_bytes(values, wide);
+      if (table[i].name_offset > m_size || m_size - table[i].name_offset < table[i].name_length
+          || table[i].data_offset % sizeof(uint64_t) != 0 || table[i].data_offset > m_size
+          || table[i].wide > 1 || (m_size - table[i].data_offset)/2 < strand_bytes)
+      {
+        throw std::runtime_error("invalid coverage index " + m_path);
+      }
+      chromosome.forward = values_at(table[i].data_offset, values, wide);
+      chromosome.reverse = values_at(table[i].data_offset + strand_bytes, values, wide);
+      m_chromosomes[std::string(m_data + table[i].name_offset, table[i].name_length)] = chromosome;
+    }
+  }
+
+  Values values_at(uint64_t data_offset, uint64_t values, bool wide) const
+  {
+    Values v;
+    v.checkpoints = (const uint64_t*) (m_data + data_offset);
+    v.offsets = wide ? nullptr
+                     : (const uint32_t*) (v.checkpoints + coverage_index_checkpoint_count(values));
+    return v;
+  }
+
+  // C(position) for the strand, interpolated between multiples of the resolution
+  double coverage(const Chromosome& chromosome, char strand, uint64_t position) const
+  {
+    if (strand == '+') return coverage(chromosome.forward, chromosome.cell_count, position);
+    if (strand == '-') return coverage(chromosome.reverse, chromosome.cell_count, position);
+    return coverage(chromosome.forward, chromosome.cell_count, position)
+         + coverage(chromosome.reverse, chromosome.cell_count, position);
+  }
+
+  double coverage(const Values& values, uint64_t cell_count, uint64_t position) const
+  {
+    const uint64_t resolution = m_header->resolution;
+    position = std::min(position, cell_count*resolution);
+    const uint64_t cell = position / resolution;
+    const uint64_t remainder = position % resolution;
+    const uint64_t cell_value = values[cell];
+    double value = cell_value;
+    if (remainder != 0)
+    {
+      value += double(values[cell+1] - cell_value) * remainder / resolution;
+    }
+    return value;
+  }
+};
+
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
+
+#endif
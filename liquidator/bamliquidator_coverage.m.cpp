@@ -0,0 +1,142 @@
+#include "bamliquidator.h"
+#include "bamliquidator_coverage.h"
+#include "metrics.h"
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+using namespace liquidator;
+
+// Reads every read of the sorted bam once, writing its coverage index.
+void build_index(const std::string& bam_file_path, const std::string& index_file_path,
+                 unsigned int resolution, unsigned int extendlen)
+{
+  bamFile input = bam_open(bam_file_path.c_str(), "r");
+  if (input == 0)
+  {
+    throw std::runtime_error("failed to open " + bam_file_path);
+  }
+  bam_header_t* header = bam_header_read(input);
+  if (header == 0)
+  {
+    bam_close(input);
+    throw std::runtime_error("failed to read header of " + bam_file_path);
+  }
+
+  const std::vector<std::string> chromosomes(header->target_name, header->target_name + header->n_targets);
+  const std::vector<uint32_t> lengths(header->target_len, header->target_len + header->n_targets);
+  bam_header_destroy(header);
+
+  bam1_t* read = bam_init1();
+  try
+  {
+    CoverageIndexWriter writer(index_file_path, chromosomes, lengths, resolution, extendlen);
+    uint64_t reads = 0;
+    int rc;
+    {
+      StageTimer timer(Stage::count);
+      while ((rc = bam_read1(input, read)) >= 0)
+      {
+        ++reads;
+        char strand;
+        unsigned int start, stop;
+        if (liquidate_read_span(read, extendlen, strand, start, stop))
+        {
+          writer.add(read->core.tid, strand, start, stop);
+        }
+      }
+    }
+    if (rc < -1)
+    {
+      throw std::runtime_error("failed to read " + bam_file_path);
+    }
+    {
+      StageTimer timer(Stage::write);
+      writer.finish();
+    }
+    add_count(Counter::reads_fetched, reads);
+  }
+  catch(...)
+  {
+    bam_destroy1(read);
+    bam_close(input);
+    throw;
+  }
+  bam_destroy1(read);
+  bam_close(input);
+}
+
+int main(int argc, char* argv[])
+{
+  Metrics::start();
+
+  try
+  {
+    if (argc < 4 || argc > 5)
+    {
+      std::cerr << "usage: " << argv[0] << " bam_file resolution extension [index_file]\n"
+        << "\ne.g. " << argv[0] << " /ifs/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam 10 200"
+        << "\n\nWrites a coverage index of the sorted bam file, so that bamliquidator can answer queries"
+        << "\nfor the extension by passing it the index file in place of the bam file.  Query counts"
+        << "\nare exact when the extension is 0 and the summary points start and stop at multiples of"
+        << "\nthe resolution, and are interpolated otherwise, so exact counts for any query need"
+        << "\nresolution 1.  The index file defaults to bam_file.e<extension>" << coverage_index_extension << ","
+        << "\nand takes about 8 bytes per resolution base pairs of the genome (about 26 GB for hg19 at"
+        << "\nresolution 1), and building it takes 24 bytes of memory per resolution base pairs of the"
+        << "\nlargest chromosome (about 6 GB for hg19 at resolution 1)."
+        << std::endl;
+      return 1;
+    }
+
+    const std::string bam_file_path = argv[1];
+    const unsigned int resolution = boost::lexical_cast<unsigned int>(argv[2]);
+    const unsigned int extension = boost::lexical_cast<unsigned int>(argv[3]);
+    const std::string index_file_path = argc == 5 ? argv[4] : coverage_index_path(bam_file_path, extension);
+    if (!is_coverage_index_path(index_file_path))
+    {
+      std::cerr << "The index file must end with " << coverage_index_extension
+                << ", so that bamliquidator recognizes it" << std::endl;
+      return 1;
+    }
+
+    build_index(bam_file_path, index_file_path, resolution, extension);
+
+    write_metrics("bamliquidator_coverage");
+
+    return 0;
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << "Unhandled exception: " << e.what() << std::endl;
+
+    return 4;
+  }
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
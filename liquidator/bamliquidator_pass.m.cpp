@@ -0,0 +1,680 @@
+#include "bam_scorer.h"
+#include "bamliquidator.h"
+#include "bamliquidator_bins.h"
+#include "bamliquidator_regions.h"
+#include "bgzf_read_ahead.h"
+#include "liquidator_util.h"
+#include "metrics.h"
+#include "score_matrix.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include <tbb/pipeline.h>
+#include <tbb/task_scheduler_init.h>
+
+using namespace liquidator;
+
+// A chunk of reads passed through every analysis, along with the motif scoring results
+// (there is at most one motif analysis, since it prints to stdout).
+struct PassChunk
+{
+  BgzfChunk blocks;
+  BamReadChunk reads;
+  BamScorer::ChunkResults motif_results;
+
+  void clear()
+  {
+    blocks.clear();
+    reads.clear();
+    motif_results.clear();
+  }
+};
+
+// An analysis of every read in the bam, fed the chunks of reads in order from the single
+// decode of the bam, so that each analysis doesn't read the whole bam again.
+class Analysis
+{
+public:
+  virtual ~Analysis() {}
+
+  // called for many chunks at once, before count is called for the chunk
+  virtual void score(PassChunk& chunk) const {}
+
+  // called for each chunk in read order, one chunk at a time
+  virtual void count(const PassChunk& chunk) = 0;
+
+  // called once all of the reads have been counted
+  virtual void finish() = 0;
+};
+
+hid_t open_hdf5(const std::string& hdf5_file_path)
+{
+  hid_t h5file = H5Fopen(hdf5_file_path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+  if (h5file < 0)
+  {
+    throw std::runtime_error("Failed to open H5 file " + hdf5_file_path);
+  }
+  return h5file;
+}
+
+// Returns the bam tid of each chromosome name in the header.
+std::map<std::string, int> chromosome_tids(const bam_header_t* header)
+{
+  std::map<std::string, int> tids;
+  for (int tid = 0; tid < header->n_targets; ++tid)
+  {
+    tids.insert(std::make_pair(header->target_name[tid], tid));
+  }
+  return tids;
+}
+
+// the chromosome index of a tid that is not one of the chromosome arguments
+const size_t no_chromosome = size_t(-1);
+
+// Counts bins just like bamliquidator_bins, writing the same bin_counts (and bin_strand_counts) tables.
+class BinsAnalysis : public Analysis
+{
+public:
+  BinsAnalysis(const bam_header_t* header,
+               const std::string& cell_type,
+               const unsigned int bin_size,
+               const unsigned int extension,
+               const char strand,
+               const std::string& hdf5_file_path,
+               const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
+               const unsigned int bam_file_key):
+    cell_type(cell_type),
+    bin_size(bin_size),
+    extension(extension),
+    strand(strand),
+    hdf5_file_path(hdf5_file_path),
+    chromosome_lengths(chromosome_lengths),
+    bam_file_key(bam_file_key),
+    counts(chromosome_lengths.size()),
+    reverse_counts(strand == all_strands ? chromosome_lengths.size() : 0),
+    tid_to_chromosome(header->n_targets, no_chromosome)
+  {
+    if (bin_size == 0)
+    {
+      throw std::runtime_error("Bin size cannot be zero");
+    }
+
+    const std::map<std::string, int> tids = chromosome_tids(header);
+    for (size_t i=0; i < chromosome_lengths.size(); ++i)
+    {
+      counts[i].resize(std::ceil(chromosome_lengths[i].second / (double) bin_size), 0);
+      if (!reverse_counts.empty())
+      {
+        reverse_counts[i].resize(counts[i].size(), 0);
+      }
+      const auto tid = tids.find(chromosome_lengths[i].first);
+      if (tid != tids.end() && tid_to_chromosome[tid->second] == no_chromosome)
+      {
+        tid_to_chromosome[tid->second] = i;
+      }
+    }
+  }
+
+  void count(const PassChunk& chunk) override
+  {
+    for (size_t i=0; i < chunk.reads.size; ++i)
+    {
+      const bam1_t* read = &chunk.reads.reads[i].bam;
+      if (read->core.tid < 0) continue;
+
+      const size_t chromosome = tid_to_chromosome[read->core.tid];
+      if (chromosome == no_chromosome) continue;
+
+      std::vector<double>& bins = counts[chromosome];
+      if (reverse_counts.empty())
+      {
+        liquidate_read_bins(read, 0, bins.size(), bin_size, strand, extension, bins.data());
+      }
+      else
+      {
+        liquidate_read_strand_bins(read, 0, bins.size(), bin_size, extension, bins.data(),
+                                   reverse_counts[chromosome].data());
+      }
+    }
+  }
+
+  // appends a chromosome at a time, in the order of the chromosome arguments
+  void finish() override
+  {
+    CountH5Record empty_record;
+    empty_record.bam_file_key = bam_file_key;
+    empty_record.bin_number = 0;
+    empty_record.count      = 0;
+    copy(empty_record.cell_type, cell_type, sizeof(CountH5Record::cell_type));
+    copy(empty_record.chromosome, "", sizeof(CountH5Record::chromosome));
+
+    hid_t h5file = open_hdf5(hdf5_file_path);
+    std::vector<CountH5Record> records;
+    std::vector<StrandCountH5Record> strand_records;
+    for (size_t i=0; i < chromosome_lengths.size(); ++i)
+    {
+      records.assign(counts[i].size(), empty_record);
+      strand_records.resize(reverse_counts.empty() ? 0 : records.size());
+      for (size_t bin=0; bin < records.size(); ++bin)
+      {
+        records[bin].bin_number = bin;
+        records[bin].count = counts[i][bin];
+        copy(records[bin].chromosome, chromosome_lengths[i].first, sizeof(CountH5Record::chromosome));
+        if (!strand_records.empty())
+        {
+          records[bin].count += reverse_counts[i][bin];
+          strand_records[bin] = strand_record(records[bin], counts[i][bin], reverse_counts[i][bin]);
+        }
+      }
+      if (!records.empty())
+      {
+        write(h5file, records);
+      }
+      if (!strand_records.empty())
+      {
+        write(h5file, strand_records);
+        std::vector<double>().swap(reverse_counts[i]);
+      }
+      std::vector<double>().swap(counts[i]);
+    }
+    H5Fclose(h5file);
+  }
+
+private:
+  const std::string cell_type;
+  const unsigned int bin_size;
+  const unsigned int extension;
+  const char strand;
+  const std::string hdf5_file_path;
+  const std::vector<std::pair<std::string, size_t>> chromosome_lengths;
+  const unsigned int bam_file_key;
+
+  // for each chromosome argument, with counts of the forward strand and reverse_counts of the reverse
+  // strand when counting all strands
+  std::vector<std::vector<double>> counts;
+  std::vector<std::vector<double>> reverse_counts;
+  std::vector<size_t> tid_to_chromosome; // index of the chromosome argument, or no_chromosome
+};
+
+// Counts regions just like bamliquidator_regions, writing the same region_counts (and
+// region_strand_counts) tables.
+class RegionsAnalysis : public Analysis
+{
+public:
+  RegionsAnalysis(const bam_header_t* header,
+                  const std::string& region_file_path,
+                  const std::string& region_format,
+                  const unsigned int extension,
+                  const char strand,
+                  const std::string& hdf5_file_path,
+                  const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
+                  const unsigned int bam_file_key):
+    hdf5_file_path(hdf5_file_path),
+    count_all_strands(strand == all_strands),
+    chromosomes(header->n_targets)
+  {
+    std::map<std::string, size_t> chromosome_to_length;
+    for (auto& chr_length : chromosome_lengths)
+    {
+      chromosome_to_length[chr_length.first] = chr_length.second;
+    }
+
+    regions = parse_regions(region_file_path, region_format, bam_file_key, chromosome_to_length,
+                            count_all_strands ? '.' : strand);
+    if (regions.size() == 0)
+    {
+      Logger::warn() << "No valid regions detected in " << region_file_path;
+      return;
+    }
+
+    // the regions of a chromosome that the bam lacks keep their count of 0
+    const std::map<std::string, int> tids = chromosome_tids(header);
+    for (size_t i=0; i < regions.size(); ++i)
+    {
+      const auto tid = tids.find(regions[i].chromosome);
+      if (tid != tids.end())
+      {
+        chromosomes[tid->second].indexes.push_back(i);
+      }
+    }
+
+    for (ChromosomeRegions& chromosome : chromosomes)
+    {
+      std::stable_sort(chromosome.indexes.begin(), chromosome.indexes.end(), [&](size_t a, size_t b) {
+        return regions[a].start < regions[b].start;
+      });
+
+      // when counting all strands, each region is counted as adjacent forward and reverse regions
+      const size_t copies = count_all_strands ? 2 : 1;
+      chromosome.regions.resize(chromosome.indexes.size()*copies);
+      for (size_t i=0; i < chromosome.regions.size(); ++i)
+      {
+        const Region& region = regions[chromosome.indexes[i/copies]];
+        chromosome.regions[i].start = region.start;
+        chromosome.regions[i].stop = region.stop;
+        chromosome.regions[i].strand = copies == 1 ? region.strand : i % 2 == 0 ? '+' : '-';
+      }
+      if (!chromosome.regions.empty())
+      {
+        chromosome.counter.reset(new RegionsCounter(chromosome.regions.data(), chromosome.regions.size(), extension));
+      }
+    }
+  }
+
+  void count(const PassChunk& chunk) override
+  {
+    for (size_t i=0; i < chunk.reads.size; ++i)
+    {
+      const bam1_t* read = &chunk.reads.reads[i].bam;
+      if (read->core.tid < 0) continue;
+
+      RegionsCounter* counter = chromosomes[read->core.tid].counter.get();
+      if (counter != nullptr)
+      {
+        counter->count(read);
+      }
+    }
+  }
+
+  // the regions are written in their original order
+  void finish() override
+  {
+    if (regions.size() == 0) return;
+
+    // the regions of a chromosome that the bam lacks keep their counts of 0
+    std::vector<RegionStrandCounts> strand_counts;
+    if (count_all_strands)
+    {
+      for (const Region& region : regions)
+      {
+        strand_counts.push_back(liquidator::strand_counts(region, 0, 0));
+      }
+    }
+    for (const ChromosomeRegions& chromosome : chromosomes)
+    {
+      for (size_t i=0; i < chromosome.indexes.size(); ++i)
+      {
+        Region& region = regions[chromosome.indexes[i]];
+        if (count_all_strands)
+        {
+          const double forward = chromosome.regions[2*i].count;
+          const double reverse = chromosome.regions[2*i + 1].count;
+          region.count = forward + reverse;
+          strand_counts[chromosome.indexes[i]] = liquidator::strand_counts(region, forward, reverse);
+        }
+        else
+        {
+          region.count = chromosome.regions[i].count;
+        }
+      }
+    }
+
+    hid_t h5file = open_hdf5(hdf5_file_path);
+    write(h5file, regions);
+    if (count_all_strands)
+    {
+      write(h5file, strand_counts);
+    }
+    H5Fclose(h5file);
+  }
+
+private:
+  // The regions on a single chromosome, sorted by start, with their indexes in regions.
+  struct ChromosomeRegions
+  {
+    std::vector<size_t> indexes;
+    std::vector<LiquidatedRegion> regions;
+    std::unique_ptr<RegionsCounter> counter;
+  };
+
+  const std::string hdf5_file_path;
+  const bool count_all_strands;
+  std::vector<Region> regions;
+  std::vector<ChromosomeRegions> chromosomes; // by tid
+};
+
+// Scores the reads just like motif_liquidator does for a whole bam, printing the same output.
+class MotifAnalysis : public Analysis
+{
+public:
+  MotifAnalysis(bam_header_t* header,
+                const std::string& motif_file_path,
+                const std::string& background_file_path,
+                const BamScorer::PrintStyle print_style,
+                const bool only_score_unmapped,
+                const std::string& bam_output_file_path)
+  {
+    std::array<double, AlphabetSize> background = ScoreMatrix::default_acgt_background;
+    if (!background_file_path.empty())
+    {
+      std::ifstream background_file(background_file_path);
+      if (!background_file)
+      {
+        throw std::runtime_error("failed to open background file " + background_file_path);
+      }
+      background = ScoreMatrix::read_background(background_file);
+    }
+
+    std::ifstream motif_file(motif_file_path);
+    if (!motif_file)
+    {
+      throw std::runtime_error("failed to open motif file " + motif_file_path);
+    }
+    matrices = ScoreMatrix::read(motif_file, background);
+
+    scorer.reset(new BamScorer(header, matrices, print_style, only_score_unmapped, bam_output_file_path));
+  }
+
+  void score(PassChunk& chunk) const override
+  {
+    scorer->score(chunk.reads, chunk.motif_results);
+  }
+
+  void count(const PassChunk& chunk) override
+  {
+    scorer->write(chunk.reads, chunk.motif_results);
+  }
+
+  // prints the summary
+  void finish() override
+  {
+    std::cout.flush();
+    scorer.reset();
+  }
+
+private:
+  std::vector<ScoreMatrix> matrices;
+  std::unique_ptr<BamScorer> scorer;
+};
+
+// Decodes the bam once, passing the reads through every analysis with a tbb pipeline: a
+// serial stage reads chunks of BGZF blocks, a parallel stage inflates them, a serial stage
+// parses their reads, a parallel stage scores each chunk for the motif analysis, and each
+// analysis then counts the chunks in order in its own serial stage, so the analyses count
+// different chunks at the same time.
+void analyze(BgzfReadAhead& input, std::vector<std::unique_ptr<Analysis>>& analyses)
+{
+  const size_t max_chunks_in_flight = CHUNKS_PER_THREAD * tbb::task_scheduler_init::default_num_threads();
+  bool reading = true;
+  ChunkPool<PassChunk> chunks;
+
+  tbb::filter_t<PassChunk*, PassChunk*> stages = tbb::make_filter<PassChunk*, PassChunk*>(tbb::filter::parallel,
+    [&](PassChunk* chunk) -> PassChunk*
+    {
+      StageTimer timer(Stage::score);
+      for (const auto& analysis : analyses)
+      {
+        analysis->score(*chunk);
+      }
+      return chunk;
+    });
+  for (const auto& analysis : analyses)
+  {
+    Analysis* counter = analysis.get();
+    stages = stages & tbb::make_filter<PassChunk*, PassChunk*>(tbb::filter::serial_in_order,
+      [counter](PassChunk* chunk) -> PassChunk*
+      {
+        StageTimer timer(Stage::count);
+        counter->count(*chunk);
+        return chunk;
+      });
+  }
+
+  tbb::parallel_pipeline(max_chunks_in_flight,
+    tbb::make_filter<void, PassChunk*>(tbb::filter::serial_in_order,
+      [&](tbb::flow_control& fc) -> PassChunk*
+      {
+        PassChunk* chunk = nullptr;
+        if (reading)
+        {
+          chunk = chunks.acquire();
+          StageTimer timer(Stage::fetch);
+          reading = input.read(chunk->blocks);
+        }
+        if (chunk == nullptr || chunk->blocks.block_ends.empty())
+        {
+          if (chunk)
+          {
+            chunks.release(chunk);
+          }
+          chunk = nullptr;
+          fc.stop();
+        }
+        return chunk;
+      })
+    & tbb::make_filter<PassChunk*, PassChunk*>(tbb::filter::parallel,
+      [&](PassChunk* chunk) -> PassChunk*
+      {
+        StageTimer timer(Stage::inflate);
+        BgzfReadAhead::inflate(chunk->blocks);
+        return chunk;
+      })
+    & tbb::make_filter<PassChunk*, PassChunk*>(tbb::filter::serial_in_order,
+      [&](PassChunk* chunk) -> PassChunk*
+      {
+        StageTimer timer(Stage::fetch);
+        input.parse(chunk->blocks, chunk->reads);
+        count_fetched(chunk->reads);
+        return chunk;
+      })
+    & stages
+    & tbb::make_filter<PassChunk*, void>(tbb::filter::parallel,
+      [&](PassChunk* chunk)
+      {
+        chunks.release(chunk);
+      }));
+  input.finish();
+
+  for (const auto& analysis : analyses)
+  {
+    analysis->finish();
+  }
+}
+
+// Parses "chromosome_count chr1 length1 ..." starting at argv[arg], leaving arg after it.
+std::vector<std::pair<std::string, size_t>> parse_chromosome_lengths(int argc, char* argv[], int& arg)
+{
+  if (arg >= argc)
+  {
+    throw std::runtime_error("missing chromosome count");
+  }
+  const size_t chromosome_count = boost::lexical_cast<size_t>(argv[arg++]);
+  if (arg + 2*chromosome_count > size_t(argc))
+  {
+    throw std::runtime_error("missing chromosome lengths");
+  }
+
+  std::vector<std::pair<std::string, size_t>> chromosome_lengths;
+  for (size_t i=0; i < chromosome_count; ++i, arg += 2)
+  {
+    chromosome_lengths.push_back(std::make_pair(argv[arg], boost::lexical_cast<size_t>(argv[arg+1])));
+  }
+  return chromosome_lengths;
+}
+
+// Parses the analysis arguments starting at argv[arg], leaving arg after them.
+std::unique_ptr<Analysis> parse_analysis(int argc, char* argv[], int& arg, bam_header_t* header,
+                                         const unsigned int bam_file_key)
+{
+  const std::string type = argv[arg++];
+  const int argument_count = 5; // before any chromosome lengths
+  if (arg + argument_count > argc)
+  {
+    throw std::runtime_error("missing arguments for " + type + " analysis");
+  }
+
+  if (type == "bins")
+  {
+    const std::string cell_type = argv[arg];
+    const unsigned int bin_size = boost::lexical_cast<unsigned int>(argv[arg+1]);
+    const unsigned int extension = boost::lexical_cast<unsigned int>(argv[arg+2]);
+    const char strand = boost::lexical_cast<char>(argv[arg+3]);
+    const std::string hdf5_file_path = argv[arg+4];
+    arg += argument_count;
+    const std::vector<std::pair<std::string, size_t>> chromosome_lengths = parse_chromosome_lengths(argc, argv, arg);
+    return std::unique_ptr<Analysis>(new BinsAnalysis(header, cell_type, bin_size, extension, strand, hdf5_file_path,
+                                                      chromosome_lengths, bam_file_key));
+  }
+  if (type == "regions")
+  {
+    const std::string region_file_path = argv[arg];
+    const std::string region_format = argv[arg+1];
+    const unsigned int extension = boost::lexical_cast<unsigned int>(argv[arg+2]);
+    const char strand = boost::lexical_cast<char>(argv[arg+3]);
+    const std::string hdf5_file_path = argv[arg+4];
+    arg += argument_count;
+    const std::vector<std::pair<std::string, size_t>> chromosome_lengths = parse_chromosome_lengths(argc, argv, arg);
+    return std::unique_ptr<Analysis>(new RegionsAnalysis(header, region_file_path, region_format, extension, strand,
+                                                         hdf5_file_path, chromosome_lengths, bam_file_key));
+  }
+  if (type == "motifs")
+  {
+    const std::string motif_file_path = argv[arg];
+    const std::string background_file_path = std::string(argv[arg+1]) == "-" ? "" : argv[arg+1];
+    const std::string print_argument = argv[arg+2];
+    const bool only_score_unmapped = boost::lexical_cast<bool>(argv[arg+3]);
+    const std::string bam_output_file_path = std::string(argv[arg+4]) == "-" ? "" : argv[arg+4];
+    arg += argument_count;
+
+    BamScorer::PrintStyle print_style = BamScorer::None;
+    if (print_argument == "fimo")
+    {
+      print_style = BamScorer::Fimo;
+    }
+    else if (print_argument == "mapped-fimo")
+    {
+      print_style = BamScorer::MappedFimo;
+    }
+    else if (print_argument != "none")
+    {
+      throw std::runtime_error("invalid motif print argument '" + print_argument + "'");
+    }
+    return std::unique_ptr<Analysis>(new MotifAnalysis(header, motif_file_path, background_file_path, print_style,
+                                                       only_score_unmapped, bam_output_file_path));
+  }
+  throw std::runtime_error("unknown analysis type '" + type + "'");
+}
+
+int main(int argc, char* argv[])
+{
+  try
+  {
+    Metrics::start();
+
+    if (argc < 7)
+    {
+      std::cerr << "usage: " << argv[0] << " number_of_threads bam_file bam_file_key log_file write_warnings_to_stderr "
+        << "analysis ...\n"
+        << "\nwhere each analysis is one of:"
+        << "\n  bins cell_type bin_size extension strand hdf5_file chromosome_count chr1 length1 ..."
+        << "\n  regions region_file gff_or_bed_format extension strand hdf5_file chromosome_count chr1 length1 ..."
+        << "\n  motifs motif_file background_file none|fimo|mapped-fimo only_score_unmapped output_bam\n"
+        << "\ne.g. " << argv[0] << " 0 /ifs/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam 137 output/log.txt 1"
+        << "\n      bins mm1s 100000 0 . bins_100000/counts.h5 2 chr1 247249719 chr2 242951149"
+        << "\n      bins mm1s 1000 0 . bins_1000/counts.h5 2 chr1 247249719 chr2 242951149"
+        << "\n      regions HG19_SUM159_BRD4_-0_+0.gff gff 0 _ regions/counts.h5 2 chr1 247249719 chr2 242951149\n"
+        << "\nThe bam is decoded once for all of the analyses, and each analysis writes its output exactly as"
+        << "\nbamliquidator_bins, bamliquidator_regions, or motif_liquidator (for a whole bam) would, with the"
+        << "\nmotif output printed to stdout (at most one motifs analysis is allowed). A background_file"
+        << "\nor output_bam of - means none. Strand, extension, hdf5_file and chromosome arguments are the same as"
+        << "\nfor bamliquidator_bins and bamliquidator_regions."
+        << "\nnumber of threads <= 0 means use a number of threads equal to the number of logical cpus."
+        << std::endl;
+      return 1;
+    }
+
+    const int number_of_threads = boost::lexical_cast<int>(argv[1]);
+    const std::string bam_file_path = argv[2];
+    const unsigned int bam_file_key = boost::lexical_cast<unsigned int>(argv[3]);
+    const std::string log_file_path = argv[4];
+    const bool write_warnings_to_stderr = boost::lexical_cast<bool>(argv[5]);
+
+    tbb::task_scheduler_init init( number_of_threads <= 0
+                                 ? tbb::task_scheduler_init::automatic
+                                 : number_of_threads);
+
+    Logger::configure(log_file_path, write_warnings_to_stderr);
+
+    bamFile input = bam_open(bam_file_path.c_str(), "r");
+    if (input == 0)
+    {
+      Logger::error() << "Failed to open " << bam_file_path;
+      return 3;
+    }
+    bam_header_t* header = bam_header_read(input);
+    if (header == 0)
+    {
+      Logger::error() << "Failed to read header of " << bam_file_path;
+      bam_close(input);
+      return 3;
+    }
+
+    {
+      std::vector<std::unique_ptr<Analysis>> analyses;
+      size_t motif_analyses = 0;
+      for (int arg = 6; arg < argc; )
+      {
+        motif_analyses += std::string(argv[arg]) == "motifs";
+        analyses.push_back(parse_analysis(argc, argv, arg, header, bam_file_key));
+      }
+      if (motif_analyses > 1)
+      {
+        throw std::runtime_error("at most one motifs analysis is allowed, since it prints to stdout");
+      }
+
+      BgzfReadAhead read_ahead(bam_file_path, bam_tell(input));
+      analyze(read_ahead, analyses);
+    }
+
+    bam_header_destroy(header);
+    bam_close(input);
+
+    log_metrics("bamliquidator_pass");
+
+    return 0;
+  }
+  catch(const std::exception& e)
+  {
+    Logger::error() << "Unhandled exception: " << e.what();
+
+    return 4;
+  }
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
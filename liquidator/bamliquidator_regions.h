@@ -2,17 +2,22 @@
 #define PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_REGIONS_H
 
 #include "liquidator_util.h"
+#include "metrics.h"
 
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
-#include <boost/algorithm/string.hpp>
+#include <tbb/parallel_for.h>
 
-#include <map>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -51,6 +56,34 @@ struct Region
   }
 };
 
+// The forward and reverse strand counts of a region, written alongside its Region (with the
+// counts of both strands) when all strands are counted at once.
+// This RegionStrandCounts must match exactly the structure in HDF5
+// -- see bamliquidator_batch.py function create_strand_counts_table
+struct RegionStrandCounts
+{
+  uint32_t bam_file_key;
+  char chromosome[64];
+  char region_name[region_name_length];
+  uint64_t start;
+  uint64_t stop;
+  uint64_t forward_count;
+  uint64_t reverse_count;
+};
+
+inline RegionStrandCounts strand_counts(const Region& region, uint64_t forward_count, uint64_t reverse_count)
+{
+  RegionStrandCounts counts;
+  counts.bam_file_key = region.bam_file_key;
+  std::memcpy(counts.chromosome, region.chromosome, sizeof(counts.chromosome));
+  std::memcpy(counts.region_name, region.region_name, sizeof(counts.region_name));
+  counts.start = region.start;
+  counts.stop = region.stop;
+  counts.forward_count = forward_count;
+  counts.reverse_count = reverse_count;
+  return counts;
+}
+
 inline std::ostream& operator<<(std::ostream& os, const Region& r)
 {
   os << "bam file key " << r.bam_file_key << ' ' << r.chromosome << ' '
@@ -59,8 +92,78 @@ inline std::ostream& operator<<(std::ostream& os, const Region& r)
   return os;
 }
 
+namespace detail
+{
+
+// Region files are parsed in chunks of about region_chunk_size bytes (cut on line boundaries) in parallel
+const size_t region_chunk_size = 1 << 20;
+
+// a column of a region file line, pointing into the file
+struct RegionField
+{
+  const char* begin;
+  const char* end;
+
+  size_t size() const
+  {
+    return end - begin;
+  }
+
+  std::string str() const
+  {
+    return std::string(begin, end);
+  }
+};
+
+// The regions parsed from a chunk of lines, along with the warnings to log (in order). Parsing stops at
+// the first error, which is thrown after the warnings from the lines before it are logged.
+struct RegionChunk
+{
+  const char* begin;
+  const char* end;
+  int first_line_number;
+
+  std::vector<Region> regions;
+  std::vector<std::string> warnings;
+  std::string error;
+};
+
+// Parses a coordinate the same way boost::lexical_cast<uint64_t> does (an optional sign and then only digits,
+// with a negative value wrapping), returning false if the field isn't a valid uint64_t.
+inline bool parse_coordinate(const RegionField& field, uint64_t& coordinate)
+{
+  const char* c = field.begin;
+  const bool negative = c != field.end && *c == '-';
+  if (c != field.end && (*c == '-' || *c == '+'))
+  {
+    ++c;
+  }
+  if (c == field.end)
+  {
+    return false;
+  }
+
+  uint64_t value = 0;
+  for (; c != field.end; ++c)
+  {
+    const unsigned digit = unsigned(*c) - '0';
+    if (digit > 9 || value > (UINT64_MAX - digit) / 10)
+    {
+      return false;
+    }
+    value = value*10 + digit;
+  }
+  coordinate = negative ? 0 - value : value;
+  return true;
+}
+
+}
+
 // default_strand: optional argument, default _ indicates to use 
 //                 gff strand column or . (both) for .bed region file
+//
+// The file is memory mapped (or read into memory if it isn't a regular file), and its lines are split into
+// columns in place, so parsing doesn't allocate per line.
 inline
 std::vector<Region> parse_regions(const std::string& region_file_path,
                                   const std::string& region_format,
@@ -70,6 +173,8 @@ std::vector<Region> parse_regions(const std::string& region_file_path,
 {
   using namespace liquidator;
 
+  StageTimer timer(Stage::region_parse);
+
   unsigned int chromosome_column = 0;
   unsigned int name_column = 0;
   unsigned int start_column = 0;
@@ -101,82 +206,245 @@ std::vector<Region> parse_regions(const std::string& region_file_path,
                              + "), please supply a .gff or .bed file");
   }
 
-  std::ifstream region_file(region_file_path.c_str());
-  if (!region_file.is_open())
+  std::unique_ptr<MappedFile> mapped_file;
+  try
+  {
+    mapped_file.reset(new MappedFile(region_file_path));
+  }
+  catch(const std::exception&)
   {
     throw std::runtime_error("failed to open region_file " + region_file_path);
   }
+  std::string streamed_contents;
+  if (!mapped_file->is_mapped())
+  {
+    std::ifstream region_file(region_file_path.c_str());
+    streamed_contents.assign(std::istreambuf_iterator<char>(region_file), std::istreambuf_iterator<char>());
+  }
+  const char* contents = mapped_file->is_mapped() ? mapped_file->data() : streamed_contents.data();
+  const size_t contents_size = mapped_file->is_mapped() ? mapped_file->size() : streamed_contents.size();
 
-  std::vector<Region> regions;
+  std::vector<detail::RegionChunk> chunks;
+  for (size_t begin = 0; begin < contents_size; )
+  {
+    size_t end = std::min(begin + detail::region_chunk_size, contents_size);
+    const void* line_end = std::memchr(contents + end - 1, '\n', contents_size - end + 1);
+    end = line_end == 0 ? contents_size : static_cast<const char*>(line_end) - contents + 1;
+    chunks.push_back(detail::RegionChunk{contents + begin, contents + end, 0});
+    begin = end;
+  }
+
+  // the line numbers of each chunk are only known once the lines before it are counted
+  tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i)
+  {
+    chunks[i].first_line_number = std::count(chunks[i].begin, chunks[i].end, '\n');
+  });
   int line_number = 1;
-  for(std::string line; std::getline(region_file, line); ++line_number)
+  for (auto& chunk : chunks)
   {
-    std::vector<std::string> columns;
-    boost::split(columns, line, boost::is_any_of("\t"));
-    if (columns.size() < min_columns)
-    {
-      std::stringstream ss;
-      ss << "Not enough columns parsing line " << line_number << " '" << line << "' of " << region_file_path;
-      throw std::runtime_error(ss.str());
-    }
-    Region region;
-    region.bam_file_key = bam_file_key; 
-    copy(region.chromosome,  columns[chromosome_column], sizeof(Region::chromosome));
-    if (columns.size() > name_column)
+    const int line_count = chunk.first_line_number;
+    chunk.first_line_number = line_number;
+    line_number += line_count;
+  }
+
+  const size_t max_column = std::max(std::max(chromosome_column, name_column),
+                                     std::max(std::max(start_column, stop_column), strand_column));
+
+  tbb::parallel_for(size_t(0), chunks.size(), [&](size_t chunk_index)
+  {
+    detail::RegionChunk& chunk = chunks[chunk_index];
+    std::vector<detail::RegionField> columns(max_column + 1);
+    int line_number = chunk.first_line_number;
+    for (const char* line = chunk.begin; line < chunk.end; ++line_number)
     {
-      copy(region.region_name, columns[name_column], sizeof(Region::region_name));
-      if (columns[name_column].size() >= sizeof(Region::region_name))
+      const char* line_end = static_cast<const char*>(std::memchr(line, '\n', chunk.end - line));
+      if (line_end == 0)
       {
-        Logger::warn() << "Truncated region on line " << line_number << " from '" << columns[name_column] << "' to '" << region.region_name << "'";
+        line_end = chunk.end;
       }
-    }
-    else
-    {
-      copy(region.region_name, "", sizeof(Region::region_name));
-    }
-    region.start = boost::lexical_cast<uint64_t>(columns[start_column]);
-    region.stop  = boost::lexical_cast<uint64_t>(columns[stop_column]);
-    if (region.start > region.stop)
-    {
-      std::swap(region.start, region.stop);
-    }
 
-    if (columns.size() > strand_column)
-    {
-      if (columns[strand_column].size() != 1)
+      size_t column_count = 0;
+      for (const char* column = line; ; ++column_count)
+      {
+        const char* column_end = static_cast<const char*>(std::memchr(column, '\t', line_end - column));
+        if (column_end == 0)
+        {
+          column_end = line_end;
+        }
+        if (column_count <= max_column)
+        {
+          columns[column_count] = detail::RegionField{column, column_end};
+        }
+        if (column_end == line_end)
+        {
+          ++column_count;
+          break;
+        }
+        column = column_end + 1;
+      }
+
+      if (column_count < min_columns)
       {
         std::stringstream ss;
-        ss << "error parsing strand: '" << columns[strand_column] << "' on line " << line_number;
-        throw std::runtime_error(ss.str());
+        ss << "Not enough columns parsing line " << line_number << " '" << std::string(line, line_end) << "' of " << region_file_path;
+        chunk.error = ss.str();
+        return;
       }
-      region.strand = default_strand == '_'
-                    ? columns[strand_column][0]
-                    : default_strand;
-    }
-    else
-    {
-      region.strand = default_strand == '_'
-                    ? '.'
-                    : default_strand; 
+
+      Region region;
+      region.bam_file_key = bam_file_key; 
+      const detail::RegionField& chromosome = columns[chromosome_column];
+      copy(region.chromosome, chromosome.begin, chromosome.size(), sizeof(Region::chromosome));
+      if (column_count > name_column)
+      {
+        const detail::RegionField& name = columns[name_column];
+        copy(region.region_name, name.begin, name.size(), sizeof(Region::region_name));
+        if (name.size() >= sizeof(Region::region_name))
+        {
+          std::stringstream ss;
+          ss << "Truncated region on line " << line_number << " from '" << name.str() << "' to '" << region.region_name << "'";
+          chunk.warnings.push_back(ss.str());
+        }
+      }
+      else
+      {
+        copy(region.region_name, "", sizeof(Region::region_name));
+      }
+      if (!detail::parse_coordinate(columns[start_column], region.start)
+          || !detail::parse_coordinate(columns[stop_column], region.stop))
+      {
+        std::stringstream ss;
+        ss << "error parsing start or stop: '" << columns[start_column].str() << "', '" << columns[stop_column].str()
+           << "' on line " << line_number << " of " << region_file_path;
+        chunk.error = ss.str();
+        return;
+      }
+      if (region.start > region.stop)
+      {
+        std::swap(region.start, region.stop);
+      }
+
+      if (column_count > strand_column)
+      {
+        const detail::RegionField& strand = columns[strand_column];
+        if (strand.size() != 1)
+        {
+          std::stringstream ss;
+          ss << "error parsing strand: '" << strand.str() << "' on line " << line_number;
+          chunk.error = ss.str();
+          return;
+        }
+        region.strand = default_strand == '_'
+                      ? *strand.begin
+                      : default_strand;
+      }
+      else
+      {
+        region.strand = default_strand == '_'
+                      ? '.'
+                      : default_strand; 
+      }
+      region.count = 0;
+      region.normalized_count = 0.0;
+
+      if (chromosome_to_length.empty() || region.is_valid(chromosome_to_length))
+      {
+        chunk.regions.push_back(region);
+      }
+      else
+      {
+        std::stringstream ss;
+        ss << "Excluding invalid region on line " << line_number << ": " << region;
+        chunk.warnings.push_back(ss.str());
+      }
+
+      line = line_end + 1;
     }
-    region.count = 0;
-    region.normalized_count = 0.0;
+  });
+
+  size_t region_count = 0;
+  for (const auto& chunk : chunks)
+  {
+    region_count += chunk.regions.size();
+  }
 
-    if (chromosome_to_length.empty() || region.is_valid(chromosome_to_length))
+  std::vector<Region> regions;
+  regions.reserve(region_count);
+  for (const auto& chunk : chunks)
+  {
+    for (const auto& warning : chunk.warnings)
     {
-      regions.push_back(region);
+      Logger::warn() << warning;
     }
-    else
+    if (!chunk.error.empty())
     {
-      Logger::warn() << "Excluding invalid region on line " << line_number << ": " << region;
+      throw std::runtime_error(chunk.error);
     }
+    regions.insert(regions.end(), chunk.regions.begin(), chunk.regions.end());
   }
 
+  add_count(Counter::regions, regions.size());
   return regions;
 }
 
+// Regions are counted in tiles of nearby regions on the same chromosome, so that reads
+// for overlapping regions (e.g. stitched enhancers and their --match_bamToGFF companions)
+// are fetched once per tile instead of once per region.  A region joins the current tile
+// if it starts within tile_gap of the tile's stop, as long as the tile isn't already
+// spanning max_tile_length (the bam blocks between close regions are typically read anyway).
+const uint64_t tile_gap = 2000;
+const uint64_t max_tile_length = 1000000;
+
+// A tile is a range of indexes into the sorted region indexes.
+struct Tile
+{
+  size_t begin;
+  size_t end;
+};
+
+// Returns the region indexes sorted by (chromosome, start), and sets tiles.
+inline std::vector<size_t> sort_into_tiles(const std::vector<Region>& regions, std::vector<Tile>& tiles)
+{
+  std::vector<size_t> sorted(regions.size());
+  for (size_t i=0; i < sorted.size(); ++i)
+  {
+    sorted[i] = i;
+  }
+  std::sort(sorted.begin(), sorted.end(), [&](size_t a, size_t b) {
+    const int chromosome_compare = strcmp(regions[a].chromosome, regions[b].chromosome);
+    if (chromosome_compare != 0) return chromosome_compare < 0;
+    return regions[a].start < regions[b].start;
+  });
+
+  tiles.clear();
+  for (size_t i=0; i < sorted.size(); )
+  {
+    Tile tile;
+    tile.begin = i;
+    const Region& first = regions[sorted[i]];
+    uint64_t tile_stop = first.stop;
+    for (++i; i < sorted.size(); ++i)
+    {
+      const Region& region = regions[sorted[i]];
+      if (strcmp(region.chromosome, first.chromosome) != 0
+          || region.start > tile_stop + tile_gap
+          || tile_stop - first.start > max_tile_length)
+      {
+        break;
+      }
+      tile_stop = std::max(tile_stop, region.stop);
+    }
+    tile.end = i;
+    tiles.push_back(tile);
+  }
+
+  return sorted;
+}
+
 inline void write(hid_t& file, std::vector<Region>& regions)
 {
+  StageTimer timer(Stage::write);
+
   const size_t record_size = sizeof(Region);
 
   size_t record_offset[] = { HOFFSET(Region, bam_file_key),
@@ -207,6 +475,38 @@ inline void write(hid_t& file, std::vector<Region>& regions)
   }
 }
 
+inline void write(hid_t& file, std::vector<RegionStrandCounts>& counts)
+{
+  StageTimer timer(Stage::write);
+
+  const size_t record_size = sizeof(RegionStrandCounts);
+
+  size_t record_offset[] = { HOFFSET(RegionStrandCounts, bam_file_key),
+                             HOFFSET(RegionStrandCounts, chromosome),
+                             HOFFSET(RegionStrandCounts, region_name),
+                             HOFFSET(RegionStrandCounts, start),
+                             HOFFSET(RegionStrandCounts, stop),
+                             HOFFSET(RegionStrandCounts, forward_count),
+                             HOFFSET(RegionStrandCounts, reverse_count) };
+
+  size_t field_sizes[] = { sizeof(RegionStrandCounts::bam_file_key),
+                           sizeof(RegionStrandCounts::chromosome),
+                           sizeof(RegionStrandCounts::region_name),
+                           sizeof(RegionStrandCounts::start),
+                           sizeof(RegionStrandCounts::stop),
+                           sizeof(RegionStrandCounts::forward_count),
+                           sizeof(RegionStrandCounts::reverse_count) };
+
+  herr_t status = H5TBappend_records(file, "region_strand_counts", counts.size(), record_size, record_offset,
+                                     field_sizes, counts.data());
+  if (status != 0)
+  {
+    std::stringstream ss;
+    ss << "Error appending strand record, status = " << status;
+    throw std::runtime_error(ss.str());
+  }
+}
+
 }
 
 #endif
@@ -1,11 +1,16 @@
 #include "bamliquidator.h"
 #include "liquidator_util.h"
 #include "bamliquidator_regions.h"
+#include "bamliquidator_shards.h"
+#include "metrics.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -16,9 +21,8 @@
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
-#include <tbb/blocked_range.h>
 #include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
+#include <tbb/pipeline.h>
 #include <tbb/task_scheduler_init.h>
 
 //#define time_region_parsing
@@ -55,15 +59,10 @@ public:
     samclose(fp);
   }
 
-  double liquidate(const std::string& chromosome, int start, int stop, char strand, unsigned int extension)
+  void liquidate_regions(const std::string& chromosome, LiquidatedRegion* regions, size_t region_count,
+                         unsigned int extension)
   {
-    std::vector<double> counts = ::liquidate(fp, bamidx, chromosome, start, stop, strand, 1, extension);
-    if (counts.size() != 1)
-    {
-      throw std::runtime_error("liquidate failed to provide exactly one count (count is " +
-        boost::lexical_cast<std::string>(counts.size()) + ")");
-    }
-    return counts[0];
+    ::liquidate_regions(fp, bamidx, chromosome, regions, region_count, extension);
   }
 
 private:
@@ -73,6 +72,7 @@ private:
 
   void init()
   {
+    StageTimer timer(Stage::index_load);
     fp = samopen(bam_file_path.c_str(),"rb",0);
     if(fp == NULL)
     {
@@ -92,58 +92,216 @@ typedef tbb::enumerable_thread_specific<Liquidator,
                                         tbb::ets_key_per_instance>
         Liquidators;
 
-void liquidate_regions(std::vector<Region>& regions, const std::string& bam_file_path,
-                       size_t region_begin, size_t region_end, unsigned int extension,
-                       Liquidators& liquidators)
+// Counts the regions of the tile, or when strand_counts isn't null, counts the forward and reverse
+// strands of each region from the same fetch, setting both the region's count (of both strands)
+// and its strand counts.
+void liquidate_tile(std::vector<Region>& regions, const std::vector<size_t>& sorted, const Tile& tile,
+                    unsigned int extension, Liquidators& liquidators,
+                    std::vector<RegionStrandCounts>* strand_counts)
 {
   Liquidator& liquidator = liquidators.local();
 
-  for (size_t i=region_begin; i < region_end; ++i)
+  // when counting strands, each region is counted as adjacent forward and reverse regions
+  const size_t copies = strand_counts == nullptr ? 1 : 2;
+  std::vector<LiquidatedRegion> tile_regions((tile.end - tile.begin)*copies);
+  for (size_t i=tile.begin; i < tile.end; ++i)
+  {
+    const Region& region = regions[sorted[i]];
+    for (size_t c=0; c < copies; ++c)
+    {
+      LiquidatedRegion& tile_region = tile_regions[(i - tile.begin)*copies + c];
+      tile_region.start = region.start;
+      tile_region.stop = region.stop;
+      tile_region.strand = copies == 1 ? region.strand : c == 0 ? '+' : '-';
+    }
+  }
+
+  const Region& first = regions[sorted[tile.begin]];
+  try
+  {
+    liquidator.liquidate_regions(first.chromosome, tile_regions.data(), tile_regions.size(), extension);
+  } catch(const std::exception& e)
+  {
+    Logger::error() << "Aborting because failed to parse region " << sorted[tile.begin]+1 << " (" << first
+                    << ") or one of the " << tile.end - tile.begin - 1 << " regions near it due to error: "
+                    << e.what();
+    throw;
+  }
+
+  // scatter the counts back to the regions in their original order
+  for (size_t i=tile.begin; i < tile.end; ++i)
   {
-    try
+    Region& region = regions[sorted[i]];
+    const LiquidatedRegion* counted = &tile_regions[(i - tile.begin)*copies];
+    if (strand_counts == nullptr)
     {
-      regions[i].count = liquidator.liquidate(regions[i].chromosome,
-                                              regions[i].start, 
-                                              regions[i].stop, 
-                                              regions[i].strand,
-                                              extension);
-    } catch(const std::exception& e)
+      region.count = counted->count;
+    }
+    else
     {
-      Logger::error() << "Aborting because failed to parse region " << i+1 << " (" << regions[i] << ") due to error: "
-                      << e.what();
-      throw;
+      region.count = counted[0].count + counted[1].count;
+      (*strand_counts)[sorted[i]] = liquidator::strand_counts(region, counted[0].count, counted[1].count);
     }
   }
 }
 
-void liquidate_and_write(hid_t& file, std::vector<Region>& regions,
-                         unsigned int extension, const std::string& bam_file_path)
-{
-  Liquidators liquidators((Liquidator(bam_file_path))); 
+// Roughly how many regions are counted by a single work item, so that a few small bams still
+// keep all the threads busy, while tiles are still grouped enough to keep the overhead low.
+const size_t regions_per_range = 64;
+
+// At most this many ranges per thread are counted but not yet written, so only a few bams are
+// open (and have their region counts in memory) at once.
+const int RANGES_PER_THREAD = 4;
 
-  tbb::parallel_for(
-    tbb::blocked_range<int>(0, regions.size(), 1),
-    [&](const tbb::blocked_range<int>& range)
+// The regions of a single bam file, which are counted by its ranges of tiles.
+struct BamRegions
+{
+  BamRegions(const std::pair<std::string, unsigned int>& bam_file, const std::vector<Region>& parsed_regions,
+             bool count_all_strands):
+    liquidators(Liquidator(bam_file.first)),
+    regions(parsed_regions),
+    strand_counts(count_all_strands ? parsed_regions.size() : 0)
+  {
+    for (Region& region : regions)
     {
-      liquidate_regions(regions, bam_file_path, range.begin(), range.end(), extension, liquidators);
-    },
-    tbb::auto_partitioner());
+      region.bam_file_key = bam_file.second;
+    }
+  }
+
+  Liquidators liquidators;
+  std::vector<Region> regions;
+  std::vector<RegionStrandCounts> strand_counts;
+};
+
+// A range of consecutive tiles of a single bam.
+struct TileRange
+{
+  std::shared_ptr<BamRegions> bam;
+  size_t begin;
+  size_t end;
+  bool last; // whether this is the bam's last range, so its counts are written once it is counted
+};
+
+// Counts the ranges of tiles of all the bams in parallel, with the regions parsed and sorted into
+// tiles once for all the bams.  Each bam's counts are appended to the table in region file order as
+// soon as its last range is counted, so the table is the same as liquidating the bams one at a
+// time, but the threads stay busy across the ends of the bams.
+void liquidate_and_write(hid_t& file, const std::vector<Region>& regions,
+                         unsigned int extension,
+                         const std::vector<std::pair<std::string, unsigned int>>& bam_files,
+                         bool count_all_strands)
+{
+  std::vector<Tile> tiles;
+  const std::vector<size_t> sorted = sort_into_tiles(regions, tiles);
+
+  size_t bam_index = 0;
+  size_t next_tile = 0;
+  std::shared_ptr<BamRegions> bam;
+
+  const size_t max_ranges_in_flight = RANGES_PER_THREAD * tbb::task_scheduler_init::default_num_threads();
+  tbb::parallel_pipeline(max_ranges_in_flight,
+    tbb::make_filter<void, TileRange*>(tbb::filter::serial_in_order,
+      [&](tbb::flow_control& fc) -> TileRange*
+      {
+        if (bam_index == bam_files.size())
+        {
+          fc.stop();
+          return nullptr;
+        }
+        if (!bam)
+        {
+          bam = std::make_shared<BamRegions>(bam_files[bam_index], regions, count_all_strands);
+        }
+
+        TileRange* range = new TileRange;
+        range->bam = bam;
+        range->begin = next_tile;
+        size_t range_regions = 0;
+        do
+        {
+          range_regions += tiles[next_tile].end - tiles[next_tile].begin;
+          ++next_tile;
+        } while (next_tile < tiles.size() && range_regions < regions_per_range);
+        range->end = next_tile;
+        range->last = next_tile == tiles.size();
+
+        if (range->last)
+        {
+          bam.reset();
+          ++bam_index;
+          next_tile = 0;
+        }
+        return range;
+      })
+    & tbb::make_filter<TileRange*, TileRange*>(tbb::filter::parallel,
+      [&](TileRange* range) -> TileRange*
+      {
+        BamRegions& bam_regions = *range->bam;
+        for (size_t i=range->begin; i < range->end; ++i)
+        {
+          liquidate_tile(bam_regions.regions, sorted, tiles[i], extension, bam_regions.liquidators,
+                         count_all_strands ? &bam_regions.strand_counts : nullptr);
+        }
+        return range;
+      })
+    & tbb::make_filter<TileRange*, void>(tbb::filter::serial_in_order,
+      [&](TileRange* range)
+      {
+        std::unique_ptr<TileRange> owner(range);
+        if (range->last)
+        {
+          write(file, range->bam->regions);
+          if (count_all_strands)
+          {
+            write(file, range->bam->strand_counts);
+          }
+        }
+      }));
+}
+
+// Returns the regions of the shard (see bamliquidator_shards.h): a contiguous run of the regions in
+// region file order, balanced by the bam index's estimate of the reads in each region.
+std::vector<Region> shard_regions(const std::vector<Region>& regions, const std::string& shard,
+                                  const std::string& bam_file_path)
+{
+  size_t index, count;
+  if (!parse_shard_fraction(shard, index, count))
+  {
+    throw std::runtime_error("regions can only be sharded by index/count, but got " + shard);
+  }
 
-  write(file, regions);
+  const WindowCosts window_costs = read_window_costs(bam_file_path);
+  std::vector<uint64_t> costs(regions.size());
+  for (size_t i=0; i < regions.size(); ++i)
+  {
+    costs[i] = window_costs.cost(regions[i].chromosome, regions[i].start, regions[i].stop) + 1;
+  }
+
+  const std::vector<size_t> boundaries = balanced_shard_boundaries(costs, count);
+  return std::vector<Region>(regions.begin() + boundaries[index], regions.begin() + boundaries[index+1]);
 }
 
 int main(int argc, char* argv[])
 {
+  Metrics::start();
+
   try
   {
+    const std::string shard = extract_shard_option(argc, argv);
     if (argc < 13 || argc % 2 != 1)
     {
-      std::cerr << "usage: " << argv[0] << " number_of_threads region_file gff_or_bed_format extension bam_file bam_file_key hdf5_file "
+      std::cerr << "usage: " << argv[0] << " [--shard index/count] number_of_threads region_file gff_or_bed_format extension bam_file bam_file_key hdf5_file "
                 << "log_file write_warnings_to_stderr strand chr1 length1 ...\n"
         << "\ne.g. " << argv[0] << " /grail/annotations/HG19_SUM159_BRD4_-0_+0.gff gff"
         << "\n      /ifs/labs/bradner/bam/hg18/mm1s/04032013_D1L57ACXX_4.TTAGGC.hg18.bwt.sorted.bam 137 counts.hdf5 "
         << "\n      output/log.txt 1 _ chr1 247249719 chr2 242951149 chr3 199501827\n"
+        << "\nbam_file and bam_file_key may be comma separated lists, e.g. a.bam,b.bam and 3,4, to liquidate many bam"
+        << "\nfiles (with the same chromosomes) in one process, parsing the region file once."
+        << "\nshard, e.g. 3/8 for the 4th of 8 pieces balanced using the bam index, counts just that piece of the"
+        << "\nregions of a single bam file."
         << "\nstrand value of _ means use strand that is specified in region file (and use . if strand not specified in region file)."
+        << "\nstrand value of " << all_strands << " means count the forward, reverse and both strands with a single fetch of the"
+        << "\nreads, writing both strand counts to region_counts and forward and reverse counts to region_strand_counts."
         << "\nnumber of threads <= 0 means use a number of threads equal to the number of logical cpus."
         << "\nnote that this application is intended to be run from bamliquidator_batch.py -- see"
         << "\nhttps://github.com/BradnerLab/pipeline/wiki for more information"
@@ -155,8 +313,7 @@ int main(int argc, char* argv[])
     const std::string region_file_path = argv[2];
     const std::string region_format = argv[3];
     const unsigned int extension = boost::lexical_cast<unsigned int>(argv[4]);
-    const std::string bam_file_path = argv[5];
-    const unsigned int bam_file_key = boost::lexical_cast<unsigned int>(argv[6]);
+    const std::vector<std::pair<std::string, unsigned int>> bam_files = extract_bam_files(argv[5], argv[6]);
     const std::string hdf5_file_path = argv[7];
     const std::string log_file_path = argv[8];
     const bool write_warnings_to_stderr = boost::lexical_cast<bool>(argv[9]);
@@ -169,6 +326,12 @@ int main(int argc, char* argv[])
 
     Logger::configure(log_file_path, write_warnings_to_stderr);
 
+    if (!shard.empty() && bam_files.size() != 1)
+    {
+      Logger::error() << "Only a single bam file can be sharded";
+      return 2;
+    }
+
     hid_t h5file = H5Fopen(hdf5_file_path.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
     if (h5file < 0)
     {
@@ -188,9 +351,9 @@ int main(int argc, char* argv[])
 
     std::vector<Region> regions = parse_regions(region_file_path,
                                                 region_format,
-                                                bam_file_key,
+                                                bam_files.front().second,
                                                 chromosome_to_length,
-                                                strand);
+                                                strand == all_strands ? '.' : strand);
     #ifdef time_region_parsing 
     timer.stop();
     std::cout << "parsing regions took" << timer.format() << std::endl;
@@ -200,10 +363,21 @@ int main(int argc, char* argv[])
       Logger::warn() << "No valid regions detected in " << region_file_path;
       return 0;
     }
+    if (!shard.empty())
+    {
+      regions = shard_regions(regions, shard, bam_files.front().first);
+      if (regions.empty())
+      {
+        Logger::warn() << "No regions in shard " << shard;
+        H5Fclose(h5file);
+        return 0;
+      }
+    }
 
-    liquidate_and_write(h5file, regions, extension, bam_file_path);
+    liquidate_and_write(h5file, regions, extension, bam_files, strand == all_strands);
    
     H5Fclose(h5file);
+    log_metrics("bamliquidator_regions");
 
     return 0;
   }
@@ -0,0 +1,320 @@
+#ifndef LIQUIDATOR_BAMLIQUIDATOR_SHARDS_H_INCLUDED
+#define LIQUIDATOR_BAMLIQUIDATOR_SHARDS_H_INCLUDED
+
+#include "bam_index_stats.h"
+#include "liquidator_util.h"
+
+#include <samtools/sam.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+namespace liquidator
+{
+
+/*
+ * Sharding cuts a bamliquidator_bins or bamliquidator_regions run over a single bam into pieces
+ * that can run on different machines, e.g. passing
+ *
+ *   --shard 3/8
+ *
+ * before the other arguments counts the 4th of 8 pieces (the index is 0 based).  The pieces are
+ * balanced by the compressed bytes of reads in each 16kb window of the bam index's linear index,
+ * so a piece of sparsely covered chromosomes covers more of the genome than a piece of densely
+ * covered ones.  For each bam, each piece's rows are a contiguous run of the bam's rows in an
+ * unsharded run, so appending the pieces' rows bam by bam, in shard order for each bam (see
+ * bamliquidatorbatch/merge_shards.py), gives exactly the tables of an unsharded run.
+ *
+ * bamliquidator_bins also takes explicit comma separated chromosome ranges, e.g.
+ *
+ *   --shard chr1:0-100000000,chr1:100000000-247249719,chr2
+ *
+ * counting the bins starting in each range (or in the whole chromosome), in the order listed.
+ */
+
+const unsigned int shard_window_shift = 14; // the linear index has a window per 16kb
+
+// Removes a leading "--shard value" from the arguments, returning the value (or an empty string
+// if there is no shard), so that the positional arguments are the same with or without a shard.
+inline std::string extract_shard_option(int& argc, char**& argv)
+{
+  if (argc < 3 || std::string(argv[1]) != "--shard")
+  {
+    return "";
+  }
+  const std::string shard = argv[2];
+  argv[2] = argv[0];
+  argv += 2;
+  argc -= 2;
+  return shard;
+}
+
+// Parses a shard like "3/8" into its index and count, returning false if it isn't of that form,
+// and throwing if the index isn't less than the count.
+inline bool parse_shard_fraction(const std::string& shard, size_t& index, size_t& count)
+{
+  const size_t slash = shard.find('/');
+  if (slash == std::string::npos || shard.find(':') != std::string::npos)
+  {
+    return false;
+  }
+  index = boost::lexical_cast<size_t>(shard.substr(0, slash));
+  count = boost::lexical_cast<size_t>(shard.substr(slash + 1));
+  if (index >= count)
+  {
+    throw std::runtime_error("shard index must be less than the shard count, but got " + shard);
+  }
+  return true;
+}
+
+// Cuts the items into count contiguous shards of about equal total cost, returning the count+1
+// boundaries, so that shard i is the items [boundaries[i], boundaries[i+1]).  An item goes to the
+// earlier shard when its middle is before the cut, so a single huge item doesn't empty its neighbors.
+inline std::vector<size_t> balanced_shard_boundaries(const std::vector<uint64_t>& costs, size_t count)
+{
+  uint64_t total = 0;
+  for (uint64_t cost : costs)
+  {
+    total += cost;
+  }
+
+  std::vector<size_t> boundaries(1, 0);
+  uint64_t cumulative = 0;
+  size_t item = 0;
+  for (size_t shard = 1; shard < count; ++shard)
+  {
+    const double cut = double(total) * shard / count;
+    while (item < costs.size() && cumulative + costs[item]/2.0 < cut)
+    {
+      cumulative += costs[item];
+      ++item;
+    }
+    boundaries.push_back(item);
+  }
+  boundaries.push_back(costs.size());
+  return boundaries;
+}
+
+// The estimated cost of counting the reads in a range of a chromosome: the compressed bam bytes of
+// the reads starting in each 16kb window, plus one per window, so that windows without reads (or
+// without an index) still cost a little, e.g. for writing their bins.
+class WindowCosts
+{
+public:
+  // every window costs one
+  WindowCosts() {}
+
+  // windows are the linear index of each of the references (see read_index_stats)
+  WindowCosts(const std::vector<std::string>& names, const std::vector<ReferenceIndexStats>& stats,
+              const std::vector<std::vector<uint64_t>>& windows)
+  {
+    for (size_t r=0; r < names.size() && r < stats.size() && r < windows.size(); ++r)
+    {
+      // the compressed offset of the block with the first read of each window, made increasing
+      // since the windows before any read are 0
+      std::vector<uint64_t> block_offsets(windows[r].size() + 1);
+      uint64_t previous = stats[r].begin >> 16;
+      for (size_t w=0; w < windows[r].size(); ++w)
+      {
+        previous = std::max(previous, windows[r][w] >> 16);
+        block_offsets[w] = previous;
+      }
+      block_offsets.back() = std::max(previous, stats[r].end >> 16);
+
+      std::vector<uint64_t>& prefix = m_prefixes[names[r]];
+      prefix.assign(windows[r].size() + 1, 0);
+      for (size_t w=0; w < windows[r].size(); ++w)
+      {
+        prefix[w+1] = prefix[w] + (block_offsets[w+1] - block_offsets[w]) + 1;
+      }
+    }
+  }
+
+  uint64_t cost(const std::string& chromosome, uint64_t start, uint64_t stop) const
+  {
+    if (stop <= start)
+    {
+      return 0;
+    }
+    const uint64_t first = start >> shard_window_shift;
+    const uint64_t end = ((stop - 1) >> shard_window_shift) + 1;
+
+    const std::map<std::string, std::vector<uint64_t>>::const_iterator it = m_prefixes.find(chromosome);
+    if (it == m_prefixes.end())
+    {
+      return end - first;
+    }
+    const std::vector<uint64_t>& prefix = it->second;
+    const uint64_t indexed_end = std::max(first, std::min<uint64_t>(end, prefix.size() - 1));
+    return (first < indexed_end ? prefix[indexed_end] - prefix[first] : 0) + (end - indexed_end);
+  }
+
+private:
+  // the costs of the windows before each window of each chromosome
+  std::map<std::string, std::vector<uint64_t>> m_prefixes;
+};
+
+// Reads the window costs from the bam's index, warning and falling back to every window costing
+// the same if the index can't be read.
+inline WindowCosts read_window_costs(const std::string& bam_file_path)
+{
+  samfile_t* fp = samopen(bam_file_path.c_str(), "rb", 0);
+  if (fp == NULL)
+  {
+    throw std::runtime_error("samopen() error with " + bam_file_path);
+  }
+  const std::vector<std::string> names(fp->header->target_name, fp->header->target_name + fp->header->n_targets);
+  samclose(fp);
+
+  std::vector<ReferenceIndexStats> stats;
+  std::vector<std::vector<uint64_t>> windows;
+  if (!read_index_stats(bam_file_path, stats, &windows) || stats.size() != names.size())
+  {
+    Logger::warn() << "Balancing shards by chromosome length, since failed to read the index stats of "
+                   << bam_file_path;
+    return WindowCosts();
+  }
+  return WindowCosts(names, stats, windows);
+}
+
+// The bins [first_bin, end_bin) of a chromosome.
+struct BinSpan
+{
+  std::string chromosome;
+  size_t first_bin;
+  size_t end_bin;
+};
+
+inline size_t bin_count(size_t chromosome_length, unsigned int bin_size)
+{
+  return (chromosome_length + bin_size - 1) / bin_size;
+}
+
+// Parses explicit chromosome ranges (see above) into the spans of the bins starting in them.
+inline std::vector<BinSpan> parse_bin_spans(const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
+                                            unsigned int bin_size, const std::string& ranges)
+{
+  std::map<std::string, size_t> chromosome_to_length(chromosome_lengths.begin(), chromosome_lengths.end());
+
+  std::vector<BinSpan> spans;
+  for (const std::string& range : split_list_argument(ranges))
+  {
+    const size_t colon = range.rfind(':');
+    BinSpan span;
+    span.chromosome = range.substr(0, colon);
+    const std::map<std::string, size_t>::const_iterator it = chromosome_to_length.find(span.chromosome);
+    if (it == chromosome_to_length.end())
+    {
+      throw std::runtime_error("shard range " + range + " isn't on one of the chromosome arguments");
+    }
+    const size_t bins = bin_count(it->second, bin_size);
+    span.first_bin = 0;
+    span.end_bin = bins;
+    if (colon != std::string::npos)
+    {
+      const size_t dash = range.find('-', colon);
+      if (dash == std::string::npos)
+      {
+        throw std::runtime_error("expected a shard range like chr1:0-1000000, but got " + range);
+      }
+      const size_t start = boost::lexical_cast<size_t>(range.substr(colon + 1, dash - colon - 1));
+      const size_t stop = boost::lexical_cast<size_t>(range.substr(dash + 1));
+      span.first_bin = std::min(bins, (start + bin_size - 1) / bin_size);
+      span.end_bin = std::max(span.first_bin, std::min(bins, (stop + bin_size - 1) / bin_size));
+    }
+    spans.push_back(span);
+  }
+  return spans;
+}
+
+// Returns the bin spans of the shard, in the same order as an unsharded run counts them.  The bins
+// are weighed in units of at least a window, so big genomes with tiny bins are still quick to cut.
+inline std::vector<BinSpan> shard_bin_spans(const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
+                                            unsigned int bin_size, size_t index, size_t count,
+                                            const WindowCosts& costs)
+{
+  const size_t unit_bins = std::max<size_t>(1, (size_t(1) << shard_window_shift) / bin_size);
+
+  // the chromosome and first bin of each unit
+  std::vector<std::pair<size_t, size_t>> units;
+  std::vector<uint64_t> unit_costs;
+  for (size_t c=0; c < chromosome_lengths.size(); ++c)
+  {
+    const size_t bins = bin_count(chromosome_lengths[c].second, bin_size);
+    for (size_t bin=0; bin < bins; bin += unit_bins)
+    {
+      units.push_back(std::make_pair(c, bin));
+      unit_costs.push_back(costs.cost(chromosome_lengths[c].first, uint64_t(bin)*bin_size,
+                                      std::min<uint64_t>(uint64_t(bin + unit_bins)*bin_size,
+                                                         chromosome_lengths[c].second)));
+    }
+  }
+
+  const std::vector<size_t> boundaries = balanced_shard_boundaries(unit_costs, count);
+  std::vector<BinSpan> spans;
+  for (size_t u=boundaries[index]; u < boundaries[index+1]; ++u)
+  {
+    const std::pair<std::string, size_t>& chromosome = chromosome_lengths[units[u].first];
+    const size_t end_bin = std::min(units[u].second + unit_bins, bin_count(chromosome.second, bin_size));
+    if (spans.empty() || spans.back().chromosome != chromosome.first)
+    {
+      BinSpan span;
+      span.chromosome = chromosome.first;
+      span.first_bin = units[u].second;
+      spans.push_back(span);
+    }
+    spans.back().end_bin = end_bin;
+  }
+  return spans;
+}
+
+// Returns the bin spans to count for the shard argument, which may be empty for every bin.
+inline std::vector<BinSpan> bin_spans(const std::vector<std::pair<std::string, size_t>>& chromosome_lengths,
+                                      unsigned int bin_size, const std::string& shard,
+                                      const std::string& bam_file_path)
+{
+  size_t index, count;
+  if (shard.empty())
+  {
+    return shard_bin_spans(chromosome_lengths, bin_size, 0, 1, WindowCosts());
+  }
+  else if (parse_shard_fraction(shard, index, count))
+  {
+    return shard_bin_spans(chromosome_lengths, bin_size, index, count, read_window_costs(bam_file_path));
+  }
+  return parse_bin_spans(chromosome_lengths, bin_size, shard);
+}
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
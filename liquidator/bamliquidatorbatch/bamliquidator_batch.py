@@ -24,6 +24,11 @@ __version__ = util.version
 
 default_black_list = ["chrUn", "_random", "Zv9_", "_hap"]
 
+# The counts tables repeat the same cell type and chromosome strings in consecutive rows, which
+# shuffled zlib compression shrinks to almost nothing, and level 1 keeps the appends fast.
+# Readers decompress transparently, so the table layout is unchanged.
+counts_table_filters = tables.Filters(complevel=1, complib='zlib', shuffle=True)
+
 def create_files_table(h5file):
     class Files(tables.IsDescription):
         key       = tables.UInt32Col(    pos=0) # is there an easier way to assign keys?
@@ -68,8 +73,9 @@ def bam_file_paths_with_no_file_entries(file_names, bam_file_paths):
 class BaseLiquidator(object):
     __metaclass__ = abc.ABCMeta
 
+    # liquidates the bam files with a single process, see bam_file_path_groups
     @abc.abstractmethod
-    def liquidate(self, bam_file_path, extension, sense = None):
+    def liquidate(self, bam_file_paths, extension, sense = None):
         pass
 
     @abc.abstractmethod
@@ -80,8 +86,14 @@ class BaseLiquidator(object):
     def create_counts_table(self, h5file):
         pass
 
+    # the table of forward and reverse strand counts written when counting all strands (sense '*')
+    @abc.abstractmethod
+    def create_strand_counts_table(self, h5file):
+        pass
+
     def __init__(self, executable, counts_table_name, output_directory, bam_file_path,
-                 include_cpp_warnings_in_stderr = True, counts_file_path = None, number_of_threads = 0):
+                 include_cpp_warnings_in_stderr = True, counts_file_path = None, number_of_threads = 0,
+                 strand_counts_table_name = None, shard = None):
         # clear all memoized values from any prior runs
         nps.file_keys_memo = {}
 
@@ -91,6 +103,7 @@ class BaseLiquidator(object):
         self.counts_file_path = counts_file_path
         self.include_cpp_warnings_in_stderr = include_cpp_warnings_in_stderr
         self.number_of_threads = number_of_threads
+        self.shard = shard
         self.chromosome_patterns_to_skip = [] 
 
         self.executable_path = util.most_appropriate_executable_path(executable)
@@ -114,6 +127,9 @@ class BaseLiquidator(object):
             files = create_files_table(counts_file)
             file_names = create_file_names_array(counts_file)
 
+        if strand_counts_table_name is not None and strand_counts_table_name not in counts_file.root:
+            self.create_strand_counts_table(counts_file)
+
         if os.path.isdir(bam_file_path):
             self.bam_file_paths = all_bam_file_paths_in_directory(bam_file_path)
         else:
@@ -166,14 +182,43 @@ class BaseLiquidator(object):
         assert(len(file_names) - 1 == len(files))
         assert(len(file_names) == next_file_key)
 
+    # Groups consecutive bam files with the same chromosomes, so that each group is liquidated by a single
+    # process that keeps all the cores busy, instead of a process per (typically small) bam file leaving the
+    # cores idle between processes.  A path with a comma is liquidated by itself, since the bam files of
+    # a group are passed as a comma separated list.
+    def bam_file_path_groups(self):
+        groups = []
+        previous_chromosomes = None
+        for bam_file_path in self.bam_file_paths:
+            chromosomes = self.file_to_chromosome_length_pairs[basename(bam_file_path)]
+            if (self.shard is not None or ',' in bam_file_path or not groups or ',' in groups[-1][-1]
+                    or chromosomes != previous_chromosomes):
+                groups.append([bam_file_path])
+            else:
+                groups[-1].append(bam_file_path)
+            previous_chromosomes = chromosomes
+        return groups
+
+    # the executable arguments for liquidating just a piece of each bam, see bamliquidator_shards.h
+    def shard_args(self):
+        return [] if self.shard is None else ["--shard", self.shard]
+
     def batch(self, extension, sense):
-        for i, bam_file_path in enumerate(self.bam_file_paths):
-            logging.info("Liquidating %s (file %d of %d)", bam_file_path, i+1, len(self.bam_file_paths))
+        liquidated = 0
+        for bam_file_paths in self.bam_file_path_groups():
+            liquidated += len(bam_file_paths)
+            logging.info("Liquidating %s (file %d of %d)", ", ".join(bam_file_paths), liquidated,
+                         len(self.bam_file_paths))
 
-            return_code = self.liquidate(bam_file_path, extension, sense)
+            return_code = self.liquidate(bam_file_paths, extension, sense)
             if return_code != 0:
                 raise Exception("%s failed with exit code %d" % (self.executable_path, return_code))
 
+        if self.shard is not None:
+            logging.info("Skipping post liquidation processing of shard %s, which is done after merging the shards",
+                         self.shard)
+            return
+
         start = time()
         self.normalize()
         duration = time() - start
@@ -217,31 +262,43 @@ class BaseLiquidator(object):
 class BinLiquidator(BaseLiquidator):
     def __init__(self, bin_size, output_directory, bam_file_path,
                  counts_file_path = None, extension = 0, sense = '.', skip_plot = False,
-                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, blacklist = default_black_list):
+                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, blacklist = default_black_list,
+                 shard = None):
         self.bin_size = bin_size
         self.skip_plot = skip_plot
         super(BinLiquidator, self).__init__("bamliquidator_bins", "bin_counts", output_directory, bam_file_path,
-                                            include_cpp_warnings_in_stderr, counts_file_path, number_of_threads)
+                                            include_cpp_warnings_in_stderr, counts_file_path, number_of_threads,
+                                            "bin_strand_counts" if sense == '*' else None, shard)
         self.chromosome_patterns_to_skip = blacklist
         self.batch(extension, sense)
 
-    def liquidate(self, bam_file_path, extension, sense = None):
+    def liquidate(self, bam_file_paths, extension, sense = None):
         if sense is None: sense = '.'
 
-        cell_type = basename(dirname(bam_file_path))
-        if cell_type == '':
-            cell_type = '-'
-        bam_file_name = basename(bam_file_path)
-        args = [self.executable_path, str(self.number_of_threads), cell_type, str(self.bin_size), str(extension), sense, bam_file_path, 
-                str(self.file_to_key[bam_file_name]), self.counts_file_path]
+        cell_types = []
+        for bam_file_path in bam_file_paths:
+            cell_type = basename(dirname(bam_file_path))
+            if cell_type == '':
+                cell_type = '-'
+            cell_types.append(cell_type)
+        if len(set(cell_types)) == 1:
+            cell_types = cell_types[:1]
+        elif any(',' in cell_type for cell_type in cell_types):
+            # the cell types can't be passed as a list, so liquidate the bam files one at a time
+            return max(self.liquidate([bam_file_path], extension, sense) for bam_file_path in bam_file_paths)
+        bam_file_names = [basename(bam_file_path) for bam_file_path in bam_file_paths]
+        args = [self.executable_path] + self.shard_args() + [str(self.number_of_threads), ",".join(cell_types), str(self.bin_size),
+                str(extension), sense, ",".join(bam_file_paths),
+                ",".join(str(self.file_to_key[bam_file_name]) for bam_file_name in bam_file_names),
+                self.counts_file_path]
         args.extend(self.logging_cpp_args())
-        args.extend(self.chromosome_args(bam_file_name, skip_non_canonical=True))
+        args.extend(self.chromosome_args(bam_file_names[0], skip_non_canonical=True))
 
         start = time()
         return_code = subprocess.call(args)
         duration = time() - start
 
-        reads = self.file_to_count[bam_file_name]
+        reads = sum(self.file_to_count[bam_file_name] for bam_file_name in bam_file_names)
         rate = reads / (10**6) / duration
         logging.info("Liquidation completed: %f seconds, %d reads, %f millions of reads per second", duration, reads, rate)
         self.log_time('liquidation', duration)
@@ -260,14 +317,30 @@ class BinLiquidator(BaseLiquidator):
             count      = tables.UInt64Col(    pos=3)
             file_key   = tables.UInt32Col(    pos=4)
 
-        table = h5file.create_table("/", "bin_counts", BinCount, "bin counts")
+        # a genome of small bins is millions of rows, so a large expectedrows gives large chunks
+        table = h5file.create_table("/", "bin_counts", BinCount, "bin counts",
+                                    filters=counts_table_filters, expectedrows=10**7)
+        table.flush()
+        return table
+
+    def create_strand_counts_table(self, h5file):
+        class BinStrandCount(tables.IsDescription):
+            bin_number    = tables.UInt32Col(    pos=0)
+            cell_type     = tables.StringCol(16, pos=1)
+            chromosome    = tables.StringCol(util.chromosome_name_length, pos=2)
+            forward_count = tables.UInt64Col(    pos=3)
+            reverse_count = tables.UInt64Col(    pos=4)
+            file_key      = tables.UInt32Col(    pos=5)
+
+        table = h5file.create_table("/", "bin_strand_counts", BinStrandCount, "bin forward and reverse strand counts",
+                                    filters=counts_table_filters, expectedrows=10**7)
         table.flush()
         return table
 
 class RegionLiquidator(BaseLiquidator):
     def __init__(self, regions_file, output_directory, bam_file_path,
                  region_format=None, counts_file_path = None, extension = 0, sense = '.',
-                 include_cpp_warnings_in_stderr = True, number_of_threads = 0):
+                 include_cpp_warnings_in_stderr = True, number_of_threads = 0, shard = None):
         self.regions_file = regions_file
         self.region_format = region_format
         if self.region_format is None:
@@ -279,20 +352,23 @@ class RegionLiquidator(BaseLiquidator):
                                % str(self.region_format))
 
         super(RegionLiquidator, self).__init__("bamliquidator_regions", "region_counts", output_directory, 
-                                               bam_file_path, include_cpp_warnings_in_stderr, counts_file_path, number_of_threads)
+                                               bam_file_path, include_cpp_warnings_in_stderr, counts_file_path, number_of_threads,
+                                               "region_strand_counts" if sense == '*' else None, shard)
         
         self.batch(extension, sense)
 
-    def liquidate(self, bam_file_path, extension, sense = None):
-        bam_file_name = basename(bam_file_path)
-        args = [self.executable_path, str(self.number_of_threads), self.regions_file, str(self.region_format), str(extension), bam_file_path, 
-                str(self.file_to_key[bam_file_name]), self.counts_file_path]
+    def liquidate(self, bam_file_paths, extension, sense = None):
+        bam_file_names = [basename(bam_file_path) for bam_file_path in bam_file_paths]
+        args = [self.executable_path] + self.shard_args() + [str(self.number_of_threads), self.regions_file,
+                str(self.region_format), str(extension),
+                ",".join(bam_file_paths), ",".join(str(self.file_to_key[bam_file_name]) for bam_file_name in bam_file_names),
+                self.counts_file_path]
         args.extend(self.logging_cpp_args())
         if sense is None:
             args.append('_') # _ means use strand specified in region file (or . if none specified)
         else:
             args.append(sense)
-        args.extend(self.chromosome_args(bam_file_name, skip_non_canonical=False))
+        args.extend(self.chromosome_args(bam_file_names[0], skip_non_canonical=False))
 
         start = time()
         return_code = subprocess.call(args)
@@ -318,7 +394,24 @@ class RegionLiquidator(BaseLiquidator):
             count            = tables.UInt64Col(    pos=6)
             normalized_count = tables.Float64Col(   pos=7)
 
-        table = h5file.create_table("/", "region_counts", Region, "region counts")
+        table = h5file.create_table("/", "region_counts", Region, "region counts",
+                                    filters=counts_table_filters, expectedrows=10**6)
+        table.flush()
+        return table
+
+    def create_strand_counts_table(self, h5file):
+        class RegionStrandCounts(tables.IsDescription):
+            file_key      = tables.UInt32Col(    pos=0)
+            chromosome    = tables.StringCol(util.chromosome_name_length, pos=1)
+            region_name   = tables.StringCol(64, pos=2)
+            start         = tables.UInt64Col(    pos=3)
+            stop          = tables.UInt64Col(    pos=4)
+            forward_count = tables.UInt64Col(    pos=5)
+            reverse_count = tables.UInt64Col(    pos=6)
+
+        table = h5file.create_table("/", "region_strand_counts", RegionStrandCounts,
+                                    "region forward and reverse strand counts",
+                                    filters=counts_table_filters, expectedrows=10**6)
         table.flush()
         return table
 
@@ -380,9 +473,11 @@ def main():
                               'browsing HDF5 files)')
     parser.add_argument('-e', '--extension', type=int, default=0,
                         help='Extends reads by n bp (default is 0)')
-    parser.add_argument('--sense', default=None, choices=['+', '-', '.'],
+    parser.add_argument('--sense', default=None, choices=['+', '-', '.', '*'],
                         help="Map to '+' (forward), '-' (reverse) or '.' (both) strands. For gff regions, default is to use "
-                             "the sense specified by the gff file; otherwise, default maps to both.")
+                             "the sense specified by the gff file; otherwise, default maps to both. '*' maps to all three "
+                             "with a single pass over the bam, storing the '.' counts as usual and the '+' and '-' counts "
+                             "in the bin_strand_counts or region_strand_counts table.")
     parser.add_argument('-m', '--match_bamToGFF', default=False, action='store_true',
                         help="match bamToGFF_turbo.py matrix output format, storing the result as matrix.txt in the output folder")
     parser.add_argument('--region_format', default=None, choices=['gff', 'bed'],
@@ -399,6 +494,12 @@ def main():
     parser.add_argument('-n', '--number_of_threads', type=int, default=0,
                         help='Number of threads to run concurrently during liquidation.  Defaults to the total number of logical '
                              'cpus on the system.')
+    parser.add_argument('--shard', default=None,
+                        help='Liquidate just this piece of each bam file, e.g. 3/8 for the 4th of 8 pieces, which are balanced '
+                             'using the bam index, so that the pieces can run on different machines.  Bin liquidation '
+                             'also accepts comma separated chromosome ranges, e.g. chr1:0-100000000,chr2.  Each piece '
+                             'should have its own output directory, and normalization, plots and summaries are skipped '
+                             'until the pieces are merged with bamliquidator_merge_shards.')
     parser.add_argument('--xml_timings', action='store_true',
                         help='Write performance timings to junit style timings.xml in output folder, which is useful for '
                              'tracking performance over time with automatically generated Jenkins graphs')
@@ -427,7 +528,7 @@ def main():
     if args.regions_file is None:
         liquidator = BinLiquidator(args.bin_size, args.output_directory, args.bam_file_path,
                                    args.counts_file, args.extension, args.sense, args.skip_plot,
-                                   not args.quiet, args.number_of_threads, args.black_list)
+                                   not args.quiet, args.number_of_threads, args.black_list, args.shard)
     else:
         if args.counts_file:
             raise Exception("Appending to a prior regions counts.h5 file is not supported at this time -- "
@@ -436,7 +537,7 @@ def main():
         ## review matrix output, specifically the assumption that each file has the exact same regions in the same order
         liquidator = RegionLiquidator(args.regions_file, args.output_directory, args.bam_file_path, 
                                       args.region_format, args.counts_file, args.extension, args.sense,
-                                      not args.quiet, args.number_of_threads)
+                                      not args.quiet, args.number_of_threads, args.shard)
 
     if args.flatten:
         liquidator.flatten()
@@ -444,6 +545,8 @@ def main():
     if args.match_bamToGFF:
         if args.regions_file is None:
             logging.warning("Ignoring match_bamToGFF argument (this is only supported if a regions file is provided)")
+        elif args.shard is not None:
+            logging.warning("Ignoring match_bamToGFF argument for a shard (the matrix is of the merged shards)")
         else:
             logging.info("Writing bamToGff style matrix.txt file")
             start = time()
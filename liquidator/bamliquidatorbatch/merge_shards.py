@@ -0,0 +1,106 @@
+#!/usr/bin/env python
+
+import normalize_plot_and_summarize as nps
+import common_util as util
+
+import argparse
+import logging
+import os
+import shutil
+import tables
+
+# the tables that bamliquidator_bins and bamliquidator_regions append to
+counts_table_names = ("bin_counts", "bin_strand_counts", "region_counts", "region_strand_counts")
+
+# rows copied at a time, so that merging huge tables doesn't need them all in memory
+rows_per_copy = 10**6
+
+# Writes the counts of the shards (each from bamliquidator_batch.py --shard) into a single counts file.  A run
+# without shards writes the counts of each bam file in turn, and each shard has a contiguous piece of each bam
+# file's counts, so the counts are merged a bam file at a time (in files table order), appending that file's
+# rows of each shard in the order given.  That should be shard index order, so that the counts are exactly
+# those of a run without shards.  The files tables of the shards are the same, so the first is kept.
+def merge(shard_counts_file_paths, counts_file_path):
+    shutil.copyfile(shard_counts_file_paths[0], counts_file_path)
+
+    with tables.open_file(counts_file_path, "r+") as counts_file:
+        file_keys = [file_record["key"] for file_record in counts_file.root.files]
+        shard_files = [tables.open_file(path, "r") for path in shard_counts_file_paths]
+        try:
+            for table_name in counts_table_names:
+                if table_name not in counts_file.root:
+                    continue
+                table = counts_file.get_node("/", table_name)
+                table.truncate(0)
+                for file_key in file_keys:
+                    for shard_file in shard_files:
+                        if table_name not in shard_file.root:
+                            continue
+                        shard_table = shard_file.get_node("/", table_name)
+                        for start in range(0, shard_table.nrows, rows_per_copy):
+                            rows = shard_table.read(start, start + rows_per_copy)
+                            rows = rows[rows["file_key"] == file_key]
+                            if len(rows):
+                                table.append(rows)
+                table.flush()
+        finally:
+            for shard_file in shard_files:
+                shard_file.close()
+
+def main():
+    parser = argparse.ArgumentParser(description='Merges the counts.h5 files of bamliquidator_batch.py --shard runs into '
+        'a single counts.h5 file, exactly as if the bam files were liquidated without shards, and then normalizes, '
+        'plots, and summarizes the counts just like bamliquidator_batch.py.')
+    parser.add_argument('-b', '--bin_size', type=int, default=None,
+                        help='the bin size of the shards, which is required for merging bin counts')
+    parser.add_argument('-o', '--output_directory', default='output',
+                        help='Directory to write the merged counts.h5, log, and plot files to.  Creates directory if '
+                             'necessary.  Default is "./output".')
+    parser.add_argument('--skip_plot', action='store_true', help='Skip generating plots.  (This can speed up execution.)')
+    parser.add_argument('-q', '--quiet', action='store_true',
+                        help='Informational and warning output is suppressed so only errors are written to the console.')
+    parser.add_argument('shard_counts_files', nargs='+',
+                        help='the counts.h5 files of the shards, in shard index order')
+    args = parser.parse_args()
+
+    util.mkdir_if_not_exists(args.output_directory)
+    util.configure_logging(args, args.output_directory, args.quiet)
+
+    counts_file_path = os.path.join(args.output_directory, "counts.h5")
+    logging.info("Merging %d shards into %s", len(args.shard_counts_files), counts_file_path)
+    merge(args.shard_counts_files, counts_file_path)
+
+    with tables.open_file(counts_file_path, mode = "r+") as counts_file:
+        if "bin_counts" in counts_file.root:
+            if args.bin_size is None:
+                raise Exception("The bin size is required for merging bin counts")
+            nps.normalize_plot_and_summarize(counts_file, args.output_directory, args.bin_size, args.skip_plot)
+        else:
+            nps.normalize_regions(counts_file.root.region_counts, counts_file.root.files)
+
+if __name__ == "__main__":
+    main()
+
+'''
+   The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+'''
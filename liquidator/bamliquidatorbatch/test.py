@@ -6,6 +6,7 @@ from os import sys, path
 from itertools import izip
 
 import bamliquidator_batch as blb
+import merge_shards
 import normalize_plot_and_summarize as nps
 
 import os
@@ -97,6 +98,24 @@ class SingleFullReadBamTest(TempDirTest):
             self.assertEqual(len(self.sequence), record['count']) # count represents how many base pair reads 
                                                                   # intersected the bin
 
+    def test_bin_liquidation_all_strands(self):
+        bin_size = len(self.sequence)
+        liquidator = blb.BinLiquidator(bin_size = bin_size,
+                                       output_directory = os.path.join(self.dir_path, 'output'),
+                                       bam_file_path = self.bam_file_path,
+                                       sense = '*')
+
+        with tables.open_file(liquidator.counts_file_path) as counts:
+            self.assertEqual(1, len(counts.root.bin_counts))
+            self.assertEqual(len(self.sequence), counts.root.bin_counts[0]['count'])
+
+            self.assertEqual(1, len(counts.root.bin_strand_counts))
+            record = counts.root.bin_strand_counts[0]
+            self.assertEqual(0, record['bin_number'])
+            self.assertEqual(self.chromosome, record['chromosome'])
+            self.assertEqual(0, record['forward_count']) # 0 since the read is reverse (flag 16)
+            self.assertEqual(len(self.sequence), record['reverse_count'])
+
     def test_bin_liquidation_zero_bin_size(self):
         with self.assertRaises(Exception):
             liquidator = blb.BinLiquidator(bin_size = 0,
@@ -497,6 +516,88 @@ class AppendingTest(TempDirTest):
                 self.assertEqual(str(together_h5.root.summary[:]), str(appending_h5.root.summary[:]))
                 self.assertEqual(str(together_h5.root.sorted_summary[:]), str(appending_h5.root.sorted_summary[:]))
 
+    def testRegion(self):
+        # both bams are liquidated by a single process together, which should match one process per bam appending
+        regions_file_path = create_single_region_gff_file(self.dir_path, self.chromosome, 1, 8)
+
+        together_dir_path = os.path.join(self.dir_path, 'together')
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = together_dir_path,
+                                          bam_file_path = self.dir_path)
+
+        appending_dir = os.path.join(self.dir_path, 'appending')
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = appending_dir,
+                                          bam_file_path = self.bam1_file_path)
+
+        appending_h5_path = os.path.join(appending_dir, 'counts.h5')
+        liquidator = blb.RegionLiquidator(regions_file = regions_file_path,
+                                          output_directory = os.path.join(self.dir_path, 'appending_extra_without_h5_file'),
+                                          bam_file_path = self.bam2_file_path,
+                                          counts_file_path = appending_h5_path)
+
+        with tables.open_file(os.path.join(together_dir_path, 'counts.h5')) as together_h5:
+            with tables.open_file(appending_h5_path) as appending_h5:
+                self.assertEqual(2, len(together_h5.root.region_counts))
+                self.assertEqual(str(together_h5.root.region_counts[:]), str(appending_h5.root.region_counts[:]))
+
+class ShardTest(TempDirTest):
+    def setUp(self):
+        super(ShardTest, self).setUp()
+        self.chromosomes = ['chr1', 'chr2', 'chr3']
+        self.sequence = 'ATTTAAAAATTAATTTAATGCTTGGCTAAATCTTAATTACATATATAATT'
+        self.bam_file_path = create_bam(self.dir_path, self.chromosomes, self.sequence, file_name='multiple.bam')
+
+    def testBin(self):
+        bin_size = 10
+        liquidator = blb.BinLiquidator(bin_size = bin_size,
+                                       output_directory = os.path.join(self.dir_path, 'unsharded'),
+                                       bam_file_path = self.bam_file_path)
+
+        shard_counts_file_paths = []
+        for shard in ("0/3", "1/3", "2/3"):
+            shard_liquidator = blb.BinLiquidator(bin_size = bin_size,
+                                                 output_directory = os.path.join(self.dir_path, 'shard' + shard[0]),
+                                                 bam_file_path = self.bam_file_path,
+                                                 shard = shard)
+            shard_counts_file_paths.append(shard_liquidator.counts_file_path)
+
+        merged_counts_file_path = os.path.join(self.dir_path, 'merged.h5')
+        merge_shards.merge(shard_counts_file_paths, merged_counts_file_path)
+
+        with tables.open_file(liquidator.counts_file_path) as unsharded_h5:
+            with tables.open_file(merged_counts_file_path) as merged_h5:
+                self.assertEqual(3*len(self.sequence)//bin_size, len(merged_h5.root.bin_counts))
+                self.assertEqual(str(unsharded_h5.root.bin_counts[:]), str(merged_h5.root.bin_counts[:]))
+
+    def testBinManyBams(self):
+        # the merged counts are in the same order as without shards, one bam at a time
+        bam_directory = os.path.join(self.dir_path, 'bams')
+        os.mkdir(bam_directory)
+        create_bam(bam_directory, self.chromosomes, self.sequence, file_name='first.bam')
+        create_bam(bam_directory, self.chromosomes, self.sequence, file_name='second.bam', flag=0)
+
+        bin_size = 10
+        liquidator = blb.BinLiquidator(bin_size = bin_size,
+                                       output_directory = os.path.join(self.dir_path, 'unsharded'),
+                                       bam_file_path = bam_directory)
+
+        shard_counts_file_paths = []
+        for shard in ("0/2", "1/2"):
+            shard_liquidator = blb.BinLiquidator(bin_size = bin_size,
+                                                 output_directory = os.path.join(self.dir_path, 'shard' + shard[0]),
+                                                 bam_file_path = bam_directory,
+                                                 shard = shard)
+            shard_counts_file_paths.append(shard_liquidator.counts_file_path)
+
+        merged_counts_file_path = os.path.join(self.dir_path, 'merged.h5')
+        merge_shards.merge(shard_counts_file_paths, merged_counts_file_path)
+
+        with tables.open_file(liquidator.counts_file_path) as unsharded_h5:
+            with tables.open_file(merged_counts_file_path) as merged_h5:
+                self.assertEqual(2*3*len(self.sequence)//bin_size, len(merged_h5.root.bin_counts))
+                self.assertEqual(str(unsharded_h5.root.bin_counts[:]), str(merged_h5.root.bin_counts[:]))
+
 class LiquidateBamInDifferentDirectories(unittest.TestCase):
     def setUp(self):
         self.dir_before = os.getcwd()
@@ -0,0 +1,426 @@
+// Benchmarks of the scoring and counting hot spots and of the end to end bam and fasta paths,
+// run on synthetic fixtures generated from a fixed seed so runs are comparable across versions
+// (see "make bench").  Each benchmark prints one json object per line to stdout, e.g.
+//
+//   {"benchmark": "detail::score", "version": "1.2.0-abc1234", "items": 2000000, "unit": "bases", "seconds": 0.0123, "per_second": 1.6e+08}
+//
+// where seconds is the fastest of a few runs.
+//
+// usage: liquidator_bench [scale [fixture_directory]]
+//
+// The scale multiplies the fixture sizes (default 1, which takes a few seconds).  The fixtures are
+// written to a temporary directory that is removed afterwards unless fixture_directory is given.
+
+#include "bam_scorer.h"
+#include "bamliquidator.h"
+#include "bamliquidator_regions.h"
+#include "detail/score_matrix_detail.h"
+#include "fasta_reader.h"
+#include "fasta_scorer.h"
+#include "score_matrix.h"
+#include "version.h"
+
+#include <samtools/bam.h>
+#include <samtools/sam.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace liquidator;
+
+namespace
+{
+
+const int repeats = 3;
+
+const char* const motifs = R"(MEME version 4
+
+ALPHABET= ACGT
+
+strands: + -
+
+Background letter frequencies
+A 0.25 C 0.25 G 0.25 T 0.25
+
+MOTIF short
+
+letter-probability matrix: alength= 4 w= 8 nsites= 20 E= 0
+  0.100000        0.100000        0.700000        0.100000
+  0.100000        0.100000        0.700000        0.100000
+  0.700000        0.100000        0.100000        0.100000
+  0.700000        0.100000        0.100000        0.100000
+  0.100000        0.100000        0.100000        0.700000
+  0.100000        0.100000        0.100000        0.700000
+  0.100000        0.700000        0.100000        0.100000
+  0.100000        0.700000        0.100000        0.100000
+
+MOTIF long
+
+letter-probability matrix: alength= 4 w= 16 nsites= 20 E= 0
+  0.250000        0.250000        0.250000        0.250000
+  0.050000        0.850000        0.050000        0.050000
+  0.050000        0.050000        0.850000        0.050000
+  0.400000        0.100000        0.400000        0.100000
+  0.850000        0.050000        0.050000        0.050000
+  0.050000        0.050000        0.050000        0.850000
+  0.100000        0.400000        0.100000        0.400000
+  0.050000        0.850000        0.050000        0.050000
+  0.050000        0.850000        0.050000        0.050000
+  0.250000        0.250000        0.250000        0.250000
+  0.050000        0.050000        0.850000        0.050000
+  0.700000        0.100000        0.100000        0.100000
+  0.050000        0.050000        0.050000        0.850000
+  0.100000        0.100000        0.700000        0.100000
+  0.050000        0.850000        0.050000        0.050000
+  0.250000        0.250000        0.250000        0.250000
+)";
+
+struct Chromosome
+{
+    std::string name;
+    uint32_t length;
+};
+
+const std::vector<Chromosome> chromosomes = {{"chr1", 10000000}, {"chr2", 5000000}, {"chr3", 1000000}};
+
+const uint32_t read_length = 50;
+const uint32_t region_length = 1000;
+
+// keeps the benchmarked work from being optimized away
+volatile double sink = 0;
+
+char random_base(std::mt19937& random)
+{
+    return "ACGT"[random() % 4];
+}
+
+void write_fasta(const std::string& path, size_t sequence_count, size_t sequence_length, std::mt19937& random)
+{
+    std::ofstream fasta(path);
+    for (size_t i=0; i < sequence_count; ++i)
+    {
+        fasta << ">sequence" << i << '\n';
+        for (size_t j=0; j < sequence_length; ++j)
+        {
+            fasta << random_base(random);
+        }
+        fasta << '\n';
+    }
+    if (!fasta)
+    {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+void write_gff(const std::string& path, size_t region_count, std::mt19937& random)
+{
+    std::ofstream gff(path);
+    for (size_t i=0; i < region_count; ++i)
+    {
+        const Chromosome& chromosome = chromosomes[random() % chromosomes.size()];
+        const uint32_t start = random() % (chromosome.length - region_length);
+        gff << chromosome.name << "\tregion" << i << "\tbench\t" << start << '\t' << start + region_length
+            << "\t.\t" << ((random() % 2) ? '+' : '-') << "\t.\tregion" << i << '\n';
+    }
+    if (!gff)
+    {
+        throw std::runtime_error("failed to write " + path);
+    }
+}
+
+// Sets the read to a name, a perfect match cigar, random bases and uniform qualities, placed at tid
+// and pos, or unmapped without a position if tid is -1.
+void fill_read(bam1_t* read, int32_t tid, int32_t pos, size_t number, std::mt19937& random)
+{
+    const std::string name = "read" + boost::lexical_cast<std::string>(number);
+    const bool mapped = tid >= 0;
+
+    bam1_core_t& core = read->core;
+    core.tid = tid;
+    core.pos = pos;
+    core.bin = mapped ? bam_reg2bin(pos, pos + read_length) : 4680;
+    core.qual = mapped ? 60 : 0;
+    core.l_qname = name.size() + 1;
+    core.flag = (mapped ? 0 : BAM_FUNMAP) | ((random() % 2) ? BAM_FREVERSE : 0);
+    core.n_cigar = mapped ? 1 : 0;
+    core.l_qseq = read_length;
+    core.mtid = -1;
+    core.mpos = -1;
+    core.isize = 0;
+
+    read->l_aux = 0;
+    read->data_len = core.l_qname + 4*core.n_cigar + (read_length + 1)/2 + read_length;
+    if (read->m_data < read->data_len)
+    {
+        read->m_data = read->data_len;
+        read->data = (uint8_t*) realloc(read->data, read->m_data);
+    }
+
+    uint8_t* data = read->data;
+    std::memcpy(data, name.c_str(), core.l_qname);
+    data += core.l_qname;
+    if (mapped)
+    {
+        const uint32_t cigar = read_length << BAM_CIGAR_SHIFT | BAM_CMATCH;
+        std::memcpy(data, &cigar, sizeof(cigar));
+        data += sizeof(cigar);
+    }
+    const uint8_t codes[] = {1, 2, 4, 8}; // A, C, G and T in 4 bit bam encoding
+    std::memset(data, 0, (read_length + 1)/2);
+    for (uint32_t i=0; i < read_length; ++i)
+    {
+        data[i/2] |= codes[random() % 4] << ((i % 2) ? 0 : 4);
+    }
+    data += (read_length + 1)/2;
+    std::memset(data, 30, read_length);
+}
+
+// Writes a sorted, indexed bam of random reads spread over the chromosomes by length, followed by
+// unplaced unmapped reads (a twentieth as many) like an aligner writes. Returns how many reads it wrote.
+size_t write_bam(const std::string& path, size_t read_count, std::mt19937& random)
+{
+    bam_header_t* header = bam_header_init();
+    header->n_targets = chromosomes.size();
+    header->target_name = (char**) malloc(sizeof(char*) * chromosomes.size());
+    header->target_len = (uint32_t*) malloc(sizeof(uint32_t) * chromosomes.size());
+    std::stringstream text;
+    uint64_t total_length = 0;
+    for (size_t i=0; i < chromosomes.size(); ++i)
+    {
+        header->target_name[i] = strdup(chromosomes[i].name.c_str());
+        header->target_len[i] = chromosomes[i].length;
+        text << "@SQ\tSN:" << chromosomes[i].name << "\tLN:" << chromosomes[i].length << '\n';
+        total_length += chromosomes[i].length;
+    }
+    header->text = strdup(text.str().c_str());
+    header->l_text = text.str().size();
+
+    bamFile output = bam_open(path.c_str(), "w");
+    if (output == 0)
+    {
+        throw std::runtime_error("failed to open " + path);
+    }
+    bam_header_write(output, header);
+
+    bam1_t* read = bam_init1();
+    size_t number = 0;
+    for (size_t tid=0; tid < chromosomes.size(); ++tid)
+    {
+        std::vector<uint32_t> positions(read_count * chromosomes[tid].length / total_length);
+        for (uint32_t& position : positions)
+        {
+            position = random() % (chromosomes[tid].length - read_length);
+        }
+        std::sort(positions.begin(), positions.end());
+        for (uint32_t position : positions)
+        {
+            fill_read(read, tid, position, number++, random);
+            bam_write1(output, read);
+        }
+    }
+    for (size_t i=0; i < read_count / 20; ++i)
+    {
+        fill_read(read, -1, -1, number++, random);
+        bam_write1(output, read);
+    }
+    bam_destroy1(read);
+    bam_close(output);
+    bam_header_destroy(header);
+
+    if (bam_index_build(path.c_str()) != 0)
+    {
+        throw std::runtime_error("failed to index " + path);
+    }
+    return number;
+}
+
+std::vector<std::string> read_sequences(const std::string& fasta_path)
+{
+    std::ifstream fasta(fasta_path);
+    FastaReader reader(fasta);
+    std::vector<std::string> sequences;
+    std::string sequence, name;
+    while (reader.next_read(sequence, name))
+    {
+        sequences.push_back(sequence);
+    }
+    return sequences;
+}
+
+// Runs the benchmark a few times, printing the fastest run.
+void report(const std::string& name, size_t items, const std::string& unit, const std::function<void()>& run)
+{
+    double fastest = std::numeric_limits<double>::max();
+    for (int i=0; i < repeats; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        fastest = std::min(fastest, elapsed.count());
+    }
+    std::cout << "{\"benchmark\": \"" << name << "\", \"version\": \"" << version << "\", \"items\": " << items
+              << ", \"unit\": \"" << unit << "\", \"seconds\": " << fastest << ", \"per_second\": " << items/fastest
+              << '}' << std::endl;
+}
+
+// Discards what the end to end paths print to stdout (e.g. the BamScorer summary) while in scope,
+// so only the benchmark results are on stdout.
+class QuietStdout
+{
+public:
+    QuietStdout() : m_original(std::cout.rdbuf(m_discarded.rdbuf())) {}
+    ~QuietStdout() { std::cout.rdbuf(m_original); }
+
+private:
+    std::ostringstream m_discarded;
+    std::streambuf* const m_original;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        if (argc > 3)
+        {
+            std::cerr << "usage: " << argv[0] << " [scale [fixture_directory]]" << std::endl;
+            return 1;
+        }
+        const double scale = argc > 1 ? boost::lexical_cast<double>(argv[1]) : 1;
+        const bool keep_fixtures = argc > 2;
+        const boost::filesystem::path directory = keep_fixtures
+            ? boost::filesystem::path(argv[2])
+            : boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("liquidator_bench_%%%%%%%%");
+        boost::filesystem::create_directories(directory);
+
+        const size_t fasta_sequences = 200 * scale;
+        const size_t fasta_sequence_length = 10000;
+        const size_t bam_reads = 200000 * scale;
+        const size_t gff_regions = 20000 * scale;
+
+        const std::string fasta_path = (directory / "bench.fasta").string();
+        const std::string bam_path = (directory / "bench.bam").string();
+        const std::string gff_path = (directory / "bench.gff").string();
+
+        std::mt19937 random(2016);
+        write_fasta(fasta_path, fasta_sequences, fasta_sequence_length, random);
+        const size_t bam_written_reads = write_bam(bam_path, bam_reads, random);
+        write_gff(gff_path, gff_regions, random);
+
+        std::istringstream motif_stream(motifs);
+        const std::vector<ScoreMatrix> matrices = ScoreMatrix::read(motif_stream);
+        const std::vector<std::string> sequences = read_sequences(fasta_path);
+        const size_t fasta_bases = fasta_sequences * fasta_sequence_length;
+        report("detail::score", fasta_bases, "bases", [&]() {
+            const auto& matrix = matrices.back().matrix();
+            unsigned total = 0;
+            for (const std::string& sequence : sequences)
+            {
+                for (size_t begin=0; begin + matrix.size() <= sequence.size(); ++begin)
+                {
+                    total += detail::score(matrix, sequence, begin, begin + matrix.size());
+                }
+            }
+            sink = sink + total;
+        });
+
+        const size_t distribution_rounds = 20 * scale;
+        report("detail::probability_distribution", distribution_rounds * matrices.size(), "matrices", [&]() {
+            for (size_t i=0; i < distribution_rounds; ++i)
+            {
+                for (const ScoreMatrix& matrix : matrices)
+                {
+                    sink = sink + detail::probability_distribution(matrix.matrix(), ScoreMatrix::default_acgt_background).back();
+                }
+            }
+        });
+
+        std::vector<Region> regions;
+        report("parse_regions", gff_regions, "regions", [&]() {
+            regions = parse_regions(gff_path, "gff", 0);
+        });
+
+        report("liquidate", regions.size(), "regions", [&]() {
+            samfile_t* bam = samopen(bam_path.c_str(), "rb", 0);
+            bam_index_t* index = bam_index_load(bam_path.c_str());
+            if (bam == 0 || index == 0)
+            {
+                throw std::runtime_error("failed to open " + bam_path);
+            }
+            double count = 0;
+            for (const Region& region : regions)
+            {
+                liquidate(bam, index, region.chromosome, region.start, region.stop, region.strand, 1, 0, &count);
+            }
+            sink = sink + count;
+            bam_index_destroy(index);
+            samclose(bam);
+        });
+
+        const std::string fasta_output_path = (directory / "bench_fasta_hits.txt").string();
+        report("process_fasta", fasta_bases, "bases", [&]() {
+            QuietStdout quiet;
+            process_fasta(matrices, fasta_path, fasta_output_path);
+        });
+
+        report("BamScorer", bam_written_reads, "reads", [&]() {
+            QuietStdout quiet;
+            BamScorer(bam_path, matrices, BamScorer::None, false, "");
+        });
+
+        report("BamScorer --unmapped-only", bam_written_reads, "reads", [&]() {
+            QuietStdout quiet;
+            BamScorer(bam_path, matrices, BamScorer::None, true, "");
+        });
+
+        if (!keep_fixtures)
+        {
+            boost::filesystem::remove_all(directory);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Unhandled exception: " << e.what() << std::endl;
+        return 4;
+    }
+
+    return 0;
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -0,0 +1,326 @@
+#ifndef LIQUIDATOR_BGZF_READ_AHEAD_H_INCLUDED
+#define LIQUIDATOR_BGZF_READ_AHEAD_H_INCLUDED
+
+#include <samtools/bam.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Whole bam reads are read ahead in chunks of about BGZF_CHUNK_BYTES of inflated data
+// (a BGZF block inflates to at most 64kb).
+static const size_t BGZF_CHUNK_BYTES = 1 << 20;
+
+namespace liquidator
+{
+
+// Sets the read's core from the 32 bytes of a bam record after its block length, just
+// like bam_read1 (on a little endian machine).
+inline void set_read_core(const uint32_t x[8], bam1_core_t& core)
+{
+    core.tid = x[0];
+    core.pos = x[1];
+    core.bin = x[2] >> 16;
+    core.qual = x[2] >> 8 & 0xff;
+    core.l_qname = x[2] & 0xff;
+    core.flag = x[3] >> 16;
+    core.n_cigar = x[3] & 0xffff;
+    core.l_qseq = x[4];
+    core.mtid = x[5];
+    core.mpos = x[6];
+    core.isize = x[7];
+}
+
+// Grows the read's data buffer (to a power of two, like bam_read1) to hold data_length bytes,
+// and sets the read's data_len.
+inline void reserve_read_data(bam1_t& read, int data_length)
+{
+    read.data_len = data_length;
+    if (read.m_data < read.data_len)
+    {
+        read.m_data = 1;
+        while (read.m_data < read.data_len)
+        {
+            read.m_data <<= 1;
+        }
+        read.data = (uint8_t*) realloc(read.data, read.m_data);
+    }
+}
+
+// Sets the read's l_aux from its core and data_len.
+inline void set_read_aux_length(bam1_t& read)
+{
+    const bam1_core_t& core = read.core;
+    read.l_aux = read.data_len - core.n_cigar*4 - core.l_qname - core.l_qseq - (core.l_qseq + 1)/2;
+}
+
+// Some of a bam's BGZF blocks, read compressed by BgzfReadAhead::read and then inflated by
+// BgzfReadAhead::inflate.
+struct BgzfChunk
+{
+    void clear()
+    {
+        compressed.clear();
+        block_ends.clear();
+        inflated.clear();
+    }
+
+    std::vector<uint8_t> compressed; // whole blocks, header to footer
+    std::vector<size_t> block_ends;  // the offset in compressed after each block
+    std::vector<uint8_t> inflated;
+};
+
+// Reads a bam's reads without samtools' single threaded BGZF reader, so that the blocks can be
+// inflated in parallel: read (serially) reads the compressed blocks of a chunk, inflate (for many
+// chunks at once) inflates them, and parse (serially, in read order) parses the inflated reads,
+// carrying a read that continues into the next chunk over to that chunk.  The reads parsed are
+// exactly those bam_read1 would read from the same virtual offset.
+class BgzfReadAhead
+{
+public:
+    // Reads the bam from the virtual file offset, e.g. bam_tell just after bam_header_read.
+    BgzfReadAhead(const std::string& bam_file_path, int64_t virtual_offset)
+    :
+        m_bam_file_path(bam_file_path),
+        m_file(bam_file_path, std::ios::binary),
+        m_skip(virtual_offset & 0xffff)
+    {
+        m_file.seekg(virtual_offset >> 16);
+        if (!m_file)
+        {
+            throw std::runtime_error("failed to open " + bam_file_path);
+        }
+    }
+
+    // Reads the next blocks into the chunk, returning false once there are no blocks left
+    // (the chunk may still have the last blocks).
+    bool read(BgzfChunk& chunk)
+    {
+        size_t inflated_size = 0;
+        while (inflated_size < BGZF_CHUNK_BYTES)
+        {
+            uint8_t header[block_header_size];
+            m_file.read(reinterpret_cast<char*>(header), block_header_size);
+            if (m_file.gcount() == 0)
+            {
+                return false;
+            }
+            // the same header check as samtools, which only reads blocks with just the BC subfield
+            if (m_file.gcount() != block_header_size || header[0] != 31 || header[1] != 139 || header[2] != 8
+                || (header[3] & 4) == 0 || unpack16(header + 10) != 6
+                || header[12] != 'B' || header[13] != 'C' || unpack16(header + 14) != 2)
+            {
+                throw std::runtime_error("invalid BGZF block in " + m_bam_file_path);
+            }
+            const size_t block_size = unpack16(header + 16) + 1;
+            if (block_size < block_header_size + block_footer_size)
+            {
+                throw std::runtime_error("invalid BGZF block size in " + m_bam_file_path);
+            }
+
+            const size_t begin = chunk.compressed.size();
+            chunk.compressed.resize(begin + block_size);
+            std::copy(header, header + block_header_size, chunk.compressed.begin() + begin);
+            const std::streamsize rest = block_size - block_header_size;
+            m_file.read(reinterpret_cast<char*>(chunk.compressed.data() + begin + block_header_size), rest);
+            if (m_file.gcount() != rest)
+            {
+                throw std::runtime_error("truncated BGZF block in " + m_bam_file_path);
+            }
+            chunk.block_ends.push_back(chunk.compressed.size());
+            inflated_size += unpack32(chunk.compressed.data() + chunk.compressed.size() - 4);
+        }
+        return true;
+    }
+
+    // Inflates the chunk's blocks, checking each block's crc. May be called for many chunks at once.
+    static void inflate(BgzfChunk& chunk)
+    {
+        size_t inflated_size = 0;
+        for (size_t end : chunk.block_ends)
+        {
+            inflated_size += unpack32(chunk.compressed.data() + end - 4);
+        }
+        chunk.inflated.resize(inflated_size);
+
+        z_stream stream = z_stream();
+        if (inflateInit2(&stream, -15) != Z_OK) // raw deflate data, without a zlib or gzip wrapper
+        {
+            throw std::runtime_error("failed to initialize zlib");
+        }
+        size_t begin = 0;
+        uint8_t* output = chunk.inflated.data();
+        for (size_t end : chunk.block_ends)
+        {
+            const uint8_t* footer = chunk.compressed.data() + end - block_footer_size;
+            const uint32_t block_inflated_size = unpack32(footer + 4);
+            if (block_inflated_size == 0)
+            {
+                // e.g. the end of file block, which may be alone in a chunk with no inflated data to
+                // point zlib at, so it is just checked for the crc of no data
+                if (unpack32(footer) != crc32(0, Z_NULL, 0))
+                {
+                    inflateEnd(&stream);
+                    throw std::runtime_error("failed to inflate BGZF block");
+                }
+                begin = end;
+                continue;
+            }
+
+            stream.next_in = const_cast<uint8_t*>(chunk.compressed.data() + begin + block_header_size);
+            stream.avail_in = end - begin - block_header_size - block_footer_size;
+            stream.next_out = output;
+            stream.avail_out = block_inflated_size;
+            const int rc = ::inflate(&stream, Z_FINISH);
+            if (rc != Z_STREAM_END || stream.avail_out != 0
+                || crc32(crc32(0, Z_NULL, 0), output, block_inflated_size) != unpack32(footer))
+            {
+                inflateEnd(&stream);
+                throw std::runtime_error("failed to inflate BGZF block");
+            }
+            inflateReset(&stream);
+            output += block_inflated_size;
+            begin = end;
+        }
+        inflateEnd(&stream);
+    }
+
+    // Parses the reads of the next inflated chunk into reads (e.g. a BamReadChunk), which has
+    // next_read() and size.  A read that doesn't end in this chunk is kept for the next chunk.
+    template <typename Reads>
+    void parse(const BgzfChunk& chunk, Reads& reads)
+    {
+        const uint8_t* data = chunk.inflated.data();
+        const uint8_t* const end = data + chunk.inflated.size();
+
+        const size_t skipped = std::min<size_t>(m_skip, end - data);
+        data += skipped;
+        m_skip -= skipped;
+
+        if (!m_partial.empty())
+        {
+            size_t needed;
+            while (data < end && (needed = partial_bytes_needed()) > 0)
+            {
+                const size_t taken = std::min<size_t>(needed, end - data);
+                m_partial.insert(m_partial.end(), data, data + taken);
+                data += taken;
+            }
+            if (partial_bytes_needed() > 0)
+            {
+                return;
+            }
+            parse_read(m_partial.data(), reads.next_read());
+            ++reads.size;
+            m_partial.clear();
+        }
+
+        while (end - data >= 4)
+        {
+            const int32_t block_length = read_block_length(data);
+            if (end - data - 4 < block_length)
+            {
+                break;
+            }
+            parse_read(data, reads.next_read());
+            ++reads.size;
+            data += 4 + block_length;
+        }
+        m_partial.assign(data, end);
+    }
+
+    // Throws if the bam ended in the middle of a read, once every chunk is parsed.
+    void finish() const
+    {
+        if (!m_partial.empty())
+        {
+            throw std::runtime_error("truncated read at the end of " + m_bam_file_path);
+        }
+    }
+
+private:
+    static const std::streamsize block_header_size = 18; // with just the BC subfield
+    static const size_t block_footer_size = 8;           // crc32 and inflated size
+
+    static uint32_t unpack16(const uint8_t* p)
+    {
+        return p[0] | p[1] << 8;
+    }
+
+    static uint32_t unpack32(const uint8_t* p)
+    {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    int32_t read_block_length(const uint8_t* record) const
+    {
+        int32_t block_length;
+        std::memcpy(&block_length, record, sizeof(block_length));
+        if (block_length < 32)
+        {
+            throw std::runtime_error("invalid read in " + m_bam_file_path);
+        }
+        return block_length;
+    }
+
+    // the bytes left for the partial read to be whole
+    size_t partial_bytes_needed() const
+    {
+        if (m_partial.size() < 4)
+        {
+            return 4 - m_partial.size();
+        }
+        return 4 + read_block_length(m_partial.data()) - m_partial.size();
+    }
+
+    // parses the read starting at its block length, just like bam_read1 (on a little endian machine)
+    void parse_read(const uint8_t* record, bam1_t& read) const
+    {
+        const int32_t block_length = read_block_length(record);
+        uint32_t x[8];
+        std::memcpy(x, record + 4, sizeof(x));
+        set_read_core(x, read.core);
+        reserve_read_data(read, block_length - int(sizeof(x)));
+        std::memcpy(read.data, record + 4 + sizeof(x), read.data_len);
+        set_read_aux_length(read);
+    }
+
+    const std::string m_bam_file_path;
+    std::ifstream m_file;
+    size_t m_skip;                 // inflated bytes before the first read, in the first block
+    std::vector<uint8_t> m_partial; // the start of a read that doesn't end in the last chunk parsed
+};
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -0,0 +1,76 @@
+#ifndef LIQUIDATOR_CHUNK_POOL_H_INCLUDED
+#define LIQUIDATOR_CHUNK_POOL_H_INCLUDED
+
+#include "metrics.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <tbb/concurrent_queue.h>
+
+namespace liquidator
+{
+
+// The chunks of a tbb pipeline, recycled so that reading a chunk into a recycled chunk reuses
+// each read's data buffer instead of allocating it again. The pipeline's first (serial) stage
+// acquires chunks and its last stage releases them, so there are never more chunks than the
+// pipeline's tokens.  The pool owns every chunk, so a stage that throws doesn't leak the chunks
+// in flight.  A Chunk is default constructible and has a clear().
+template <typename Chunk>
+class ChunkPool
+{
+public:
+    // returns an empty chunk, valid until the pool is destroyed
+    Chunk* acquire()
+    {
+        sample_queue_depth(++m_in_flight);
+        Chunk* chunk;
+        if (m_released.try_pop(chunk))
+        {
+            chunk->clear();
+            return chunk;
+        }
+        m_chunks.emplace_back(new Chunk);
+        return m_chunks.back().get();
+    }
+
+    // may be called from many threads at once
+    void release(Chunk* chunk)
+    {
+        --m_in_flight;
+        m_released.push(chunk);
+    }
+
+private:
+    std::vector<std::unique_ptr<Chunk>> m_chunks; // only appended to by acquire, which isn't concurrent
+    tbb::concurrent_queue<Chunk*> m_released;
+    std::atomic<size_t> m_in_flight{0}; // acquired but not yet released, sampled for metrics
+};
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -5,8 +5,15 @@
 #include "pwm_detail.h"
 #include "parsing_detail.h"
 
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIQUIDATOR_SCORE_WINDOWS_X86
+#include <immintrin.h>
+#endif
 
 namespace liquidator { namespace detail {
 
@@ -107,6 +114,299 @@ inline unsigned score(const std::vector<std::array<unsigned, AlphabetSize>>& mat
     return score;
 }
 
+// returns score of a sequence of alphabet indexes (see alphabet_index); sequences with invalid indexes return 0.
+inline unsigned score(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                      const uint8_t* indexes,
+                      const size_t begin,
+                      const size_t end)
+{
+    assert(end >= begin);
+    assert((end-begin) <= matrix.size());
+
+    unsigned score = 0;
+    for (size_t position=begin, row=0; position < end; ++position, ++row)
+    {
+        const auto column = indexes[position];
+        if (column >= AlphabetSize)
+        {
+            return 0;
+        }
+        score += matrix[row][column];
+    }
+    return score;
+}
+
+// remaining_max[row] is the max score of the rows from row on, so remaining_max[0] is the max
+// score of the whole matrix and remaining_max[matrix.size()] is 0.
+inline std::vector<unsigned> remaining_max(const std::vector<std::array<unsigned, AlphabetSize>>& matrix)
+{
+    std::vector<unsigned> remaining(matrix.size() + 1, 0);
+    for (size_t row=matrix.size(); row > 0; --row)
+    {
+        remaining[row-1] = remaining[row] + *std::max_element(matrix[row-1].begin(), matrix[row-1].end());
+    }
+    return remaining;
+}
+
+// The rows of a matrix for a scoring kernel. A kernel for a fixed Width copies the rows into
+// an array, so the compiler can unroll the loops over the rows and keep the rows in registers
+// (without the copy, each store of a score might change the rows, so they'd be loaded again).
+// Width 0 is for a kernel that scores any width, reading the matrix itself.
+template <size_t Width>
+struct KernelRows
+{
+    explicit KernelRows(const std::vector<std::array<unsigned, AlphabetSize>>& matrix)
+    {
+        assert(matrix.size() == Width);
+        std::copy(matrix.begin(), matrix.end(), rows.begin());
+    }
+
+    static constexpr size_t size() { return Width; }
+
+    const std::array<unsigned, AlphabetSize>& operator[](size_t row) const { return rows[row]; }
+
+    std::array<std::array<unsigned, AlphabetSize>, Width> rows;
+};
+
+template <>
+struct KernelRows<0>
+{
+    explicit KernelRows(const std::vector<std::array<unsigned, AlphabetSize>>& matrix) : rows(matrix) {}
+
+    size_t size() const { return rows.size(); }
+
+    const std::array<unsigned, AlphabetSize>& operator[](size_t row) const { return rows[row]; }
+
+    const std::vector<std::array<unsigned, AlphabetSize>>& rows;
+};
+
+// Scores many consecutive windows of a sequence of alphabet indexes at once:
+// scores[i] = score(matrix, indexes, i, i + matrix.size()) for i in [0, window_count),
+// so indexes must have at least window_count + matrix.size() - 1 elements.
+//
+// If remaining_max (see remaining_max()) is given, scores below min_score may be given as 0
+// instead, since a window is abandoned once even the max of its remaining rows can't reach
+// min_score. The vector kernels abandon a block of windows once all of them can't reach it.
+//
+// Each kernel is instantiated for the common matrix widths (see score_windows_function()),
+// and for any width with Width 0. score_windows() picks the widest kernel the cpu supports
+// at runtime, since the makefile doesn't build with -march=native. The kernels add the same
+// unsigned values in the same order, so they all give identical scores. The scorers reach
+// them through ScoreMatrix::score_windows, e.g. from a MotifSet's per matrix scan.
+template <size_t Width = 0>
+inline void score_windows_scalar(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                                 const uint8_t* indexes,
+                                 const size_t window_count,
+                                 unsigned* scores,
+                                 const unsigned min_score = 0,
+                                 const unsigned* remaining_max = 0)
+{
+    const KernelRows<Width> rows(matrix);
+    for (size_t begin=0; begin < window_count; ++begin)
+    {
+        unsigned score = 0;
+        for (size_t row=0; row < rows.size(); ++row)
+        {
+            const auto column = indexes[begin + row];
+            if (column >= AlphabetSize)
+            {
+                score = 0;
+                break;
+            }
+            score += rows[row][column];
+            if (remaining_max && score + remaining_max[row+1] < min_score)
+            {
+                score = 0;
+                break;
+            }
+        }
+        scores[begin] = score;
+    }
+}
+
+#ifdef LIQUIDATOR_SCORE_WINDOWS_X86
+// 4 windows at a time, looking up the row values for the 4 indexes with a byte shuffle
+template <size_t Width = 0>
+__attribute__((target("sse4.1")))
+inline void score_windows_sse41(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                                const uint8_t* indexes,
+                                const size_t window_count,
+                                unsigned* scores,
+                                const unsigned min_score,
+                                const unsigned* remaining_max)
+{
+    const __m128i max_index = _mm_set1_epi32(AlphabetSize - 1);
+    const __m128i byte_broadcast = _mm_set1_epi32(0x01010101);
+    const __m128i byte_offsets = _mm_set1_epi32(0x03020100);
+    const __m128i min_scores = _mm_set1_epi32(min_score);
+    const KernelRows<Width> rows(matrix);
+
+    size_t begin = 0;
+    for (; begin + 4 <= window_count; begin += 4)
+    {
+        __m128i sum = _mm_setzero_si128();
+        __m128i invalid = _mm_setzero_si128();
+        for (size_t row=0; row < rows.size(); ++row)
+        {
+            int32_t packed;
+            std::memcpy(&packed, indexes + begin + row, sizeof(packed));
+            const __m128i columns = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+            invalid = _mm_or_si128(invalid, _mm_cmpgt_epi32(columns, max_index));
+
+            // each lane's column c becomes the byte shuffle {4c, 4c+1, 4c+2, 4c+3}
+            const __m128i first_bytes = _mm_slli_epi32(_mm_min_epu32(columns, max_index), 2);
+            const __m128i shuffle = _mm_add_epi32(_mm_mullo_epi32(first_bytes, byte_broadcast), byte_offsets);
+            const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[row].data()));
+            sum = _mm_add_epi32(sum, _mm_shuffle_epi8(values, shuffle));
+
+            if (remaining_max)
+            {
+                const __m128i reachable = _mm_add_epi32(sum, _mm_set1_epi32(remaining_max[row+1]));
+                if (_mm_movemask_epi8(_mm_cmpgt_epi32(min_scores, reachable)) == 0xffff)
+                {
+                    sum = _mm_setzero_si128();
+                    break;
+                }
+            }
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(scores + begin), _mm_andnot_si128(invalid, sum));
+    }
+    score_windows_scalar<Width>(matrix, indexes + begin, window_count - begin, scores + begin, min_score, remaining_max);
+}
+
+// 8 windows at a time, looking up the row values for the 8 indexes with a lane permute
+template <size_t Width = 0>
+__attribute__((target("avx2")))
+inline void score_windows_avx2(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                               const uint8_t* indexes,
+                               const size_t window_count,
+                               unsigned* scores,
+                               const unsigned min_score,
+                               const unsigned* remaining_max)
+{
+    const __m256i max_index = _mm256_set1_epi32(AlphabetSize - 1);
+    const __m256i min_scores = _mm256_set1_epi32(min_score);
+    const KernelRows<Width> rows(matrix);
+
+    size_t begin = 0;
+    for (; begin + 8 <= window_count; begin += 8)
+    {
+        __m256i sum = _mm256_setzero_si256();
+        __m256i invalid = _mm256_setzero_si256();
+        for (size_t row=0; row < rows.size(); ++row)
+        {
+            const __m256i columns = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indexes + begin + row)));
+            invalid = _mm256_or_si256(invalid, _mm256_cmpgt_epi32(columns, max_index));
+
+            // the row is in both 128 bit halves, and the permute only uses the low 3 bits of each column
+            const __m256i values = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[row].data())));
+            sum = _mm256_add_epi32(sum, _mm256_permutevar8x32_epi32(values, columns));
+
+            if (remaining_max)
+            {
+                const __m256i reachable = _mm256_add_epi32(sum, _mm256_set1_epi32(remaining_max[row+1]));
+                if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(min_scores, reachable)) == -1)
+                {
+                    sum = _mm256_setzero_si256();
+                    break;
+                }
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(scores + begin), _mm256_andnot_si256(invalid, sum));
+    }
+    score_windows_scalar<Width>(matrix, indexes + begin, window_count - begin, scores + begin, min_score, remaining_max);
+}
+#endif
+
+enum class ScoreKernel
+{
+    scalar,
+    sse41,
+    avx2
+};
+
+inline ScoreKernel supported_score_kernel()
+{
+#ifdef LIQUIDATOR_SCORE_WINDOWS_X86
+    static const ScoreKernel kernel = __builtin_cpu_supports("avx2") ? ScoreKernel::avx2
+                                    : __builtin_cpu_supports("sse4.1") ? ScoreKernel::sse41
+                                    : ScoreKernel::scalar;
+    return kernel;
+#else
+    return ScoreKernel::scalar;
+#endif
+}
+
+typedef void (*ScoreWindowsFunction)(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                                     const uint8_t* indexes,
+                                     const size_t window_count,
+                                     unsigned* scores,
+                                     const unsigned min_score,
+                                     const unsigned* remaining_max);
+
+// the kernels are instantiated for the widths of most motifs
+constexpr size_t min_kernel_width = 6;
+constexpr size_t max_kernel_width = 20;
+
+template <size_t Width>
+inline ScoreWindowsFunction kernel_score_windows_function(const ScoreKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef LIQUIDATOR_SCORE_WINDOWS_X86
+    case ScoreKernel::avx2:
+        return score_windows_avx2<Width>;
+    case ScoreKernel::sse41:
+        return score_windows_sse41<Width>;
+#endif
+    default:
+        return score_windows_scalar<Width>;
+    }
+}
+
+template <size_t Width>
+inline ScoreWindowsFunction width_score_windows_function(const size_t width, const ScoreKernel kernel)
+{
+    return width == Width ? kernel_score_windows_function<Width>(kernel)
+                          : width_score_windows_function<Width + 1>(width, kernel);
+}
+
+template <>
+inline ScoreWindowsFunction width_score_windows_function<max_kernel_width + 1>(const size_t, const ScoreKernel kernel)
+{
+    return kernel_score_windows_function<0>(kernel);
+}
+
+// The kernel for scoring the windows of a matrix of the width, instantiated for the width if
+// it is in [min_kernel_width, max_kernel_width], so it can be picked once per matrix.
+inline ScoreWindowsFunction score_windows_function(const size_t width, const ScoreKernel kernel = supported_score_kernel())
+{
+    return width_score_windows_function<min_kernel_width>(width, kernel);
+}
+
+inline void score_windows(const ScoreWindowsFunction score_windows_function,
+                          const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                          const uint8_t* indexes,
+                          const size_t window_count,
+                          unsigned* scores,
+                          const unsigned min_score,
+                          const unsigned* remaining_max)
+{
+    // every window reaches 0, so there is nothing to abandon
+    score_windows_function(matrix, indexes, window_count, scores, min_score, min_score == 0 ? 0 : remaining_max);
+}
+
+inline void score_windows(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                          const uint8_t* indexes,
+                          const size_t window_count,
+                          unsigned* scores,
+                          const unsigned min_score = 0,
+                          const unsigned* remaining_max = 0,
+                          const ScoreKernel kernel = supported_score_kernel())
+{
+    score_windows(score_windows_function(matrix.size(), kernel), matrix, indexes, window_count, scores, min_score, remaining_max);
+}
+
 inline unsigned max(const std::vector<std::array<unsigned, AlphabetSize>>& matrix)
 {
     unsigned max = 0;
@@ -135,27 +435,42 @@ probability_distribution(const std::vector<std::array<unsigned, AlphabetSize>>&
 
     current[0] = 1; // a score of 0 or better has probability 100%
 
+    // Only the scores in [current_min, current_max] can be reached by the rows so far, so only
+    // that span is updated, which is a small part of the table for most matrices. Within the span
+    // the additions are in the same order as over the whole table, so the results are identical.
+    size_t current_min = 0;
+    size_t current_max = 0;
+    size_t prior_min = 0;
+    size_t prior_max = 0;
+
     for (size_t row=0; row < matrix.size(); ++row)
     {
         using std::swap;
         swap(prior, current);
+        swap(prior_min, current_min);
+        swap(prior_max, current_max);
+
+        // the stale span from two rows ago is cleared, since the rest of current is already 0
+        std::fill(current.begin() + current_min, current.begin() + current_max + 1, 0);
 
-        const size_t max_score_for_row = row*max_matrix_value;
-        assert(max_score_for_row <= max_score);
+        const unsigned row_min = *std::min_element(matrix[row].begin(), matrix[row].end());
+        const unsigned row_max = *std::max_element(matrix[row].begin(), matrix[row].end());
+        current_min = prior_min + row_min;
+        current_max = prior_max + row_max;
+        assert(current_max <= max_score);
 
-        std::fill(current.begin(), current.end(), 0);
         for (size_t column=0; column < AlphabetSize; ++column)
         {
             const unsigned matrix_score = matrix[row][column];
-            assert(matrix_score <= max_score);
-            for (size_t score=0; score <= max_score_for_row; ++score)
+            assert(matrix_score <= max_matrix_value);
+            const double column_background = background[column];
+            double* shifted_current = current.data() + matrix_score;
+            for (size_t score=prior_min; score <= prior_max; ++score)
             {
-                assert(score <= max_score);
                 const double prior_probability = prior[score];
                 if (prior_probability != 0)
                 {
-                    assert((score+matrix_score) <= max_score);
-                    current[score+matrix_score] += prior_probability * background[column];
+                    shifted_current[score] += prior_probability * column_background;
                 }
             }
         }
@@ -24,7 +24,7 @@ FastaReader::FastaReader(std::istream &fasta_file)
 bool FastaReader::next_read(std::string& sequence, std::string& sequence_name)
 {
     // this function assumes that every sequence is preceded by a ">" line, with no empty lines allowed.
-    // this is an approximation of the fasta format.
+    // the sequence may be wrapped over any number of lines, which are joined.
     if (!m_fasta_file) return false;
     std::getline(m_fasta_file, sequence_name);
     if (!m_fasta_file) return false;
@@ -34,8 +34,16 @@ bool FastaReader::next_read(std::string& sequence, std::string& sequence_name)
         throw std::runtime_error("fasta sequence description is missing");
     }
     sequence_name.erase(0, 1); // remove the '>' from the name
-    std::getline(m_fasta_file, sequence);
-    return static_cast<bool>(m_fasta_file);
+    if (!sequence_name.empty() && sequence_name.back() == '\r') sequence_name.pop_back();
+
+    sequence.clear();
+    std::string line;
+    while (m_fasta_file.peek() != '>' && std::getline(m_fasta_file, line))
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        sequence += line;
+    }
+    return true;
 }
 
 }
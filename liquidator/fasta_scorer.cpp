@@ -1,199 +1,489 @@
 #include "fasta_scorer.h"
 
-#include "fasta_reader.h"
-#include "fimo_style_printer.h"
-#include "detail/score_matrix_detail.h"
+#include "hit_table.h"
+#include "motif_set.h"
+
+#include "liquidator_util.h"
+#include "metrics.h"
 
-#include <tbb/blocked_range.h>
 #include <tbb/enumerable_thread_specific.h>
-#include <tbb/parallel_for.h>
+#include <tbb/pipeline.h>
 #include <tbb/task_scheduler_init.h>
 
+#include <zlib.h>
+
 //#define LIQUIDATOR_FASTA_SCORER_TIMINGS
 #ifdef LIQUIDATOR_FASTA_SCORER_TIMINGS
 #include <boost/timer/timer.hpp>
 #endif
 
-#include <cerrno>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <mutex>
+#include <memory>
 #include <stdexcept>
-#include <sstream>
 
 namespace liquidator
 {
 
-void process_fasta_serial(const std::vector<ScoreMatrix>& matrices,
-                          const std::string& fasta_file_path,
-                          const std::string& output_file_path)
+// Windows with p-values below max_hit_pvalue are written as hits.
+const double max_hit_pvalue = 0.001;
+
+// The fasta is scored in chunks of about FASTA_CHUNK_SIZE bytes, cut on record boundaries,
+// with at most CHUNKS_PER_THREAD chunks per thread in flight so that memory use is bounded
+// no matter the size of the fasta. Records too long for a chunk (e.g. chromosomes) are
+// split into pieces of FASTA_CHUNK_SIZE bytes, so they are scored in parallel too.
+const size_t FASTA_CHUNK_SIZE = 1 << 20;
+const int CHUNKS_PER_THREAD = 4;
+
+// A chunk of whole fasta records passed through the pipeline, along with its output
+struct FastaChunk
+{
+    const char* data = 0; // either into the mapped file or into buffer
+    size_t size = 0;
+    std::string buffer;
+
+    // the fimo style output, or for HitTableOutput the hits and their sequence names (which
+    // each hit's sequence indexes until the hits are written)
+    std::string output;
+    std::vector<HitRecord> hits;
+    std::vector<std::string> hit_sequences;
+
+    // Set if the chunk is a piece of a record too long for a chunk, in which case the chunk is
+    // just sequence, starting at base piece_offset of the record named piece_name. The chunk
+    // ends with the first bases of the next piece, so that the windows beginning in the first
+    // piece_size bytes (which are this piece's windows) are whole.
+    bool is_piece = false;
+    std::string piece_name;
+    size_t piece_offset = 0;
+    size_t piece_size = 0;
+};
+
+// Sequences may be wrapped over any number of lines, with unix or windows line breaks.
+inline bool is_line_break(char c)
+{
+    return c == '\n' || c == '\r';
+}
+
+// Returns the offset of the first record (a '>' starting a line) after begin, or size if there is none.
+inline size_t next_record(const char* data, size_t begin, size_t size)
 {
-    std::ifstream fasta_input(fasta_file_path);
-    if (!fasta_input)
+    const char record_start[] = "\n>";
+    const char* found = std::search(data + begin, data + size, record_start, record_start + 2);
+    return found == data + size ? size : found - data + 1;
+}
+
+// Returns the offset of the last record in [begin, end), or begin if there is none.
+inline size_t last_record(const char* data, size_t begin, size_t end)
+{
+    const char record_start[] = "\n>";
+    const char* found = std::find_end(data + begin, data + end, record_start, record_start + 2);
+    return found == data + end ? begin : found - data + 1;
+}
+
+// Splits a fasta into chunks. Uncompressed regular files are memory mapped and the chunks
+// point into the mapping. Anything else (gzip or bgzf compressed files, or pipes) is
+// decompressed as a stream with zlib, which passes uncompressed input through as is, and
+// is copied into each chunk's buffer.
+class FastaChunkReader
+{
+public:
+    // max_window_length is the length of the longest motif, i.e. the most bases a piece
+    // needs from the next piece
+    FastaChunkReader(const std::string& fasta_file_path, size_t max_window_length)
+    :
+        m_file(fasta_file_path),
+        m_max_window_length(max_window_length),
+        m_offset(0),
+        m_stream(0),
+        m_stream_complete(false),
+        m_in_record(false),
+        m_record_offset(0)
+    {
+        const bool compressed = m_file.size() >= 2
+                             && uint8_t(m_file.data()[0]) == 0x1f && uint8_t(m_file.data()[1]) == 0x8b;
+        if (!m_file.is_mapped() || compressed)
+        {
+            m_stream = gzopen(fasta_file_path.c_str(), "rb");
+            if (m_stream == 0)
+            {
+                throw std::runtime_error("failed to open " + fasta_file_path);
+            }
+            gzbuffer(m_stream, 1 << 17);
+        }
+    }
+
+    ~FastaChunkReader()
     {
-        throw std::runtime_error("failed to open " + fasta_file_path);
+        if (m_stream != 0)
+        {
+            gzclose(m_stream);
+        }
     }
 
-    std::ofstream output(output_file_path);
-    FimoStylePrinter printer(output);
+    FastaChunkReader(const FastaChunkReader&) = delete;
+    FastaChunkReader& operator=(const FastaChunkReader&) = delete;
 
-    FastaReader fasta_reader(fasta_input);
-    std::string sequence;
-    std::string sequence_name;
-    while (fasta_reader.next_read(sequence, sequence_name))
+    // returns false when the fasta has been entirely read
+    bool next_chunk(FastaChunk& chunk)
     {
-        for (const auto& matrix : matrices)
+        if (m_stream == 0)
         {
-            printer.sequence_name = &sequence_name;
-            matrix.score(sequence, printer);
+            return cut_chunk(m_file.data(), m_file.size(), true, chunk);
         }
+
+        fill_buffer();
+        if (!cut_chunk(m_buffer.data(), m_buffer.size(), m_stream_complete, chunk))
+        {
+            return false;
+        }
+        // the buffer is refilled while the chunk is being scored
+        chunk.buffer.assign(chunk.data, chunk.size);
+        chunk.data = chunk.buffer.data();
+        return true;
     }
-}
 
-std::string get_file_contents(const std::string& file_path)
-{
-    // Seems to be fastest way to read entire file into memory, based off of
-    // http://insanecoding.blogspot.com/2011/11/how-to-read-in-file-in-c.html
+private:
+    // Keeps at least 3 chunks of the stream buffered past m_offset (or the rest of the stream),
+    // which is enough to cut a chunk along with its lookahead.
+    void fill_buffer()
+    {
+        m_buffer.erase(0, m_offset);
+        m_offset = 0;
+
+        const size_t buffered_size = 3*FASTA_CHUNK_SIZE;
+        while (!m_stream_complete && m_buffer.size() < buffered_size)
+        {
+            const size_t previous_size = m_buffer.size();
+            m_buffer.resize(buffered_size);
+            const int read_size = gzread(m_stream, &m_buffer[previous_size], buffered_size - previous_size);
+            if (read_size < 0)
+            {
+                int error = 0;
+                throw std::runtime_error(std::string("failed to read fasta: ") + gzerror(m_stream, &error));
+            }
+            m_buffer.resize(previous_size + read_size);
+            m_stream_complete = read_size == 0;
+        }
+    }
 
-    std::ifstream in(file_path, std::ios::in | std::ios::binary);
-    if (!in)
+    // Cuts the next chunk from the data at m_offset. If complete is false, more data follows size.
+    bool cut_chunk(const char* data, size_t size, bool complete, FastaChunk& chunk)
     {
-        std::stringstream ss;
-        ss << "Failed to open file " << file_path << ": error " << errno;
-        throw std::runtime_error(ss.str());
+        if (!m_in_record)
+        {
+            if (m_offset >= size)
+            {
+                return false;
+            }
+
+            const size_t limit = m_offset + FASTA_CHUNK_SIZE;
+            const size_t end = limit >= size ? size : next_record(data, limit - 1, size);
+            if (end - m_offset <= 2*FASTA_CHUNK_SIZE && (end < size || complete))
+            {
+                return whole_records(data, end, chunk);
+            }
+
+            // the record reaching past the limit is too long for a chunk, so it is split into
+            // pieces after the records before it are chunked on their own
+            const size_t record = last_record(data, m_offset, std::min(limit, size));
+            if (record > m_offset)
+            {
+                return whole_records(data, record, chunk);
+            }
+
+            const size_t name_end = std::find(data + m_offset, data + size, '\n') - data;
+            m_record_name.assign(data + m_offset + 1, data + std::max(name_end, m_offset + 1));
+            if (!m_record_name.empty() && m_record_name.back() == '\r')
+            {
+                m_record_name.pop_back();
+            }
+            m_offset = std::min(name_end + 1, size);
+            m_record_offset = 0;
+            m_in_record = true;
+        }
+
+        return record_piece(data, size, complete, chunk);
     }
-    std::string contents;
-    in.seekg(0, std::ios::end);
-    contents.resize(in.tellg());
-    in.seekg(0, std::ios::beg);
-    in.read(&contents[0], contents.size());
-    in.close();
-    return contents;
-}
+
+    bool whole_records(const char* data, size_t end, FastaChunk& chunk)
+    {
+        chunk.data = data + m_offset;
+        chunk.size = end - m_offset;
+        chunk.is_piece = false;
+        m_offset = end;
+        return true;
+    }
+
+    bool record_piece(const char* data, size_t size, bool complete, FastaChunk& chunk)
+    {
+        chunk.data = data + m_offset;
+        chunk.is_piece = true;
+        chunk.piece_name = m_record_name;
+        chunk.piece_offset = m_record_offset;
+
+        const size_t search_end = std::min(size, m_offset + 2*FASTA_CHUNK_SIZE);
+        const size_t record_end = next_record(data, m_offset - 1, search_end);
+        if (record_end < search_end || (search_end == size && complete))
+        {
+            // the last piece of the record
+            chunk.size = chunk.piece_size = record_end - m_offset;
+            m_offset = record_end;
+            m_in_record = false;
+            return true;
+        }
+
+        const size_t piece_end = m_offset + FASTA_CHUNK_SIZE;
+        size_t lookahead_end = piece_end;
+        for (size_t bases = 0; bases + 1 < m_max_window_length && lookahead_end < size; ++lookahead_end)
+        {
+            const char c = data[lookahead_end];
+            if (c == '>' && data[lookahead_end - 1] == '\n')
+            {
+                break;
+            }
+            if (!is_line_break(c))
+            {
+                ++bases;
+            }
+        }
+
+        chunk.size = lookahead_end - m_offset;
+        chunk.piece_size = piece_end - m_offset;
+        m_record_offset += std::count_if(data + m_offset, data + piece_end, [](char c) { return !is_line_break(c); });
+        m_offset = piece_end;
+        return true;
+    }
+
+    const MappedFile m_file;
+    const size_t m_max_window_length;
+    size_t m_offset; // into the mapping or m_buffer
+
+    gzFile m_stream;
+    bool m_stream_complete;
+    std::string m_buffer;
+
+    // the record m_offset is in, if it is being split into pieces
+    bool m_in_record;
+    std::string m_record_name;
+    size_t m_record_offset; // in bases
+};
 
 class Scorer
 {
 public:
-    Scorer(const std::vector<ScoreMatrix>& matrices,
-           const std::string& fasta,
-           std::ofstream& output,
-           std::mutex& output_mutex)
+    Scorer(const MotifSet& motifs, FastaOutputFormat output_format)
     :
-        matrices(matrices),
-        fasta(fasta),
-        output(output),
-        output_mutex(output_mutex)
+        matrices(motifs.matrices()),
+        scanner(motifs),
+        output_format(output_format)
     {}
 
     Scorer(const Scorer& other)
     :
         matrices(other.matrices),
-        fasta(other.fasta),
-        output(other.output),
-        output_mutex(other.output_mutex)
+        scanner(other.scanner),
+        output_format(other.output_format)
     {}
 
-    ~Scorer()
-    {
-        std::lock_guard<std::mutex> lock(output_mutex);
-
-        output << ss.str();
-    }
-
     Scorer& operator=(const Scorer& other) = delete;
 
-    void score(size_t region_begin, const size_t region_end)
+    void score(FastaChunk& chunk)
     {
+        const char* fasta = chunk.data;
+        const size_t fasta_size = chunk.size;
+
+        if (chunk.is_piece)
+        {
+            score_sequence(fasta, chunk.piece_name.data(), chunk.piece_name.size(),
+                           0, fasta_size, chunk.piece_offset, chunk.piece_size, chunk);
+            return;
+        }
+
+        size_t region_begin = 0;
         while(true)
         {
             // Note: Is > a valid char in a sequence name? maybe we should search for "\n>" char* instead of single char
             //       If this is needed, this could complicate finding the first start in the file.
             //       Will wait until have test case to validate this need.
-            size_t name_begin = fasta.find_first_of('>', region_begin);
-            if (name_begin >= region_end)
+            size_t name_begin = find(fasta, region_begin, fasta_size, '>');
+            if (name_begin >= fasta_size)
             {
                 break;
             }
             name_begin++; // name starts character after '>'
-            size_t name_end = fasta.find_first_of('\n', name_begin+1);
+            const size_t name_end = find(fasta, name_begin, fasta_size, '\n');
+            if (name_end >= fasta_size)
+            {
+                break; // a name without a sequence
+            }
+            const size_t name_length = name_end - name_begin - (fasta[name_end - 1] == '\r' ? 1 : 0);
+
+            // the sequence is every line up to the next record
+            const size_t sequence_begin = name_end + 1;
+            const size_t sequence_end = next_record(fasta, name_end, fasta_size);
+            score_sequence(fasta, fasta + name_begin, name_length, sequence_begin, sequence_end, 0, sequence_end, chunk);
+
+            region_begin = sequence_end;
+        }
+    }
+
+private:
+    // A line of sequence, with the offset of its first base in the fasta and in indexes
+    struct Line
+    {
+        size_t fasta_offset;
+        size_t index;
+    };
+
+    // Scores the sequence in fasta [sequence_begin, sequence_end), whose first base is at
+    // base_offset of the named sequence, adding the hits for windows beginning before window_limit
+    // to the chunk's output.
+    void score_sequence(const char* fasta, const char* name, size_t name_length,
+                        size_t sequence_begin, size_t sequence_end, size_t base_offset, size_t window_limit,
+                        FastaChunk& chunk)
+    {
+        // the sequence is encoded once (without its line breaks), then scanned once for all the matrices
+        indexes.resize(sequence_end - sequence_begin);
+        lines.clear();
+        size_t index_count = 0;
+        size_t window_count = 0;
+        bool line_start = true;
+        for (size_t i = sequence_begin; i < sequence_end; ++i)
+        {
+            if (i == window_limit)
+            {
+                window_count = index_count;
+            }
+            const char c = fasta[i];
+            if (is_line_break(c))
+            {
+                line_start = true;
+                continue;
+            }
+            if (line_start)
+            {
+                lines.push_back(Line{i, index_count});
+                line_start = false;
+            }
+            indexes[index_count++] = alphabet_index(c);
+        }
+        indexes.resize(index_count);
+        if (window_limit >= sequence_end)
+        {
+            window_count = index_count;
+        }
+        add_count(Counter::bases_scored, window_count); // the lookahead bases are counted with the next piece
 
-            size_t sequence_begin = name_end + 1;
-            // this assumes the file is terminated by a newline, otherwise last sequence won't have an end
-            size_t sequence_end = fasta.find_first_of('\n', sequence_begin + 1);
+        std::string& output = chunk.output;
+        size_t hit_sequence = chunk.hit_sequences.size(); // added with the sequence's first hit
+        scanner.scan(indexes, [&](size_t matrix_index, size_t window, unsigned scaled_score)
+        {
+            if (window >= window_count)
+            {
+                return; // the next piece's window
+            }
+            const ScoreMatrix& matrix = matrices[matrix_index];
+            const size_t length = matrix.matrix().size();
+            const auto& pvalues = matrix.pvalues();
+            assert(scaled_score < pvalues.size());
+            const double pvalue = pvalues[scaled_score];
+
+            const size_t sequence_start = base_offset + window + 1;
+            const size_t sequence_stop = base_offset + window + length;
+            const double unscaled_score = double(scaled_score)/matrix.scale()
+                + length*matrix.min_before_scaling();
+
+            if (output_format == HitTableOutput)
+            {
+                if (hit_sequence == chunk.hit_sequences.size())
+                {
+                    chunk.hit_sequences.emplace_back(name, name_length);
+                }
+                chunk.hits.push_back(HitRecord{uint32_t(matrix_index), uint32_t(hit_sequence),
+                                               sequence_start, unscaled_score, pvalue});
+                return;
+            }
 
-            for (const auto& matrix : matrices)
+            // formatted by hand instead of with a stream, which is a large part of the time for many hits
+            output += matrix.name();
+            output += '\t';
+            output.append(name, name_length);
+            output += '\t';
+            append_decimal(output, sequence_start);
+            output += '\t';
+            append_decimal(output, sequence_stop);
+            output += '\t';
+            output += matrix.is_reverse_complement() ? '-' : '+';
+            output += '\t';
+            append_decimal(output, unscaled_score, 6);
+            output += '\t';
+            append_decimal(output, pvalue, 3);
+            output += "\t\t"; // omit q-value for now
+
+            const char* bases = window_bases(fasta, window, length);
+            if (matrix.is_reverse_complement())
             {
-                for (size_t begin = sequence_begin, end = sequence_begin + matrix.matrix().size();
-                     end <= sequence_end;
-                     ++begin, ++end)
+                // Note: might want to do toupper here and in the else (which is done in score_matrix.h).
+                //       Will wait until have test case to validate this need.
+                for (size_t i=length - 1; ; --i)
                 {
-                    // Note: swapping loop order so loop by matrix then by sequence seems slightly slower in one test.
-                    //       This is complicated also by motifs potentially having different lengths,
-                    //       since the sequence substring length being dicated by the motif length.
-                    const unsigned scaled_score = detail::score(matrix.matrix(),
-                                                                fasta,
-                                                                begin,
-                                                                end);
-                    const auto& pvalues = matrix.pvalues();
-                    assert(scaled_score < pvalues.size());
-                    const double pvalue = pvalues[scaled_score];
-                    if (pvalue < 0.001)
+                    output += complement(bases[i]);
+                    if (i==0)
                     {
-                        const size_t name_length = name_end-name_begin;
-                        const size_t sequence_start = begin - sequence_begin + 1;
-                        const size_t sequence_stop = end - sequence_begin;
-                        const double unscaled_score = double(scaled_score)/matrix.scale()
-                            + matrix.matrix().size()*matrix.min_before_scaling();
-                        ss << matrix.name()<< '\t';
-                        ss.write(fasta.data() + name_begin, name_length);
-                        ss << '\t'
-                           << sequence_start << '\t'
-                           << sequence_stop << '\t'
-                           << (matrix.is_reverse_complement() ? '-' : '+') << '\t';
-
-                        ss.precision(6);
-                        ss << unscaled_score << '\t';
-                        ss.precision(3);
-
-                        ss << pvalue << '\t'
-                           << '\t'; // omit q-value for now
-
-                        if (matrix.is_reverse_complement())
-                        {
-                            // Note: might want to do toupper here and in the else (which is done in score_matrix.h).
-                            //       Will wait until have test case to validate this need.
-                            for (size_t i=begin + matrix.matrix().size() - 1; ; --i)
-                            {
-                                ss << complement(fasta[i]);
-                                if (i==begin)
-                                {
-                                    break;
-                                }
-                            }
-                        }
-                        else
-                        {
-                            ss.write(fasta.data() + begin,
-                                     matrix.matrix().size());
-                        }
-
-                        ss << std::endl;
+                        break;
                     }
                 }
             }
+            else
+            {
+                output.append(bases, length);
+            }
 
-            region_begin = sequence_end + 1;
+            output += '\n';
+        });
+    }
+
+    // Returns the bases of the window beginning at index window, which are copied out of the fasta
+    // if the window is wrapped over more than one line.
+    const char* window_bases(const char* fasta, size_t window, size_t length)
+    {
+        const auto line = std::upper_bound(lines.begin(), lines.end(), window,
+                                           [](size_t index, const Line& l) { return index < l.index; }) - 1;
+        const size_t line_end = line + 1 == lines.end() ? indexes.size() : (line + 1)->index;
+        size_t i = line->fasta_offset + (window - line->index);
+        if (window + length <= line_end)
+        {
+            return fasta + i;
+        }
+
+        window_copy.clear();
+        for (; window_copy.size() < length; ++i)
+        {
+            if (!is_line_break(fasta[i]))
+            {
+                window_copy.push_back(fasta[i]);
+            }
         }
+        return window_copy.data();
     }
 
-private:
-    const std::vector<ScoreMatrix>& matrices;
-    const std::string& fasta;
+    // returns the offset of the first c at or after begin, or size if there is none
+    static size_t find(const char* data, size_t begin, size_t size, char c)
+    {
+        const void* found = begin < size ? std::memchr(data + begin, c, size - begin) : 0;
+        return found == 0 ? size : static_cast<const char*>(found) - data;
+    }
 
-    std::stringstream ss;
+    const std::vector<ScoreMatrix>& matrices;
+    MotifSet::Scanner scanner;
+    const FastaOutputFormat output_format;
 
-    std::ofstream& output;
-    std::mutex& output_mutex;
+    std::vector<uint8_t> indexes;
+    std::vector<Line> lines;
+    std::string window_copy;
 };
 
 typedef tbb::enumerable_thread_specific<Scorer,
@@ -201,56 +491,80 @@ typedef tbb::enumerable_thread_specific<Scorer,
                                         tbb::ets_key_per_instance>
         Scorers;
 
-void score_fasta(size_t region_begin, size_t region_end, Scorers& scorers)
-{
-    Scorer& scorer = scorers.local();
-    scorer.score(region_begin, region_end);
-}
-
+// The fasta is scored with a tbb pipeline: a serial stage reads chunks of records, a
+// parallel stage scores them, and a serial in order stage writes their output, so reading,
+// scoring and writing overlap and the hits are written in the same order as the fasta.
 void process_fasta(const std::vector<ScoreMatrix>& matrices,
                    const std::string& fasta_file_path,
-                   const std::string& output_file_path)
+                   const std::string& output_file_path,
+                   FastaOutputFormat output_format)
 {
     tbb::task_scheduler_init init(tbb::task_scheduler_init::automatic);
 
-    #ifdef LIQUIDATOR_FASTA_SCORER_TIMINGS
-    boost::timer::cpu_timer read_timer;
-    #endif
-    const std::string fasta = get_file_contents(fasta_file_path);
-    #ifdef LIQUIDATOR_FASTA_SCORER_TIMINGS
-    read_timer.stop();
-    std::cout << "reading " << fasta.size() << " bytes fasta file into memory took" << read_timer.format() << std::endl;
-    #endif
-    // todo: instead of reading entire file into memory, just figure out how many char,
-    //       then try having the scorers read the chunks into memory themselves.
-    //       or maybe try the pipeline suggested in tbb documentation:
-    //       https://www.threadingbuildingblocks.org/docs/help/tbb_userguide/Working_on_the_Assembly_Line_pipeline.html
-    //       this is currently nice in its simplicity though.
-
-    std::ofstream output(output_file_path);
-    output << "#pattern name\tsequence name\tstart\tstop\tstrand\tscore\tp-value\tq-value\tmatched sequence" << std::endl;
-    std::mutex output_mutex;
-
-    Scorers scorers((Scorer(matrices, fasta, output, output_mutex)));
+    const MotifSet motifs(matrices, max_hit_pvalue);
+    Scorers scorers((Scorer(motifs, output_format)));
+    FastaChunkReader reader(fasta_file_path, motifs.max_length());
 
-    // todo: follow instructions to pick proper grain size:
-    // https://www.threadingbuildingblocks.org/docs/doxygen/a00023.html#a49a97576004711b7159170fcaf488e4e
-    // actually, that documentation might be outdated... maybe grainsize of 1 fine because of auto_partitioner
-    const size_t grainsize = 8400; // size of 100 fasta entries from a sample file
+    std::unique_ptr<HitTable> hit_table;
+    std::ofstream output;
+    if (output_format == HitTableOutput)
+    {
+        hit_table.reset(new HitTable(output_file_path, matrices));
+    }
+    else
+    {
+        output.open(output_file_path);
+        output << "#pattern name\tsequence name\tstart\tstop\tstrand\tscore\tp-value\tq-value\tmatched sequence" << std::endl;
+    }
+    std::vector<uint32_t> sequence_rows;
 
     #ifdef LIQUIDATOR_FASTA_SCORER_TIMINGS
     boost::timer::cpu_timer tbb_timer;
     #endif
-    tbb::parallel_for(
-      tbb::blocked_range<int>(0, fasta.size(), grainsize),
-      [&](const tbb::blocked_range<int>& range)
-      {
-        score_fasta(range.begin(), range.end(), scorers);
-      },
-      tbb::auto_partitioner());
+    const size_t max_chunks_in_flight = CHUNKS_PER_THREAD * tbb::task_scheduler_init::default_num_threads();
+    tbb::parallel_pipeline(max_chunks_in_flight,
+        tbb::make_filter<void, FastaChunk*>(tbb::filter::serial_in_order,
+            [&](tbb::flow_control& fc) -> FastaChunk*
+            {
+                FastaChunk* chunk = new FastaChunk;
+                StageTimer timer(Stage::fetch);
+                if (!reader.next_chunk(*chunk))
+                {
+                    delete chunk;
+                    fc.stop();
+                    return 0;
+                }
+                return chunk;
+            })
+        & tbb::make_filter<FastaChunk*, FastaChunk*>(tbb::filter::parallel,
+            [&](FastaChunk* chunk) -> FastaChunk*
+            {
+                StageTimer timer(Stage::score);
+                scorers.local().score(*chunk);
+                return chunk;
+            })
+        & tbb::make_filter<FastaChunk*, void>(tbb::filter::serial_in_order,
+            [&](FastaChunk* chunk)
+            {
+                StageTimer timer(Stage::write);
+                if (hit_table)
+                {
+                    hit_table->append_sequences(chunk->hit_sequences, sequence_rows);
+                    for (HitRecord& hit : chunk->hits)
+                    {
+                        hit.sequence = sequence_rows[hit.sequence];
+                    }
+                    hit_table->append(chunk->hits);
+                }
+                else
+                {
+                    output.write(chunk->output.data(), chunk->output.size());
+                }
+                delete chunk;
+            }));
     #ifdef LIQUIDATOR_FASTA_SCORER_TIMINGS
     tbb_timer.stop();
-    std::cout << "tbb // scoring took" << tbb_timer.format() << std::endl;
+    std::cout << "tbb pipelined reading, scoring and writing took" << tbb_timer.format() << std::endl;
     #endif
 }
 
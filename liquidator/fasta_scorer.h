@@ -9,9 +9,16 @@
 namespace liquidator
 {
 
+enum FastaOutputFormat
+{
+    FimoOutput,    // fimo style text
+    HitTableOutput // hdf5 tables, see hit_table.h
+};
+
 void process_fasta(const std::vector<ScoreMatrix>& matrices,
                    const std::string& fasta_file_path,
-                   const std::string& output_file_path);
+                   const std::string& output_file_path,
+                   FastaOutputFormat output_format = FimoOutput);
 
 }
 
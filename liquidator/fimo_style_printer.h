@@ -46,6 +46,12 @@ public:
         }
     }
 
+    // for the threshold ScoreMatrix::score overloads (see ScoreMatrix::min_scaled_score)
+    double threshold() const
+    {
+        return m_threshold;
+    }
+
     const std::string* sequence_name;
 
 private:
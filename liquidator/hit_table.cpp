@@ -0,0 +1,207 @@
+#include "hit_table.h"
+
+#include "liquidator_util.h"
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include <stdexcept>
+
+namespace
+{
+
+// these records must match exactly the structures in HDF5
+struct MotifRecord
+{
+    char name[128];
+    uint32_t length;
+    char strand;
+};
+
+struct SequenceRecord
+{
+    char name[256];
+};
+
+// records per hdf5 chunk, which are compressed
+const hsize_t chunk_records = 4096;
+
+// copies the name into the fixed length column, warning if it doesn't fit
+void copy_name(char* dest, const std::string& name, size_t dest_size, const char* table)
+{
+    if (name.size() >= dest_size)
+    {
+        liquidator::Logger::warn() << "Truncated name in " << table << " table from '" << name << "' to '"
+                                   << name.substr(0, dest_size - 1) << "'";
+    }
+    liquidator::copy(dest, name, dest_size);
+}
+
+void check(herr_t status, const std::string& action)
+{
+    if (status < 0)
+    {
+        throw std::runtime_error("Error " + action + ", status = " + std::to_string(status));
+    }
+}
+
+// a fixed length string type, closed on destruction
+struct StringType
+{
+    StringType(size_t size)
+    :
+        id(H5Tcopy(H5T_C_S1))
+    {
+        H5Tset_size(id, size);
+    }
+
+    ~StringType()
+    {
+        H5Tclose(id);
+    }
+
+    const hid_t id;
+};
+
+}
+
+namespace liquidator
+{
+
+HitTable::HitTable(const std::string& file_path, const std::vector<ScoreMatrix>& matrices)
+:
+    m_file(H5Fcreate(file_path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT))
+{
+    if (m_file < 0)
+    {
+        throw std::runtime_error("Failed to create H5 file " + file_path);
+    }
+
+    try
+    {
+        const hid_t file = m_file;
+
+        std::vector<MotifRecord> motifs(matrices.size());
+        for (size_t i=0; i < matrices.size(); ++i)
+        {
+            copy_name(motifs[i].name, matrices[i].name(), sizeof(MotifRecord::name), "motifs");
+            motifs[i].length = matrices[i].matrix().size();
+            motifs[i].strand = matrices[i].is_reverse_complement() ? '-' : '+';
+        }
+        const StringType motif_name(sizeof(MotifRecord::name));
+        const StringType strand(sizeof(MotifRecord::strand));
+        const char* motif_fields[] = { "name", "length", "strand" };
+        const size_t motif_offsets[] = { HOFFSET(MotifRecord, name),
+                                         HOFFSET(MotifRecord, length),
+                                         HOFFSET(MotifRecord, strand) };
+        const hid_t motif_types[] = { motif_name.id, H5T_NATIVE_UINT32, strand.id };
+        check(H5TBmake_table("motifs", file, "motifs", 3, motifs.size(), sizeof(MotifRecord),
+                             motif_fields, motif_offsets, motif_types, chunk_records, 0, 1, motifs.data()),
+              "making motifs table");
+
+        const StringType sequence_name(sizeof(SequenceRecord::name));
+        const char* sequence_fields[] = { "name" };
+        const size_t sequence_offsets[] = { HOFFSET(SequenceRecord, name) };
+        const hid_t sequence_types[] = { sequence_name.id };
+        check(H5TBmake_table("sequences", file, "sequences", 1, 0, sizeof(SequenceRecord),
+                             sequence_fields, sequence_offsets, sequence_types, chunk_records, 0, 1, 0),
+              "making sequences table");
+
+        const char* hit_fields[] = { "motif", "sequence", "start", "score", "pvalue" };
+        const size_t hit_offsets[] = { HOFFSET(HitRecord, motif),
+                                       HOFFSET(HitRecord, sequence),
+                                       HOFFSET(HitRecord, start),
+                                       HOFFSET(HitRecord, score),
+                                       HOFFSET(HitRecord, pvalue) };
+        const hid_t hit_types[] = { H5T_NATIVE_UINT32, H5T_NATIVE_UINT32, H5T_NATIVE_UINT64,
+                                    H5T_NATIVE_DOUBLE, H5T_NATIVE_DOUBLE };
+        check(H5TBmake_table("hits", file, "hits", 5, 0, sizeof(HitRecord),
+                             hit_fields, hit_offsets, hit_types, chunk_records, 0, 1, 0),
+              "making hits table");
+    }
+    catch(...)
+    {
+        H5Fclose(m_file);
+        throw;
+    }
+}
+
+HitTable::~HitTable()
+{
+    H5Fclose(m_file);
+}
+
+void HitTable::append_sequences(const std::vector<std::string>& names, std::vector<uint32_t>& rows)
+{
+    rows.clear();
+    std::vector<SequenceRecord> records;
+    records.reserve(names.size());
+    for (const std::string& name : names)
+    {
+        if (rows.empty() && m_sequence_count > 0 && name == m_last_sequence)
+        {
+            rows.push_back(m_sequence_count - 1);
+            continue;
+        }
+        rows.push_back(m_sequence_count + records.size());
+        records.emplace_back();
+        copy_name(records.back().name, name, sizeof(SequenceRecord::name), "sequences");
+    }
+    if (records.empty())
+    {
+        return;
+    }
+
+    const size_t offsets[] = { HOFFSET(SequenceRecord, name) };
+    const size_t sizes[] = { sizeof(SequenceRecord::name) };
+    check(H5TBappend_records(m_file, "sequences", records.size(), sizeof(SequenceRecord), offsets, sizes, records.data()),
+          "appending sequence records");
+    m_sequence_count += records.size();
+    m_last_sequence = names.back();
+}
+
+void HitTable::append(const std::vector<HitRecord>& hits)
+{
+    if (hits.empty())
+    {
+        return;
+    }
+
+    const size_t offsets[] = { HOFFSET(HitRecord, motif),
+                               HOFFSET(HitRecord, sequence),
+                               HOFFSET(HitRecord, start),
+                               HOFFSET(HitRecord, score),
+                               HOFFSET(HitRecord, pvalue) };
+    const size_t sizes[] = { sizeof(HitRecord::motif),
+                             sizeof(HitRecord::sequence),
+                             sizeof(HitRecord::start),
+                             sizeof(HitRecord::score),
+                             sizeof(HitRecord::pvalue) };
+    check(H5TBappend_records(m_file, "hits", hits.size(), sizeof(HitRecord), offsets, sizes, hits.data()),
+          "appending hit records");
+}
+
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -0,0 +1,79 @@
+#ifndef LIQUIDATOR_HIT_TABLE_H_INCLUDED
+#define LIQUIDATOR_HIT_TABLE_H_INCLUDED
+
+#include "score_matrix.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace liquidator
+{
+
+// this HitRecord must match exactly the structure in HDF5
+struct HitRecord
+{
+    uint32_t motif;    // row in the motifs table
+    uint32_t sequence; // row in the sequences table
+    uint64_t start;    // 1 based like fimo; the matched sequence is [start, start + motif length)
+    double score;
+    double pvalue;
+};
+
+// An hdf5 file of hits with "hits", "motifs" and "sequences" tables, which is much smaller and
+// faster to read than fimo style text. The motif and sequence names are only stored once, in
+// their tables, which the hits refer to by row. Only the sequences with hits have rows, which
+// are appended a chunk of the fasta at a time, so nothing is kept per sequence.
+class HitTable
+{
+public:
+    // Creates the file (replacing any existing file) and writes the motifs table, which has
+    // a row for each of the matrices (with name, length and strand).
+    // Throws std::runtime_error on failure.
+    HitTable(const std::string& file_path, const std::vector<ScoreMatrix>& matrices);
+
+    ~HitTable();
+
+    HitTable(const HitTable&) = delete;
+    HitTable& operator=(const HitTable&) = delete;
+
+    // Appends the named sequences (e.g. those with hits in a chunk) to the sequences table with
+    // a single write, setting rows[i] to the row of names[i]. A first name that is the same as the
+    // last name appended (the next piece of a sequence split over chunks) reuses its row. Names
+    // too long for the table are truncated with a warning.
+    void append_sequences(const std::vector<std::string>& names, std::vector<uint32_t>& rows);
+
+    void append(const std::vector<HitRecord>& hits);
+
+private:
+    int64_t m_file; // hid_t, which is kept out of this header so hdf5.h is only needed by hit_table.cpp
+    uint32_t m_sequence_count = 0;
+    std::string m_last_sequence;
+};
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
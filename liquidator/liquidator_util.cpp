@@ -2,7 +2,11 @@
 
 #include <iostream>
 #include <fstream>
+#include <cerrno>
 #include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 namespace
@@ -31,6 +35,11 @@ Logger Logger::error()
   return Logger("ERROR", true);
 }
 
+Logger Logger::info()
+{
+  return Logger("INFO", false);
+}
+
 Logger::Logger(const std::string& a_level, bool a_write_to_stderr):
   level(a_level),
   write_to_stderr(a_write_to_stderr),
@@ -67,6 +76,52 @@ Logger::Logger(const Logger& logger):
   logger.copied = true;
 }
 
+MappedFile::MappedFile(const std::string& file_path):
+  contents(0),
+  length(0),
+  mapped(false)
+{
+  const int fd = open(file_path.c_str(), O_RDONLY);
+  if (fd == -1)
+  {
+    std::stringstream ss;
+    ss << "Failed to open file " << file_path << ": error " << errno;
+    throw std::runtime_error(ss.str());
+  }
+
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+  {
+    mapped = true;
+    length = file_stat.st_size;
+    if (length > 0)
+    {
+      void* address = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address == MAP_FAILED)
+      {
+        const int mmap_errno = errno;
+        close(fd);
+        std::stringstream ss;
+        ss << "Failed to map file " << file_path << ": error " << mmap_errno;
+        throw std::runtime_error(ss.str());
+      }
+      // the contents are read front to back
+      madvise(address, length, MADV_SEQUENTIAL);
+      contents = static_cast<const char*>(address);
+    }
+  }
+  // the mapping stays valid after the descriptor is closed
+  close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+  if (contents != 0)
+  {
+    munmap(const_cast<char*>(contents), length);
+  }
+}
+
 }
 
 /* The MIT License (MIT) 
@@ -2,6 +2,8 @@
 #define PIPELINE_BAMLIQUIDATORINTERNAL_BAMLIQUIDATOR_UTIL_H
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -63,6 +65,14 @@ inline size_t alphabet_index(char c)
     return 99;
 }
 
+// Same as alphabet_index(bam_nt16_rev_table[code]) for a bam 4 bit base code,
+// without the round trip through the "=ACMGRSVTWYHKDBN" characters.
+inline size_t nt16_alphabet_index(uint8_t code)
+{
+    static const uint8_t indexes[16] = { 99, 0, 1, 99, 2, 99, 99, 99, 3, 99, 99, 99, 99, 99, 99, 99 };
+    return indexes[code & 0xf];
+}
+
 inline std::string complement(const std::string& sequence)
 {
   std::string c = sequence;
@@ -73,6 +83,32 @@ inline std::string complement(const std::string& sequence)
   return c;
 }
 
+// Appends the decimal digits of value to output, which is much faster than formatting with a stream.
+inline void append_decimal(std::string& output, size_t value)
+{
+  char digits[20];
+  size_t count = 0;
+  do
+  {
+    digits[count++] = char('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (count > 0)
+  {
+    output += digits[--count];
+  }
+}
+
+// Appends value to output exactly as a stream with the given precision (and default floatfield)
+// would format it, without the stream's locale and state overhead.
+inline void append_decimal(std::string& output, double value, int precision)
+{
+  char formatted[32];
+  const int length = std::snprintf(formatted, sizeof(formatted), "%.*g", precision, value);
+  output.append(formatted, std::min(size_t(length), sizeof(formatted) - 1));
+}
+
 // copies str to dest
 // precondition: dest_size > 0
 // postcondition: dest is null terminated, dest isn't overflowed, and any excess in dest is filled with \0 characters
@@ -84,6 +120,14 @@ inline void copy(char* dest, const std::string& str, size_t dest_size)
   dest[dest_size - 1] = '\0';
 }
 
+// same as copy(dest, std::string(src, src_size), dest_size), without constructing the string
+inline void copy(char* dest, const char* src, size_t src_size, size_t dest_size)
+{
+  const size_t copied = std::min(std::min(src_size, dest_size - 1), strnlen(src, src_size));
+  std::memcpy(dest, src, copied);
+  std::memset(dest + copied, '\0', dest_size - copied);
+}
+
 // The logger class is intended to be used to match bamliquidator_batch.py logging output style
 class Logger
 {
@@ -118,6 +162,9 @@ public:
    */
   static Logger error();
 
+  // Same as warn(), but with the INFO level, and never written to stderr.
+  static Logger info();
+
   template<typename T>
   Logger& operator<<(const T& v)
   {
@@ -142,6 +189,42 @@ private:
   mutable bool copied;
 };
 
+// A read only memory mapping of an entire file, unmapped on destruction.
+// Only regular files are mapped: for anything else (e.g. a pipe) is_mapped() is false,
+// and the file should be read as a stream instead.
+class MappedFile
+{
+public:
+  // throws std::runtime_error if the file can't be opened or mapped
+  explicit MappedFile(const std::string& file_path);
+
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool is_mapped() const
+  {
+    return mapped;
+  }
+
+  // null if the file is empty or isn't mapped
+  const char* data() const
+  {
+    return contents;
+  }
+
+  size_t size() const
+  {
+    return length;
+  }
+
+private:
+  const char* contents;
+  size_t length;
+  bool mapped;
+};
+
 inline std::vector<std::pair<std::string, size_t>>
 extract_chromosome_lengths(int argc, char* argv[], int chr1_arg)
 {
@@ -154,6 +237,42 @@ extract_chromosome_lengths(int argc, char* argv[], int chr1_arg)
   return chromosome_lengths;
 }
 
+// Splits a comma separated argument, e.g. "a.bam,b.bam" into {"a.bam", "b.bam"}.
+inline std::vector<std::string> split_list_argument(const std::string& arg)
+{
+  std::vector<std::string> items;
+  std::stringstream ss(arg);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    items.push_back(item);
+  }
+  return items;
+}
+
+// Pairs the comma separated bam files with their comma separated keys, e.g. "a.bam,b.bam" and "3,4",
+// so that a single process can liquidate many bam files.  A single key means a single bam file,
+// so that a path with a comma still works.
+inline std::vector<std::pair<std::string, unsigned int>>
+extract_bam_files(const std::string& bam_files, const std::string& bam_file_keys)
+{
+  const std::vector<std::string> keys = split_list_argument(bam_file_keys);
+  const std::vector<std::string> files = keys.size() == 1 ? std::vector<std::string>(1, bam_files)
+                                                          : split_list_argument(bam_files);
+  if (files.empty() || files.size() != keys.size())
+  {
+    throw std::runtime_error("expected one bam file key for each of the bam files " + bam_files
+                             + ", but got bam file keys " + bam_file_keys);
+  }
+
+  std::vector<std::pair<std::string, unsigned int>> files_and_keys;
+  for (size_t i=0; i < files.size(); ++i)
+  {
+    files_and_keys.push_back(std::make_pair(files[i], boost::lexical_cast<unsigned int>(keys[i])));
+  }
+  return files_and_keys;
+}
+
 }
 
 /* The MIT License (MIT) 
@@ -0,0 +1,330 @@
+#ifndef LIQUIDATOR_METRICS_H_INCLUDED
+#define LIQUIDATOR_METRICS_H_INCLUDED
+
+#include "liquidator_util.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <tbb/cache_aligned_allocator.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#include <time.h>
+
+namespace liquidator
+{
+
+/*
+ * Optional instrumentation of where the time goes, enabled by setting the LIQUIDATOR_METRICS
+ * environment variable to a file path.  At exit each executable then appends one line of json
+ * to that file, e.g. (wrapped here)
+ *
+ *   {"executable": "bamliquidator_bins", "wall_seconds": 12.5, "cpu_seconds": 48.1,
+ *    "stages": {"fetch": {"wall_seconds": 44.2, "cpu_seconds": 43.9, "calls": 3120}, ...},
+ *    "counters": {"reads_fetched": 71234567, "bam_bytes_decoded": 9876543210, ...},
+ *    "queue_depth": {"samples": 611, "mean": 7.9, "max": 8},
+ *    "threads": [{"busy_seconds": 12.1, "idle_seconds": 0.4, "stages": {...}}, ...]}
+ *
+ * and logs the same line.  Stage times and counters are kept per thread, so recording them
+ * doesn't contend, and are only summed when written.  Stage wall times are summed over threads,
+ * so they can add up to more than the total wall time.  When metrics are disabled, recording
+ * is just a check of a bool.
+ */
+
+enum class Stage
+{
+  index_load,   // opening bams and loading their indexes
+  region_parse, // parsing region files
+  fetch,        // fetching or reading reads from bams (and counting them when fetching, see fetch), or reading fasta chunks
+  inflate,      // inflating BGZF blocks read ahead of parsing them (see bgzf_read_ahead.h)
+  score,        // scoring reads or fasta sequences for motifs
+  count,        // counting reads read once for many analyses or for an index (see bamliquidator_pass)
+  write,        // writing results, e.g. to hdf5
+  stage_count
+};
+
+enum class Counter
+{
+  reads_fetched,
+  bam_bytes_decoded, // uncompressed bytes of the reads decoded (samtools doesn't report compressed bytes read)
+  queries,           // bamliquidator queries answered
+  regions,           // regions parsed
+  bases_scored,      // fasta bases scored for motifs (see fasta_scorer.cpp)
+  counter_count
+};
+
+namespace metrics_detail
+{
+
+inline const char* name(Stage stage)
+{
+  static const char* const names[] = {"index_load", "region_parse", "fetch", "inflate", "score", "count", "write"};
+  return names[int(stage)];
+}
+
+inline const char* name(Counter counter)
+{
+  static const char* const names[] = {"reads_fetched", "bam_bytes_decoded", "queries", "regions", "bases_scored"};
+  return names[int(counter)];
+}
+
+inline double wall_seconds()
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline double thread_cpu_seconds()
+{
+  timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+struct StageTotals
+{
+  double wall_seconds = 0;
+  double cpu_seconds = 0;
+  size_t calls = 0;
+
+  StageTotals& operator+=(const StageTotals& other)
+  {
+    wall_seconds += other.wall_seconds;
+    cpu_seconds += other.cpu_seconds;
+    calls += other.calls;
+    return *this;
+  }
+};
+
+typedef std::array<StageTotals, size_t(Stage::stage_count)> StageArray;
+
+struct ThreadMetrics
+{
+  StageArray stages;
+  std::array<uint64_t, size_t(Counter::counter_count)> counters = {};
+  size_t queue_depth_samples = 0;
+  size_t queue_depth_total = 0;
+  size_t queue_depth_max = 0;
+};
+
+inline void write_stages(std::ostream& out, const StageArray& stages)
+{
+  out << '{';
+  bool first = true;
+  for (size_t i=0; i < stages.size(); ++i)
+  {
+    if (stages[i].calls == 0) continue;
+    out << (first ? "" : ", ") << '"' << name(Stage(i)) << "\": {\"wall_seconds\": " << stages[i].wall_seconds
+        << ", \"cpu_seconds\": " << stages[i].cpu_seconds << ", \"calls\": " << stages[i].calls << '}';
+    first = false;
+  }
+  out << '}';
+}
+
+}
+
+class Metrics
+{
+public:
+  static bool enabled()
+  {
+    static const bool enabled = path() != nullptr && *path() != '\0';
+    return enabled;
+  }
+
+  static Metrics& instance()
+  {
+    static Metrics metrics;
+    return metrics;
+  }
+
+  // Call at the start of main, so the total wall time covers the whole run.
+  static void start()
+  {
+    if (enabled())
+    {
+      instance();
+    }
+  }
+
+  // this thread's metrics
+  metrics_detail::ThreadMetrics& local()
+  {
+    return m_threads.local();
+  }
+
+  // Appends the json summary (see above) to the LIQUIDATOR_METRICS file, returning the summary
+  // so the caller can also log it.  Call once, after all the work is done.
+  std::string write(const std::string& executable)
+  {
+    using namespace metrics_detail;
+
+    const double wall = wall_seconds() - m_start_wall;
+    StageArray stages;
+    std::array<uint64_t, size_t(Counter::counter_count)> counters = {};
+    size_t queue_depth_samples = 0, queue_depth_total = 0, queue_depth_max = 0;
+    std::stringstream threads;
+    bool first_thread = true;
+    for (const ThreadMetrics& thread : m_threads)
+    {
+      double busy = 0;
+      for (size_t i=0; i < stages.size(); ++i)
+      {
+        stages[i] += thread.stages[i];
+        busy += thread.stages[i].wall_seconds;
+      }
+      for (size_t i=0; i < counters.size(); ++i)
+      {
+        counters[i] += thread.counters[i];
+      }
+      queue_depth_samples += thread.queue_depth_samples;
+      queue_depth_total += thread.queue_depth_total;
+      queue_depth_max = std::max(queue_depth_max, thread.queue_depth_max);
+
+      threads << (first_thread ? "" : ", ") << "{\"busy_seconds\": " << busy
+              << ", \"idle_seconds\": " << std::max(0.0, wall - busy) << ", \"stages\": ";
+      write_stages(threads, thread.stages);
+      threads << '}';
+      first_thread = false;
+    }
+
+    std::stringstream summary;
+    summary << "{\"executable\": \"" << executable << "\", \"wall_seconds\": " << wall
+            << ", \"cpu_seconds\": " << double(std::clock())/CLOCKS_PER_SEC << ", \"stages\": ";
+    write_stages(summary, stages);
+    summary << ", \"counters\": {";
+    for (size_t i=0; i < counters.size(); ++i)
+    {
+      summary << (i == 0 ? "" : ", ") << '"' << name(Counter(i)) << "\": " << counters[i];
+    }
+    summary << '}';
+    if (queue_depth_samples > 0)
+    {
+      summary << ", \"queue_depth\": {\"samples\": " << queue_depth_samples << ", \"mean\": "
+              << double(queue_depth_total)/queue_depth_samples << ", \"max\": " << queue_depth_max << '}';
+    }
+    summary << ", \"threads\": [" << threads.str() << "]}";
+
+    std::ofstream(path(), std::ios::app) << summary.str() << std::endl;
+    return summary.str();
+  }
+
+private:
+  Metrics():
+    m_start_wall(metrics_detail::wall_seconds())
+  {}
+
+  static const char* path()
+  {
+    return std::getenv("LIQUIDATOR_METRICS");
+  }
+
+  const double m_start_wall;
+  tbb::enumerable_thread_specific<metrics_detail::ThreadMetrics,
+                                  tbb::cache_aligned_allocator<metrics_detail::ThreadMetrics>,
+                                  tbb::ets_key_per_instance> m_threads;
+};
+
+// Writes the summary (see Metrics::write) if metrics are enabled, returning it, or an empty string
+// if metrics are disabled.
+inline std::string write_metrics(const std::string& executable)
+{
+  return Metrics::enabled() ? Metrics::instance().write(executable) : std::string();
+}
+
+// Same as write_metrics, also logging the summary, for the executables that use Logger.
+inline void log_metrics(const std::string& executable)
+{
+  const std::string summary = write_metrics(executable);
+  if (!summary.empty())
+  {
+    Logger::info() << "metrics\t" << summary;
+  }
+}
+
+// Adds value to the counter for this thread, if metrics are enabled.
+inline void add_count(Counter counter, uint64_t value)
+{
+  if (Metrics::enabled())
+  {
+    Metrics::instance().local().counters[size_t(counter)] += value;
+  }
+}
+
+// Records a sample of how many chunks are in flight in a pipeline, if metrics are enabled.
+inline void sample_queue_depth(size_t depth)
+{
+  if (Metrics::enabled())
+  {
+    metrics_detail::ThreadMetrics& local = Metrics::instance().local();
+    ++local.queue_depth_samples;
+    local.queue_depth_total += depth;
+    local.queue_depth_max = std::max(local.queue_depth_max, depth);
+  }
+}
+
+// Adds the wall and cpu time of its scope to the stage for this thread, if metrics are enabled.
+// Stages shouldn't be nested, so that a thread's busy time is the sum of its stage times.
+class StageTimer
+{
+public:
+  explicit StageTimer(Stage stage):
+    m_stage(stage),
+    m_enabled(Metrics::enabled()),
+    m_start_wall(m_enabled ? metrics_detail::wall_seconds() : 0),
+    m_start_cpu(m_enabled ? metrics_detail::thread_cpu_seconds() : 0)
+  {}
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+  ~StageTimer()
+  {
+    if (m_enabled)
+    {
+      metrics_detail::StageTotals& totals = Metrics::instance().local().stages[size_t(m_stage)];
+      totals.wall_seconds += metrics_detail::wall_seconds() - m_start_wall;
+      totals.cpu_seconds += metrics_detail::thread_cpu_seconds() - m_start_cpu;
+      ++totals.calls;
+    }
+  }
+
+private:
+  const Stage m_stage;
+  const bool m_enabled;
+  const double m_start_wall;
+  const double m_start_cpu;
+};
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -0,0 +1,240 @@
+#include "motif_cache.h"
+
+#include "liquidator_util.h"
+#include "detail/score_matrix_detail.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace
+{
+
+// the version must be incremented when the format changes, or the way matrices are built changes
+const char cache_magic[8] = { 'L', 'Q', 'M', 'O', 'T', 'I', 'F', '\0' };
+const uint32_t cache_version = 1;
+
+// The cache is a CacheHeader followed by, for each matrix, a MatrixHeader and then its name, scaled
+// values and p-values, each padded to a multiple of 8 bytes so the p-values are aligned in the mapping.
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t matrix_count;
+    uint64_t key;
+};
+
+struct MatrixHeader
+{
+    uint32_t name_length;
+    uint32_t length;
+    uint64_t pvalue_count;
+    double scale;
+    double min_before_scaling;
+    uint8_t is_reverse_complement;
+    uint8_t padding[7];
+};
+
+size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+// 64 bit FNV-1a
+uint64_t hash(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i=0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Reads sizes from a mapped cache, checking that a truncated cache isn't read past its end.
+class CacheCursor
+{
+public:
+    CacheCursor(const liquidator::MappedFile& file)
+    :
+        m_file(file),
+        m_offset(0)
+    {}
+
+    const char* next(size_t size)
+    {
+        if (size > m_file.size() - m_offset)
+        {
+            throw std::runtime_error("motif cache is truncated");
+        }
+        const char* data = m_file.data() + m_offset;
+        m_offset += padded(size);
+        m_offset = std::min(m_offset, m_file.size());
+        return data;
+    }
+
+private:
+    const liquidator::MappedFile& m_file;
+    size_t m_offset;
+};
+
+void write_padded(std::ostream& out, const void* data, size_t size)
+{
+    static const char zeros[8] = {};
+    out.write(static_cast<const char*>(data), size);
+    out.write(zeros, padded(size) - size);
+}
+
+}
+
+namespace liquidator
+{
+
+uint64_t motif_cache_key(const std::string& meme_style_pwm,
+                         const std::array<double, AlphabetSize>& acgt_background,
+                         bool include_reverse_complement,
+                         double pseudo_sites)
+{
+    uint64_t key = 14695981039346656037ull;
+    key = hash(key, &cache_version, sizeof(cache_version));
+    key = hash(key, meme_style_pwm.data(), meme_style_pwm.size());
+    key = hash(key, acgt_background.data(), sizeof(double)*acgt_background.size());
+    key = hash(key, &include_reverse_complement, sizeof(include_reverse_complement));
+    key = hash(key, &pseudo_sites, sizeof(pseudo_sites));
+    return key;
+}
+
+bool read_motif_cache(const std::string& cache_file_path, uint64_t key, std::vector<ScoreMatrix>& matrices)
+{
+    if (access(cache_file_path.c_str(), F_OK) != 0)
+    {
+        return false;
+    }
+
+    const MappedFile file(cache_file_path);
+    if (!file.is_mapped() || file.size() < sizeof(CacheHeader))
+    {
+        return false;
+    }
+
+    CacheCursor cursor(file);
+    CacheHeader header;
+    std::memcpy(&header, cursor.next(sizeof(CacheHeader)), sizeof(CacheHeader));
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0
+        || header.version != cache_version
+        || header.key != key)
+    {
+        return false;
+    }
+
+    std::vector<ScoreMatrix> cached;
+    cached.reserve(header.matrix_count);
+    for (uint32_t i=0; i < header.matrix_count; ++i)
+    {
+        MatrixHeader matrix_header;
+        std::memcpy(&matrix_header, cursor.next(sizeof(MatrixHeader)), sizeof(MatrixHeader));
+
+        const std::string name(cursor.next(matrix_header.name_length), matrix_header.name_length);
+
+        const size_t values_size = sizeof(std::array<unsigned, AlphabetSize>)*matrix_header.length;
+        const auto values = reinterpret_cast<const std::array<unsigned, AlphabetSize>*>(cursor.next(values_size));
+
+        const size_t pvalues_size = sizeof(double)*matrix_header.pvalue_count;
+        const auto pvalues = reinterpret_cast<const double*>(cursor.next(pvalues_size));
+
+        // every scaled score of the matrix indexes its p-values (see detail::probability_distribution)
+        const std::vector<std::array<unsigned, AlphabetSize>> matrix(values, values + matrix_header.length);
+        if (matrix_header.pvalue_count != size_t(detail::max(matrix))*matrix.size() + 1)
+        {
+            throw std::runtime_error("motif cache is corrupt");
+        }
+
+        cached.push_back(ScoreMatrix(name,
+                                     matrix_header.is_reverse_complement != 0,
+                                     matrix,
+                                     matrix_header.scale,
+                                     matrix_header.min_before_scaling,
+                                     std::vector<double>(pvalues, pvalues + matrix_header.pvalue_count)));
+    }
+
+    matrices.swap(cached);
+    return true;
+}
+
+void write_motif_cache(const std::string& cache_file_path, uint64_t key, const std::vector<ScoreMatrix>& matrices)
+{
+    const std::string temporary_path = cache_file_path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream out(temporary_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            throw std::runtime_error("failed to open " + temporary_path);
+        }
+
+        CacheHeader header = {};
+        std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = cache_version;
+        header.matrix_count = matrices.size();
+        header.key = key;
+        write_padded(out, &header, sizeof(header));
+
+        for (const ScoreMatrix& matrix : matrices)
+        {
+            MatrixHeader matrix_header = {};
+            matrix_header.name_length = matrix.name().size();
+            matrix_header.length = matrix.matrix().size();
+            matrix_header.pvalue_count = matrix.pvalues().size();
+            matrix_header.scale = matrix.scale();
+            matrix_header.min_before_scaling = matrix.min_before_scaling();
+            matrix_header.is_reverse_complement = matrix.is_reverse_complement();
+            write_padded(out, &matrix_header, sizeof(matrix_header));
+            write_padded(out, matrix.name().data(), matrix.name().size());
+            write_padded(out, matrix.matrix().data(), sizeof(std::array<unsigned, AlphabetSize>)*matrix.matrix().size());
+            write_padded(out, matrix.pvalues().data(), sizeof(double)*matrix.pvalues().size());
+        }
+
+        if (!out.flush())
+        {
+            std::remove(temporary_path.c_str());
+            throw std::runtime_error("failed to write " + temporary_path);
+        }
+    }
+
+    if (std::rename(temporary_path.c_str(), cache_file_path.c_str()) != 0)
+    {
+        const int rename_errno = errno;
+        std::remove(temporary_path.c_str());
+        std::stringstream ss;
+        ss << "Failed to rename " << temporary_path << " to " << cache_file_path << ": error " << rename_errno;
+        throw std::runtime_error(ss.str());
+    }
+}
+
+}
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
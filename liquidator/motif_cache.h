@@ -0,0 +1,60 @@
+#ifndef LIQUIDATOR_MOTIF_CACHE_H_INCLUDED
+#define LIQUIDATOR_MOTIF_CACHE_H_INCLUDED
+
+#include "score_matrix.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace liquidator
+{
+
+// A motif cache is a versioned binary file of built matrices (their scaled values, scales and
+// p-value tables), so that reading a motif file doesn't need to parse it or build the p-value
+// tables again. Each cache has a key from everything the matrices were built from, so a cache
+// compiled from a different motif file, background or settings is never used.
+
+// Returns the key of the matrices ScoreMatrix::read builds from the motif file contents.
+uint64_t motif_cache_key(const std::string& meme_style_pwm,
+                         const std::array<double, AlphabetSize>& acgt_background,
+                         bool include_reverse_complement = true,
+                         double pseudo_sites = ScoreMatrix::DEFAULT_PSEUDO_SITES);
+
+// Reads the matrices from a memory mapping of the cache and returns true, or returns false
+// if there is no cache file, or it's from another version or has a different key.
+// Throws std::runtime_error if the cache file is truncated or corrupt.
+bool read_motif_cache(const std::string& cache_file_path, uint64_t key, std::vector<ScoreMatrix>& matrices);
+
+// Writes the cache to a temporary file that is then renamed to the cache file, so that a
+// concurrent read_motif_cache never sees a partially written cache.
+// Throws std::runtime_error on failure.
+void write_motif_cache(const std::string& cache_file_path, uint64_t key, const std::vector<ScoreMatrix>& matrices);
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -1,5 +1,6 @@
 #include "bam_scorer.h"
 #include "fasta_scorer.h"
+#include "motif_cache.h"
 #include "score_matrix.h"
 #include "version.h"
 
@@ -8,6 +9,8 @@
 
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 
@@ -30,11 +33,13 @@ int process_command_line(int argc,
                          std::string& ouput_file_path,
                          std::string& motif_name,
                          BamScorer::PrintStyle& bam_print_style,
+                         FastaOutputFormat& fasta_output_format,
+                         std::string& cache_file_path,
                          bool& unmapped_only)
 {
     namespace po = boost::program_options;
 
-    std::string motif_file_path, background_file_path, print_argument;
+    std::string motif_file_path, background_file_path, print_argument, format_argument;
 
     po::options_description options(std::string("usage: motif_liquidator [options] motif fasta|bam")
                                   + "\nversion " + std::string(version) +
@@ -42,7 +47,8 @@ int process_command_line(int argc,
                                   + "\nFor more info, see https://github.com/BradnerLab/pipeline/wiki/motif_liquidator"
                                   + "\n\npositional arguments:"
                                   + "\n  motif                   A MEME style position weight matrix file."
-                                  + "\n  fasta|bam               A fasta file or (sorted and indexed) bam file."
+                                  + "\n  fasta|bam               A fasta file (which may be gzip or bgzf compressed, with sequences on"
+                                  + "\n                          one line or wrapped over many) or (sorted and indexed) bam file."
                                   + "\n\noptional arguments");
     options.add_options()
         ("motif-name,m", po::value(&motif_name), "Motif name (default is all motifs in the motif file)")
@@ -51,10 +57,18 @@ int process_command_line(int argc,
                                                            "Backgrounds specified in the motif file are never used (just like default "
                                                            "FIMO behavior).")
         ("help,h", "Display this help and exit.")
-        ("output,o", po::value(&ouput_file_path), "File to write matches to. Output is fimo style for fasta input, and output is a "
-                                                  "(sorted/indexed) .bam for bam input.")
-        ("region,r", po::value(&region_file_path), ".bed or .gff region file for filtering bam input.")
+        ("output,o", po::value(&ouput_file_path), "File to write matches to. Output is fimo style for fasta input (unless "
+                                                  "--format is specified), and output is a (sorted/indexed) .bam for bam input.")
+        ("format,f", po::value(&format_argument), "For fastas, the output format: 'fimo' (the default) for fimo style text, or 'hdf5' "
+                                                  "for an hdf5 file with hits, motifs and sequences tables, whose hits refer to motifs "
+                                                  "and sequences by row and have the start of the matched sequence instead of its text. "
+                                                  "This is much smaller and faster to read for many hits.")
+        ("region,r", po::value(&region_file_path), ".bed or .gff region file for filtering bam input.  Reads overlapping more than one region are only scored once.")
         ("unmapped-only,u", "Only scores unmapped reads from bam.")
+        ("cache,c", po::value(&cache_file_path), "Binary motif cache file, which is much faster to load than the motif file.  "
+                                                 "If the cache was compiled from the same motif file and background, the motifs "
+                                                 "are loaded from it, otherwise the cache is (re)compiled from the motif file.  A cache "
+                                                 "that can't be read or written is warned about and the motif file is used.")
         ("print,p", po::value(&print_argument), "For bams, additionally prints detailed fimo style output to stdout.  Specify '-p fimo' "
                                                 "for fimo style output or '-p mapped-fimo' for the sequence name to include the chromosome "
                                                 "and the for start/stop values to be the mapped positions.")
@@ -96,18 +110,23 @@ int process_command_line(int argc,
 
         po::notify(vm);
 
-        const std::string input_extension = boost::filesystem::extension(input_file_path);
-        if (input_extension == ".bam")
+        std::string input_extension = boost::filesystem::extension(input_file_path);
+        const bool gzipped = input_extension == ".gz";
+        if (gzipped)
+        {
+            input_extension = boost::filesystem::extension(boost::filesystem::path(input_file_path).stem());
+        }
+        if (input_extension == ".bam" && !gzipped)
         {
             input_type = bam_input_type;
         }
-        else if (input_extension == ".fasta")
+        else if (input_extension == ".fasta" || input_extension == ".fa")
         {
             input_type = fasta_input_type;
         }
         else
         {
-            std::cerr << "only .bam and .fasta extensions are supported at this time" << std::endl;
+            std::cerr << "only .bam, .fasta and .fa (optionally gzipped, e.g. .fa.gz) extensions are supported at this time" << std::endl;
             return 1;
         }
 
@@ -155,6 +174,25 @@ int process_command_line(int argc,
             bam_print_style = BamScorer::None;
         }
 
+        fasta_output_format = FimoOutput;
+        if (vm.count("format"))
+        {
+            if (input_type != fasta_input_type)
+            {
+                std::cerr << "only .fasta input files support an output format" << std::endl;
+                return 1;
+            }
+            if (format_argument == "hdf5")
+            {
+                fasta_output_format = HitTableOutput;
+            }
+            else if (format_argument != "fimo")
+            {
+                std::cerr << "Invalid format argument '" << format_argument << "'; please specify either 'fimo' or 'hdf5'." << std::endl;
+                return 1;
+            }
+        }
+
         unmapped_only = vm.count("unmapped-only") > 0;
     }
     catch(const std::exception& e)
@@ -167,21 +205,74 @@ int process_command_line(int argc,
     return 0;
 }
 
+// The cache has all of the motifs in the motif file, so the motif_name filter is applied after reading it.
+// The cache only saves time, so a cache that can't be read (e.g. truncated) or written (e.g. in a read
+// only directory) is warned about and the motif file is read instead, rewriting the cache if possible.
+std::vector<ScoreMatrix> read_cached_matrices(std::ifstream& motif_file,
+                                              const std::array<double, AlphabetSize>& background,
+                                              const std::string& motif_name,
+                                              const std::string& cache_file_path)
+{
+    const std::string motif_file_contents((std::istreambuf_iterator<char>(motif_file)), std::istreambuf_iterator<char>());
+    const uint64_t key = motif_cache_key(motif_file_contents, background);
+
+    std::vector<ScoreMatrix> all_matrices;
+    bool cached = false;
+    try
+    {
+        cached = read_motif_cache(cache_file_path, key, all_matrices);
+    }
+    catch (const std::exception& e)
+    {
+        Logger::warn() << "Ignoring motif cache " << cache_file_path << ": " << e.what();
+        all_matrices.clear();
+    }
+
+    if (!cached)
+    {
+        std::istringstream motifs(motif_file_contents);
+        all_matrices = ScoreMatrix::read(motifs, background);
+        try
+        {
+            write_motif_cache(cache_file_path, key, all_matrices);
+        }
+        catch (const std::exception& e)
+        {
+            Logger::warn() << "Failed to write motif cache " << cache_file_path << ": " << e.what();
+        }
+    }
+
+    std::vector<ScoreMatrix> matrices;
+    for (const ScoreMatrix& matrix : all_matrices)
+    {
+        if (motif_name.empty() || matrix.name() == motif_name)
+        {
+            matrices.push_back(matrix);
+        }
+    }
+    return matrices;
+}
+
 int main(int argc, char** argv)
 {
     try
     {
-        std::string input_file_path, region_file_path, ouput_file_path, motif_name;
+        Metrics::start();
+
+        std::string input_file_path, region_file_path, ouput_file_path, motif_name, cache_file_path;
         std::ifstream motif_file;
         InputType input_type = invalid_input_type;
         BamScorer::PrintStyle bam_print_style = BamScorer::None;
+        FastaOutputFormat fasta_output_format = FimoOutput;
         bool unmapped_only = false;
         std::array<double, AlphabetSize> background = ScoreMatrix::default_acgt_background;
 
-        const int rc = process_command_line(argc, argv, input_file_path, input_type, motif_file, background, region_file_path, ouput_file_path, motif_name, bam_print_style, unmapped_only);
+        const int rc = process_command_line(argc, argv, input_file_path, input_type, motif_file, background, region_file_path, ouput_file_path, motif_name, bam_print_style, fasta_output_format, cache_file_path, unmapped_only);
         if (rc) return rc;
 
-        std::vector<ScoreMatrix> matrices = ScoreMatrix::read(motif_file, background, motif_name);
+        std::vector<ScoreMatrix> matrices = cache_file_path.empty()
+                                          ? ScoreMatrix::read(motif_file, background, motif_name)
+                                          : read_cached_matrices(motif_file, background, motif_name, cache_file_path);
 
         if (input_type == bam_input_type)
         {
@@ -189,8 +280,10 @@ int main(int argc, char** argv)
         }
         else if (input_type == fasta_input_type)
         {
-            process_fasta(matrices, input_file_path, ouput_file_path);
+            process_fasta(matrices, input_file_path, ouput_file_path, fasta_output_format);
         }
+
+        write_metrics("motif_liquidator");
     }
     catch(const std::exception& e)
     {
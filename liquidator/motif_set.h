@@ -0,0 +1,314 @@
+#ifndef LIQUIDATOR_MOTIF_SET_H_INCLUDED
+#define LIQUIDATOR_MOTIF_SET_H_INCLUDED
+
+#include "score_matrix.h"
+#include "detail/score_matrix_detail.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <numeric>
+#include <vector>
+
+namespace liquidator
+{
+
+// All the matrices of a motif file (reverse complements included) packed together,
+// so a sequence is scanned once for every motif instead of once per matrix.
+//
+// The values are stored position major: for each motif position there is a block
+// with a column for each base, and each column holds that position's value for
+// every matrix long enough to have it. Since every matrix at an offset reads the
+// same base, scoring an offset is a run of contiguous adds over the matrices (which
+// the compiler vectorizes), and a forward matrix and its reverse complement are
+// scored from the same encoded window. The matrices are ordered longest first, so
+// each position's columns only hold the matrices that reach it.
+//
+// A few matrices are instead scanned one at a time with each matrix's own kernel (see
+// ScoreMatrix::score_windows), which is vectorized across windows where the cpu allows
+// and stops scoring a window once it can't reach the threshold, and so beats the packed
+// adds until there are enough matrices to fill them (see default_scan).
+class MotifSet
+{
+public:
+    enum class Scan
+    {
+        packed,    // all the matrices at each offset together
+        per_matrix // each matrix in turn, with ScoreMatrix::score_windows
+    };
+
+    // The faster scan for the number of matrices with the cpu's score kernel. Scanning random
+    // bases, the avx2 kernels were faster one matrix at a time for every number of matrices
+    // tried (up to 600), while the sse4.1 and scalar kernels fell behind the packed scan past
+    // about 8 and 4 matrices.
+    static Scan default_scan(size_t matrix_count)
+    {
+        switch (detail::supported_score_kernel())
+        {
+            case detail::ScoreKernel::avx2:
+                return Scan::per_matrix;
+            case detail::ScoreKernel::sse41:
+                return matrix_count <= 8 ? Scan::per_matrix : Scan::packed;
+            default:
+                return matrix_count <= 4 ? Scan::per_matrix : Scan::packed;
+        }
+    }
+
+    // windows with p-values below max_pvalue are hits
+    MotifSet(const std::vector<ScoreMatrix>& matrices, double max_pvalue)
+    :
+        MotifSet(matrices, max_pvalue, default_scan(matrices.size()))
+    {}
+
+    MotifSet(const std::vector<ScoreMatrix>& matrices, double max_pvalue, Scan scan)
+    :
+        m_matrices(matrices),
+        m_scan(scan),
+        m_order(matrices.size())
+    {
+        for (const ScoreMatrix& matrix : matrices)
+        {
+            m_matrix_min_scaled_scores.push_back(matrix.min_scaled_score(max_pvalue));
+        }
+
+        std::iota(m_order.begin(), m_order.end(), 0);
+        std::stable_sort(m_order.begin(), m_order.end(), [&](size_t a, size_t b) {
+            return matrices[a].matrix().size() > matrices[b].matrix().size();
+        });
+
+        for (size_t matrix_index : m_order)
+        {
+            m_lengths.push_back(matrices[matrix_index].matrix().size());
+            m_min_scaled_scores.push_back(m_matrix_min_scaled_scores[matrix_index]);
+            m_any_min_scaled_score_is_0 = m_any_min_scaled_score_is_0 || m_min_scaled_scores.back() == 0;
+        }
+
+        const size_t max_length = m_lengths.empty() || m_scan != Scan::packed ? 0 : m_lengths.front();
+        for (size_t position = 0; position < max_length; ++position)
+        {
+            // the matrices that reach this position are the first reaching_count
+            size_t reaching_count = 0;
+            while (reaching_count < m_lengths.size() && m_lengths[reaching_count] > position)
+            {
+                ++reaching_count;
+            }
+            m_reaching_counts.push_back(reaching_count);
+            m_block_offsets.push_back(m_values.size());
+
+            for (size_t column = 0; column < AlphabetSize; ++column)
+            {
+                for (size_t i = 0; i < reaching_count; ++i)
+                {
+                    m_values.push_back(matrices[m_order[i]].matrix()[position][column]);
+                }
+            }
+        }
+    }
+
+    const std::vector<ScoreMatrix>& matrices() const
+    {
+        return m_matrices;
+    }
+
+    // the length of the longest matrix
+    size_t max_length() const
+    {
+        return m_lengths.empty() ? 0 : m_lengths.front();
+    }
+
+    // The scratch space for scanning, so a MotifSet can be shared by threads
+    // each scanning with their own Scanner.
+    class Scanner
+    {
+    public:
+        Scanner(const MotifSet& motifs)
+        :
+            m_motifs(motifs),
+            m_sums(motifs.m_lengths.size())
+        {}
+
+        // Scans the sequence of alphabet indexes (see alphabet_index), calling
+        // consumer(matrix_index, begin, scaled_score) for each window [begin, begin + length)
+        // that is a hit, in the same order as scoring each of the matrices in turn would.
+        template <typename HitConsumer>
+        void scan(const std::vector<uint8_t>& indexes, HitConsumer&& consumer)
+        {
+            if (m_motifs.m_scan == Scan::per_matrix)
+            {
+                scan_per_matrix(indexes, consumer);
+                return;
+            }
+
+            find_hits(indexes);
+            for (const Hit& hit : m_hits)
+            {
+                consumer(hit.matrix_index, hit.begin, hit.scaled_score);
+            }
+        }
+
+    private:
+        struct Hit
+        {
+            size_t matrix_index;
+            size_t begin;
+            unsigned scaled_score;
+
+            bool operator<(const Hit& other) const
+            {
+                return matrix_index < other.matrix_index || (matrix_index == other.matrix_index && begin < other.begin);
+            }
+        };
+
+        void find_hits(const std::vector<uint8_t>& indexes)
+        {
+            m_hits.clear();
+            const std::vector<size_t>& lengths = m_motifs.m_lengths;
+            const size_t size = indexes.size();
+            if (lengths.empty() || size < lengths.back())
+            {
+                return;
+            }
+
+            // windows reaching an invalid index score 0
+            m_next_invalid.resize(size + 1);
+            m_next_invalid[size] = size;
+            for (size_t i = size; i > 0; --i)
+            {
+                m_next_invalid[i-1] = indexes[i-1] < AlphabetSize ? m_next_invalid[i] : i-1;
+            }
+
+            // the windows at begin are for the matrices from first_within on (those that don't
+            // run past the sequence end), and are scorable for those from first_valid on
+            size_t first_within = 0;
+            for (size_t begin = 0; begin + lengths.back() <= size; ++begin)
+            {
+                while (first_within < lengths.size() && begin + lengths[first_within] > size)
+                {
+                    ++first_within;
+                }
+                const size_t valid_length = m_next_invalid[begin] - begin;
+                const size_t first_valid = std::lower_bound(lengths.begin() + first_within, lengths.end(), valid_length,
+                                                            std::greater<size_t>()) - lengths.begin();
+
+                if (m_motifs.m_any_min_scaled_score_is_0)
+                {
+                    add_zero_score_hits(begin, first_within, first_valid);
+                }
+                if (first_valid == lengths.size())
+                {
+                    continue;
+                }
+
+                unsigned* sums = m_sums.data();
+                std::fill(sums + first_valid, sums + lengths.size(), 0);
+                for (size_t position = 0; position < lengths[first_valid]; ++position)
+                {
+                    const size_t reaching_count = m_motifs.m_reaching_counts[position];
+                    const unsigned* column = m_motifs.m_values.data() + m_motifs.m_block_offsets[position]
+                                           + indexes[begin + position]*reaching_count;
+                    for (size_t i = first_valid; i < reaching_count; ++i)
+                    {
+                        sums[i] += column[i];
+                    }
+                }
+
+                for (size_t i = first_valid; i < lengths.size(); ++i)
+                {
+                    if (sums[i] >= m_motifs.m_min_scaled_scores[i])
+                    {
+                        m_hits.push_back(Hit{m_motifs.m_order[i], begin, sums[i]});
+                    }
+                }
+            }
+
+            std::sort(m_hits.begin(), m_hits.end());
+        }
+
+        template <typename HitConsumer>
+        void scan_per_matrix(const std::vector<uint8_t>& indexes, HitConsumer& consumer) const
+        {
+            static const size_t block_size = 256;
+            unsigned scaled_scores[block_size];
+            for (size_t matrix_index = 0; matrix_index < m_motifs.m_matrices.size(); ++matrix_index)
+            {
+                const ScoreMatrix& matrix = m_motifs.m_matrices[matrix_index];
+                const size_t length = matrix.matrix().size();
+                if (indexes.size() < length) continue;
+
+                const unsigned min_scaled_score = m_motifs.m_matrix_min_scaled_scores[matrix_index];
+                const size_t window_count = indexes.size() - length + 1;
+                for (size_t block_begin = 0; block_begin < window_count; block_begin += block_size)
+                {
+                    const size_t block_count = std::min(block_size, window_count - block_begin);
+                    matrix.score_windows(indexes.data() + block_begin, block_count, min_scaled_score, scaled_scores);
+                    for (size_t i = 0; i < block_count; ++i)
+                    {
+                        if (scaled_scores[i] >= min_scaled_score)
+                        {
+                            consumer(matrix_index, block_begin + i, scaled_scores[i]);
+                        }
+                    }
+                }
+            }
+        }
+
+        // the unscorable windows score 0, which is a hit if any p-value is allowed
+        void add_zero_score_hits(size_t begin, size_t first_within, size_t first_valid)
+        {
+            for (size_t i = first_within; i < first_valid; ++i)
+            {
+                if (m_motifs.m_min_scaled_scores[i] == 0)
+                {
+                    m_hits.push_back(Hit{m_motifs.m_order[i], begin, 0});
+                }
+            }
+        }
+
+        const MotifSet& m_motifs;
+        std::vector<unsigned> m_sums; // in m_order
+        std::vector<size_t> m_next_invalid;
+        std::vector<Hit> m_hits;
+    };
+
+private:
+    const std::vector<ScoreMatrix>& m_matrices;
+    const Scan m_scan;
+    std::vector<unsigned> m_matrix_min_scaled_scores; // by matrix index
+
+    // the following are all in m_order, i.e. longest matrix first
+    std::vector<size_t> m_order; // matrix indexes
+    std::vector<size_t> m_lengths;
+    std::vector<unsigned> m_min_scaled_scores;
+    bool m_any_min_scaled_score_is_0 = false;
+
+    std::vector<size_t> m_reaching_counts; // for each position
+    std::vector<size_t> m_block_offsets;   // for each position, into m_values
+    std::vector<unsigned> m_values;
+};
+
+}
+
+#endif
+
+/* The MIT License (MIT)
+
+   Copyright (c) 2016 Boulder Labs (jdimatteo@boulderlabs.com)
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+ */
@@ -4,6 +4,11 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <memory>
+
 namespace liquidator
 {
 constexpr std::array<double, 4> ScoreMatrix::default_acgt_background;
@@ -56,16 +61,29 @@ ScoreMatrix::ScoreMatrix(const std::string& name,
     std::vector<double> table = detail::probability_distribution(scaledPWM.matrix, adjusted_background);
     detail::pdf_to_pvalues(table);
     m_pvalues = table;
+    m_remaining_max = detail::remaining_max(m_matrix);
+    m_score_windows = detail::score_windows_function(m_matrix.size());
 }
 
-ScoreMatrix::Score
-ScoreMatrix::score_sequence(const std::string& sequence, size_t begin, size_t end) const
+ScoreMatrix::ScoreMatrix(const std::string& name,
+                         bool is_reverse_complement,
+                         std::vector<std::array<unsigned, AlphabetSize>> matrix,
+                         double scale,
+                         double min_before_scaling,
+                         std::vector<double> pvalues)
+    : m_name(name),
+      m_is_reverse_complement(is_reverse_complement),
+      m_matrix(std::move(matrix)),
+      m_scale(scale),
+      m_min_before_scaling(min_before_scaling),
+      m_pvalues(std::move(pvalues)),
+      m_remaining_max(detail::remaining_max(m_matrix)),
+      m_score_windows(detail::score_windows_function(m_matrix.size()))
+{}
+
+void ScoreMatrix::score_windows(const uint8_t* indexes, size_t window_count, unsigned min_scaled_score, unsigned* scaled_scores) const
 {
-    const unsigned scaled_score = detail::score(m_matrix, sequence, begin, end);
-    assert(scaled_score < m_pvalues.size());
-    const double pvalue = m_pvalues[scaled_score];
-    const double unscaled_score = double(scaled_score)/m_scale + m_matrix.size()*m_min_before_scaling;
-    return Score(sequence, m_is_reverse_complement, begin, end, pvalue, unscaled_score);
+    detail::score_windows(m_score_windows, m_matrix, indexes, window_count, scaled_scores, min_scaled_score, m_remaining_max.data());
 }
 
 std::vector<ScoreMatrix>
@@ -78,21 +96,41 @@ ScoreMatrix::read(std::istream& meme_style_pwm,
     const std::array<double, AlphabetSize> acgt_background_with_no_zeros = ensure_no_zeros_in_background(acgt_background);
 
     std::vector<detail::PWM> pwms = detail::read_pwm(meme_style_pwm);
-    std::vector<ScoreMatrix> score_matrices;
-    for (auto& pwm : pwms)
+    std::vector<const detail::PWM*> selected_pwms;
+    for (const auto& pwm : pwms)
     {
-        if (!motif_name.empty() && pwm.name != motif_name)
+        if (motif_name.empty() || pwm.name == motif_name)
         {
-            continue;
+            selected_pwms.push_back(&pwm);
         }
-        score_matrices.push_back(ScoreMatrix(pwm.name, acgt_background_with_no_zeros, include_reverse_complement, pwm.matrix, pwm.number_of_sites, false, pseudo_sites));
-        if (include_reverse_complement)
+    }
+
+    // Building the p-value table dominates reading a motif file, so the matrices are built in parallel,
+    // in the same order as they would be built one by one (each motif followed by its reverse complement).
+    const size_t matrices_per_pwm = include_reverse_complement ? 2 : 1;
+    std::vector<std::unique_ptr<ScoreMatrix>> built(selected_pwms.size()*matrices_per_pwm);
+    tbb::parallel_for(size_t(0), built.size(), [&](size_t i)
+    {
+        const detail::PWM& pwm = *selected_pwms[i/matrices_per_pwm];
+        if (i % matrices_per_pwm == 0)
         {
-            detail::reverse_complement(pwm.matrix);
+            built[i].reset(new ScoreMatrix(pwm.name, acgt_background_with_no_zeros, include_reverse_complement, pwm.matrix, pwm.number_of_sites, false, pseudo_sites));
+        }
+        else
+        {
+            auto reversed_matrix = pwm.matrix;
+            detail::reverse_complement(reversed_matrix);
             auto reversed_acgt_background_with_no_zeros = acgt_background_with_no_zeros;
             std::reverse(reversed_acgt_background_with_no_zeros.begin(), reversed_acgt_background_with_no_zeros.end());
-            score_matrices.push_back(ScoreMatrix(pwm.name, reversed_acgt_background_with_no_zeros, true, pwm.matrix, pwm.number_of_sites, true, pseudo_sites));
+            built[i].reset(new ScoreMatrix(pwm.name, reversed_acgt_background_with_no_zeros, true, reversed_matrix, pwm.number_of_sites, true, pseudo_sites));
         }
+    });
+
+    std::vector<ScoreMatrix> score_matrices;
+    score_matrices.reserve(built.size());
+    for (auto& matrix : built)
+    {
+        score_matrices.push_back(std::move(*matrix));
     }
     return score_matrices;
 }
@@ -3,7 +3,9 @@
 
 #include "liquidator_util.h"
 
+#include <algorithm>
 #include <array>
+#include <cassert>
 #include <cctype>
 #include <iostream>
 #include <string>
@@ -38,6 +40,15 @@ public:
                 unsigned number_of_sites,
                 bool is_reverse_complement = false,
                 double pseudo_sites = DEFAULT_PSEUDO_SITES);
+
+    // Constructs an already built matrix from its scaled values, scale and p-values,
+    // e.g. one read from a motif cache (see motif_cache.h).
+    ScoreMatrix(const std::string& name,
+                bool is_reverse_complement,
+                std::vector<std::array<unsigned, AlphabetSize>> matrix,
+                double scale,
+                double min_before_scaling,
+                std::vector<double> pvalues);
  
     // Scores reference a sequence string so are intended to be used only
     // in the scope of a ScoreConsumer operator.
@@ -74,13 +85,65 @@ public:
     template <typename ScoreConsumer>
     void score(const std::string& sequence, ScoreConsumer& consumer) const
     {
-        for (size_t start = 1, stop = m_matrix.size(); stop <= sequence.size(); ++start, ++stop)
+        score(sequence, 0, consumer);
+    }
+
+    // Same as score(sequence, consumer), but only calls the consumer for the windows
+    // scoring at least min_scaled_score (see min_scaled_score()), so the usual case
+    // of a window missing doesn't pay for a Score or a p-value lookup.
+    template <typename ScoreConsumer>
+    void score(const std::string& sequence, unsigned min_scaled_score, ScoreConsumer& consumer) const
+    {
+        std::vector<uint8_t> indexes(sequence.size());
+        std::transform(sequence.begin(), sequence.end(), indexes.begin(), alphabet_index);
+        score(indexes, sequence, min_scaled_score, consumer);
+    }
+
+    // Same as score(sequence, consumer), but scores the alphabet indexes of the sequence
+    // (see alphabet_index and nt16_alphabet_index), e.g. bam bases without decoding them.
+    // The sequence is only referenced by the scores for writing the matched sequence,
+    // so the consumer may fill it in lazily, e.g. just for the hits.
+    template <typename ScoreConsumer>
+    void score(const std::vector<uint8_t>& indexes, const std::string& sequence, ScoreConsumer& consumer) const
+    {
+        score(indexes, sequence, 0, consumer);
+    }
+
+    // Windows are scored a block at a time with the vectorized detail::score_windows, with
+    // the kernel picked for the matrix's width when the matrix was constructed.
+    template <typename ScoreConsumer>
+    void score(const std::vector<uint8_t>& indexes, const std::string& sequence, unsigned min_scaled_score, ScoreConsumer& consumer) const
+    {
+        if (indexes.size() < m_matrix.size()) return;
+
+        const size_t window_count = indexes.size() - m_matrix.size() + 1;
+        static const size_t block_size = 256;
+        unsigned scaled_scores[block_size];
+        for (size_t block_begin = 0; block_begin < window_count; block_begin += block_size)
         {
-            const Score score = score_sequence(sequence, start-1, stop);
-            consumer(m_name, start, stop, score);
+            const size_t block_count = std::min(block_size, window_count - block_begin);
+            score_windows(indexes.data() + block_begin, block_count, min_scaled_score, scaled_scores);
+            for (size_t i = 0, begin = block_begin; i < block_count; ++i, ++begin)
+            {
+                if (scaled_scores[i] >= min_scaled_score)
+                {
+                    const Score score = make_score(sequence, begin, begin + m_matrix.size(), scaled_scores[i]);
+                    consumer(m_name, begin + 1, begin + m_matrix.size(), score);
+                }
+            }
         }
     }
 
+    // The minimum scaled score with a p-value below max_pvalue, for the threshold score() overloads.
+    // The scaled scores are indexes into pvalues(), which never increase with the score.
+    // Returns pvalues().size() if no score is below max_pvalue.
+    unsigned min_scaled_score(double max_pvalue) const
+    {
+        return std::partition_point(m_pvalues.begin(), m_pvalues.end(),
+                                    [=](double pvalue) { return !(pvalue < max_pvalue); })
+               - m_pvalues.begin();
+    }
+
     std::string name() { return m_name; }
     size_t length() { return m_matrix.size(); }
 
@@ -125,8 +188,32 @@ public:
         return m_pvalues;
     }
 
+    // The Score of the window [begin, end) of the sequence, given its scaled score
+    // (e.g. from a MotifSet scan).
+    Score make_score(const std::string& sequence, size_t begin, size_t end, unsigned scaled_score) const
+    {
+        assert(scaled_score < m_pvalues.size());
+        const double pvalue = m_pvalues[scaled_score];
+        const double unscaled_score = double(scaled_score)/m_scale + m_matrix.size()*m_min_before_scaling;
+        return Score(sequence, m_is_reverse_complement, begin, end, pvalue, unscaled_score);
+    }
+
+    // See detail::remaining_max().
+    const std::vector<unsigned>& remaining_max() const
+    {
+        return m_remaining_max;
+    }
+
+    // scaled_scores[i] is the scaled score of the window [i, i + length()) of the indexes,
+    // or possibly 0 if it is below min_scaled_score
+    void score_windows(const uint8_t* indexes, size_t window_count, unsigned min_scaled_score, unsigned* scaled_scores) const;
+
 private:
-    Score score_sequence(const std::string& sequence, size_t begin, size_t end) const;
+
+    // see detail::score_windows_function()
+    typedef void (*ScoreWindowsFunction)(const std::vector<std::array<unsigned, AlphabetSize>>& matrix,
+                                         const uint8_t* indexes, size_t window_count, unsigned* scores,
+                                         unsigned min_score, const unsigned* remaining_max);
 
     const std::string m_name;
     const bool m_is_reverse_complement;
@@ -134,6 +221,8 @@ private:
     double m_scale;
     double m_min_before_scaling;
     std::vector<double> m_pvalues;
+    std::vector<unsigned> m_remaining_max;
+    ScoreWindowsFunction m_score_windows;
 };
 
 inline std::ostream& operator<<(std::ostream& out, const ScoreMatrix::Score& score)
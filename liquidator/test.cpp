@@ -1,8 +1,21 @@
 #include "gtest/gtest.h"
 
+#include "bam_index_stats.h"
+#include "bamliquidator.h"
+#include "bamliquidator_coverage.h"
+#include "bamliquidator_regions.h"
+#include "bamliquidator_shards.h"
+#include "bgzf_read_ahead.h"
 #include "score_matrix.h"
 #include "detail/score_matrix_detail.h"
+#include "fasta_reader.h"
 #include "fimo_style_printer.h"
+#include "motif_cache.h"
+#include "motif_set.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 
 using namespace liquidator;
 
@@ -270,6 +283,872 @@ TEST(ScoreMatrix, scaled_score)
     EXPECT_EQ(54, detail::score(matrix, "NAGN", 1, 3));
 }
 
+TEST(ScoreMatrix, scaled_score_of_indexes)
+{
+    const std::vector<std::array<unsigned, AlphabetSize>> matrix =
+    //  A   C   G   T
+    { { { { 24, 24, 24, 0 } },
+        { { 0,  0,  30, 0 } } } };
+
+    const std::string nt16 = "=ACMGRSVTWYHKDBN";
+    for (uint8_t code = 0; code < nt16.size(); ++code)
+    {
+        EXPECT_EQ(alphabet_index(nt16[code]), nt16_alphabet_index(code));
+    }
+
+    for (const std::string sequence : {"A", "T", "N", "AA", "AG", "ag", "AGN", "NAGN", "GNG"})
+    {
+        std::vector<uint8_t> indexes;
+        for (char c : sequence)
+        {
+            indexes.push_back(alphabet_index(c));
+        }
+        for (size_t begin = 0; begin < sequence.size(); ++begin)
+        {
+            for (size_t end = begin; end <= sequence.size() && end - begin <= matrix.size(); ++end)
+            {
+                EXPECT_EQ(detail::score(matrix, sequence, begin, end), detail::score(matrix, indexes.data(), begin, end))
+                    << sequence << " [" << begin << ", " << end << ")";
+            }
+        }
+    }
+}
+
+TEST(ScoreMatrix, score_windows)
+{
+    // every index, including invalid ones, at every position relative to the vector widths
+    std::vector<uint8_t> indexes;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        indexes.push_back(i % 17 == 16 ? 99 : (i*i + i/3) % AlphabetSize);
+    }
+    indexes.push_back(AlphabetSize);
+
+    // the kernels for any width and for fixed widths
+    EXPECT_EQ(detail::score_windows_scalar<0>, detail::score_windows_function(3, detail::ScoreKernel::scalar));
+    EXPECT_EQ(detail::score_windows_scalar<11>, detail::score_windows_function(11, detail::ScoreKernel::scalar));
+    EXPECT_EQ(detail::score_windows_scalar<0>, detail::score_windows_function(23, detail::ScoreKernel::scalar));
+
+    for (unsigned width : { 3u, 6u, 11u, 20u, 23u })
+    {
+        std::vector<std::array<unsigned, AlphabetSize>> matrix;
+        for (unsigned row = 0; row < width; ++row)
+        {
+            matrix.push_back({ { row*7 % 13, 1000 - row, row*row, 500 + row } });
+        }
+
+        const std::vector<unsigned> remaining_max = detail::remaining_max(matrix);
+        ASSERT_EQ(matrix.size() + 1, remaining_max.size());
+        ASSERT_EQ(0, remaining_max.back());
+
+        for (size_t window_count = 0; window_count + matrix.size() - 1 <= indexes.size(); ++window_count)
+        {
+            std::vector<unsigned> expected(window_count);
+            for (size_t begin = 0; begin < window_count; ++begin)
+            {
+                expected[begin] = detail::score(matrix, indexes.data(), begin, begin + matrix.size());
+            }
+
+            for (auto kernel : { detail::ScoreKernel::scalar, detail::ScoreKernel::sse41, detail::ScoreKernel::avx2 })
+            {
+                if (kernel > detail::supported_score_kernel())
+                {
+                    continue;
+                }
+                std::vector<unsigned> scores(window_count);
+                detail::score_windows(matrix, indexes.data(), window_count, scores.data(), 0, 0, kernel);
+                EXPECT_EQ(expected, scores) << "kernel " << int(kernel) << ", width " << width << ", " << window_count << " windows";
+
+                // scores at or above the min score are exact, the rest just need to stay below it
+                for (unsigned min_score : { 1u, 2000u, 4000u, 5500u, 6000u, 7000u, 12000u })
+                {
+                    detail::score_windows(matrix, indexes.data(), window_count, scores.data(), min_score, remaining_max.data(), kernel);
+                    for (size_t begin = 0; begin < window_count; ++begin)
+                    {
+                        if (expected[begin] >= min_score)
+                        {
+                            EXPECT_EQ(expected[begin], scores[begin]) << "kernel " << int(kernel) << ", width " << width << ", min " << min_score << ", window " << begin;
+                        }
+                        else
+                        {
+                            EXPECT_LT(scores[begin], min_score) << "kernel " << int(kernel) << ", width " << width << ", min " << min_score << ", window " << begin;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(ScoreMatrix, min_scaled_score)
+{
+    const std::vector<std::array<double, AlphabetSize>> pwm =
+    { { { { 0.1, 0.2, 0.3, 0.4 } },
+        { { 0.7, 0.1, 0.1, 0.1 } },
+        { { 0.0, 0.0, 1.0, 0.0 } },
+        { { 0.25, 0.25, 0.4, 0.1 } } } };
+    const ScoreMatrix matrix("m", uniform_bg, false, pwm, 10);
+    const std::vector<double>& pvalues = matrix.pvalues();
+
+    for (double max_pvalue : { 1.5, 1.0, 0.5, 0.1, 0.01, 0.004, 0.0001, 0.0 })
+    {
+        const unsigned min_score = matrix.min_scaled_score(max_pvalue);
+        for (unsigned scaled_score = 0; scaled_score < pvalues.size(); ++scaled_score)
+        {
+            EXPECT_EQ(pvalues[scaled_score] < max_pvalue, scaled_score >= min_score) << max_pvalue << " " << scaled_score;
+        }
+    }
+    EXPECT_EQ(0, matrix.min_scaled_score(1.5));
+    EXPECT_EQ(pvalues.size(), matrix.min_scaled_score(0.0));
+}
+
+TEST(ScoreMatrix, motif_set)
+{
+    std::vector<ScoreMatrix> matrices;
+    unsigned seed = 1;
+    auto next_random = [&]() { seed = seed * 1103515245 + 12345; return (seed >> 16) % 1000 + 1; };
+    for (size_t length : { 8, 3, 12, 8, 1 })
+    {
+        std::vector<std::array<double, AlphabetSize>> pwm;
+        for (size_t row = 0; row < length; ++row)
+        {
+            std::array<double, AlphabetSize> probabilities;
+            double total = 0;
+            for (double& probability : probabilities)
+            {
+                probability = next_random();
+                total += probability;
+            }
+            for (double& probability : probabilities)
+            {
+                probability /= total;
+            }
+            pwm.push_back(probabilities);
+        }
+        matrices.push_back(ScoreMatrix("m" + std::to_string(matrices.size()), uniform_bg, false, pwm, 10));
+    }
+
+    std::vector<uint8_t> indexes;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        indexes.push_back(next_random() % 50 == 0 ? 99 : next_random() % AlphabetSize);
+    }
+
+    struct Hit
+    {
+        size_t matrix_index;
+        size_t begin;
+        unsigned scaled_score;
+        bool operator==(const Hit& other) const
+        {
+            return matrix_index == other.matrix_index && begin == other.begin && scaled_score == other.scaled_score;
+        }
+    };
+
+    for (double max_pvalue : { 0.001, 0.05, 0.5, 1.5 })
+    {
+        for (size_t size : { 0, 1, 2, 7, 8, 11, 12, 13, 300 })
+        {
+            const std::vector<uint8_t> sequence(indexes.begin(), indexes.begin() + size);
+
+            std::vector<Hit> expected;
+            for (size_t matrix_index = 0; matrix_index < matrices.size(); ++matrix_index)
+            {
+                const ScoreMatrix& matrix = matrices[matrix_index];
+                for (size_t begin = 0; begin + matrix.matrix().size() <= size; ++begin)
+                {
+                    const unsigned scaled_score = detail::score(matrix.matrix(), sequence.data(), begin, begin + matrix.matrix().size());
+                    if (matrix.pvalues()[scaled_score] < max_pvalue)
+                    {
+                        expected.push_back(Hit{matrix_index, begin, scaled_score});
+                    }
+                }
+            }
+
+            for (MotifSet::Scan scan : { MotifSet::Scan::packed, MotifSet::Scan::per_matrix })
+            {
+                const MotifSet motifs(matrices, max_pvalue, scan);
+                MotifSet::Scanner scanner(motifs);
+                std::vector<Hit> hits;
+                scanner.scan(sequence, [&](size_t matrix_index, size_t begin, unsigned scaled_score) {
+                    hits.push_back(Hit{matrix_index, begin, scaled_score});
+                });
+                EXPECT_TRUE(expected == hits) << "max p-value " << max_pvalue << ", size " << size
+                                              << ", scan " << int(scan) << ": " << expected.size()
+                                              << " expected hits, " << hits.size() << " hits";
+            }
+        }
+    }
+
+    // a few motifs (and their reverse complements) are scored with the cpu's vectorized kernels
+    EXPECT_EQ(MotifSet::Scan::per_matrix, MotifSet::default_scan(4));
+    EXPECT_EQ(detail::supported_score_kernel() == detail::ScoreKernel::avx2 ? MotifSet::Scan::per_matrix : MotifSet::Scan::packed,
+              MotifSet::default_scan(600));
+}
+
+TEST(ScoreMatrix, motif_cache)
+{
+    const std::string input_str = R"(MEME version 4
+
+ALPHABET= ACGT
+
+strands: + -
+
+MOTIF first
+
+letter-probability matrix: alength= 4 w= 3 nsites= 18 E= 0
+  0.000000        0.222222        0.611111        0.166667
+  0.611111        0.000000        0.388889        0.000000
+  0.000000        1.000000        0.000000        0.000000
+
+MOTIF second
+
+letter-probability matrix: alength= 4 w= 2 nsites= 10 E= 0
+  0.500000        0.500000        0.000000        0.000000
+  0.100000        0.200000        0.300000        0.400000)";
+
+    std::istringstream ss(input_str);
+    const std::vector<ScoreMatrix> matrices = ScoreMatrix::read(ss);
+    ASSERT_EQ(4, matrices.size());
+
+    const std::string cache_path = testing::TempDir() + "liquidator_motif_cache_test";
+    const uint64_t key = motif_cache_key(input_str, ScoreMatrix::default_acgt_background);
+    write_motif_cache(cache_path, key, matrices);
+
+    std::vector<ScoreMatrix> cached;
+    ASSERT_TRUE(read_motif_cache(cache_path, key, cached));
+    ASSERT_EQ(matrices.size(), cached.size());
+    for (size_t i=0; i < matrices.size(); ++i)
+    {
+        EXPECT_EQ(matrices[i].name(), cached[i].name());
+        EXPECT_EQ(matrices[i].is_reverse_complement(), cached[i].is_reverse_complement());
+        EXPECT_EQ(matrices[i].matrix(), cached[i].matrix());
+        EXPECT_EQ(matrices[i].scale(), cached[i].scale());
+        EXPECT_EQ(matrices[i].min_before_scaling(), cached[i].min_before_scaling());
+        EXPECT_EQ(matrices[i].pvalues(), cached[i].pvalues());
+        EXPECT_EQ(matrices[i].remaining_max(), cached[i].remaining_max());
+    }
+
+    // a cache built from anything else is never used
+    std::array<double, AlphabetSize> other_background = ScoreMatrix::default_acgt_background;
+    other_background[0] += 0.001;
+    EXPECT_NE(key, motif_cache_key(input_str, other_background));
+    EXPECT_NE(key, motif_cache_key(input_str, ScoreMatrix::default_acgt_background, false));
+    EXPECT_NE(key, motif_cache_key(input_str, ScoreMatrix::default_acgt_background, true, 0.2));
+    EXPECT_NE(key, motif_cache_key(input_str + " ", ScoreMatrix::default_acgt_background));
+    EXPECT_FALSE(read_motif_cache(cache_path, key + 1, cached));
+    EXPECT_FALSE(read_motif_cache(cache_path + "_missing", key, cached));
+
+    // a truncated cache is an error
+    {
+        std::ifstream in(cache_path, std::ios::binary);
+        const std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::ofstream out(cache_path, std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size() - 16);
+    }
+    EXPECT_THROW(read_motif_cache(cache_path, key, cached), std::runtime_error);
+
+    // as is a cache whose p-values don't cover its matrix's scores
+    std::vector<double> short_pvalues = matrices[0].pvalues();
+    short_pvalues.pop_back();
+    const ScoreMatrix corrupt(matrices[0].name(), false, matrices[0].matrix(), matrices[0].scale(),
+                              matrices[0].min_before_scaling(), short_pvalues);
+    write_motif_cache(cache_path, key, std::vector<ScoreMatrix>(1, corrupt));
+    EXPECT_THROW(read_motif_cache(cache_path, key, cached), std::runtime_error);
+    std::remove(cache_path.c_str());
+}
+
+TEST(BamIndexStats, read_index_stats)
+{
+    std::string index("BAI\1", 4);
+    auto append32 = [&](uint32_t value) { index.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    auto append64 = [&](uint64_t value) { index.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    append32(3);
+
+    // a reference with a regular bin, the stats pseudo bin, and a linear index with an empty window
+    append32(2);
+    append32(4681); append32(1); append64(100); append64(900);
+    append32(37450); append32(2); append64(100); append64(900); append64(40); append64(2);
+    append32(3); append64(100); append64(500); append64(0);
+
+    // a reference without reads
+    append32(0);
+    append32(0);
+
+    // a reference without a linear index
+    append32(1);
+    append32(37450); append32(2); append64(900); append64(1000); append64(5); append64(0);
+    append32(0);
+
+    const std::string bam_path = testing::TempDir() + "liquidator_index_stats_test.bam";
+    const std::string index_path = testing::TempDir() + "liquidator_index_stats_test.bai";
+    std::ofstream(index_path, std::ios::binary) << index;
+
+    std::vector<ReferenceIndexStats> stats;
+    ASSERT_TRUE(read_index_stats(bam_path, stats));
+    ASSERT_EQ(3, stats.size());
+    EXPECT_TRUE(stats[0].has_reads);
+    EXPECT_EQ(100, stats[0].begin);
+    EXPECT_EQ(900, stats[0].end);
+    EXPECT_EQ(40, stats[0].mapped);
+    EXPECT_EQ(2, stats[0].unmapped);
+    EXPECT_EQ(500, stats[0].last_window_begin);
+    EXPECT_FALSE(stats[1].has_reads);
+    EXPECT_TRUE(stats[2].has_reads);
+    EXPECT_EQ(5, stats[2].mapped);
+    EXPECT_EQ(900, stats[2].last_window_begin);
+
+    std::vector<std::vector<uint64_t>> windows;
+    ASSERT_TRUE(read_index_stats(bam_path, stats, &windows));
+    ASSERT_EQ(3, windows.size());
+    EXPECT_EQ(std::vector<uint64_t>({100, 500, 0}), windows[0]);
+    EXPECT_TRUE(windows[1].empty());
+    EXPECT_TRUE(windows[2].empty());
+
+    // without the pseudo bin the stats are unknown
+    std::string old_index = index;
+    old_index.replace(old_index.find(std::string("\x4a\x92\0\0", 4)), 4, std::string("\x49\x12\0\0", 4));
+    std::ofstream(index_path, std::ios::binary | std::ios::trunc) << old_index;
+    EXPECT_FALSE(read_index_stats(bam_path, stats));
+
+    std::ofstream(index_path, std::ios::binary | std::ios::trunc) << index.substr(0, index.size() - 8);
+    EXPECT_FALSE(read_index_stats(bam_path, stats));
+    std::remove(index_path.c_str());
+    EXPECT_FALSE(read_index_stats(bam_path, stats));
+}
+
+TEST(CoverageIndex, liquidate)
+{
+    struct Span { size_t chromosome; char strand; unsigned int start; unsigned int stop; };
+    const std::vector<Span> spans = {{0, '+', 0, 10}, {0, '-', 5, 25}, {0, '+', 18, 19}, {0, '-', 90, 120},
+                                     {2, '+', 0, 50}, {2, '+', 3, 3}, {2, '-', 49, 60},
+                                     {3, '+', 100, 900}, {3, '-', 130, 700}, {3, '+', 640, 641}};
+    const std::vector<std::string> chromosomes = {"chrA", "chrB", "chrC", "chrD"};
+    const std::vector<uint32_t> lengths = {95, 40, 50, 1000};
+
+    // the overlap of every span with [start, stop), as liquidate would count the reads
+    auto expected = [&](size_t chromosome, char strand, unsigned int start, unsigned int stop)
+    {
+        double count = 0;
+        for (const Span& span : spans)
+        {
+            if (span.chromosome != chromosome || (strand != '.' && strand != span.strand)) continue;
+            count += std::max(0, int(std::min(span.stop, stop)) - int(std::max(span.start, start)));
+        }
+        return count;
+    };
+
+    const std::string path = testing::TempDir() + "liquidator_coverage_test" + coverage_index_extension;
+    for (unsigned int resolution : {1, 10})
+    {
+        CoverageIndexWriter writer(path, chromosomes, lengths, resolution, 200);
+        for (const Span& span : spans)
+        {
+            writer.add(span.chromosome, span.strand, span.start, span.stop);
+        }
+        writer.finish();
+
+        const CoverageIndex index(path);
+        EXPECT_EQ(resolution, index.resolution());
+        EXPECT_EQ(200, index.extendlen());
+        for (char strand : {'+', '-', '.'})
+        {
+            double counts[2] = {0, 0};
+            index.liquidate("chrA", 0, 100, strand, 2, 200, counts);
+            EXPECT_EQ(expected(0, strand, 0, 50), counts[0]);
+            EXPECT_EQ(expected(0, strand, 50, 100), counts[1]);
+
+            counts[0] = 0;
+            index.liquidate("chrC", 10, 70, strand, 1, 200, counts);
+            EXPECT_EQ(expected(2, strand, 10, 70), counts[0]);
+
+            // many checkpoints
+            counts[0] = counts[1] = 0;
+            index.liquidate("chrD", 120, 1000, strand, 2, 200, counts);
+            EXPECT_EQ(expected(3, strand, 120, 560), counts[0]);
+            EXPECT_EQ(expected(3, strand, 560, 1000), counts[1]);
+
+            // only the resolution 1 index is exact between multiples of the resolution
+            counts[0] = 0;
+            index.liquidate("chrA", 7, 21, strand, 1, 200, counts);
+            if (resolution == 1)
+            {
+                EXPECT_EQ(expected(0, strand, 7, 21), counts[0]);
+            }
+            else
+            {
+                EXPECT_DOUBLE_EQ(0.3*expected(0, strand, 0, 10) + expected(0, strand, 10, 20)
+                                 + 0.1*expected(0, strand, 20, 30), counts[0]);
+            }
+        }
+
+        double count = 0;
+        index.liquidate("chrB", 0, 40, '.', 1, 200, &count);
+        index.liquidate("chrZ", 0, 40, '.', 1, 200, &count);
+        EXPECT_EQ(0, count);
+        EXPECT_THROW(index.liquidate("chrA", 0, 40, '.', 1, 0, &count), std::runtime_error);
+    }
+
+    // more coverage between checkpoints than a uint32_t offset holds
+    {
+        CoverageIndexWriter writer(path, {"chrW"}, {4000000000u}, 100000000, 0);
+        writer.add(0, '+', 0, 4000000000u);
+        writer.add(0, '+', 0, 4000000000u);
+        writer.add(0, '-', 0, 100000000);
+        writer.finish();
+
+        const CoverageIndex index(path);
+        double counts[2] = {0, 0};
+        index.liquidate("chrW", 0, 4000000000u, '+', 2, 0, counts);
+        EXPECT_EQ(4000000000.0, counts[0]);
+        EXPECT_EQ(4000000000.0, counts[1]);
+        counts[0] = 0;
+        index.liquidate("chrW", 50000000, 250000000, '-', 1, 0, counts);
+        EXPECT_EQ(50000000, counts[0]);
+    }
+
+    CoverageIndexWriter unsorted(path, chromosomes, lengths, 1, 0);
+    unsorted.add(2, '+', 0, 1);
+    EXPECT_THROW(unsorted.add(0, '+', 0, 1), std::runtime_error);
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "not an index";
+    EXPECT_THROW(CoverageIndex index(path), std::runtime_error);
+    std::remove(path.c_str());
+    std::remove((path + ".tmp").c_str());
+}
+
+TEST(Shards, balance)
+{
+    EXPECT_EQ(std::vector<size_t>({0, 2, 4}), balanced_shard_boundaries({1, 1, 1, 1}, 2));
+    EXPECT_EQ(std::vector<size_t>({0, 1, 5}), balanced_shard_boundaries({10, 1, 1, 1, 1}, 2));
+    EXPECT_EQ(std::vector<size_t>({0, 0, 0, 0}), balanced_shard_boundaries({}, 3));
+
+    // a reference whose reads end in block 1000, with the 3rd window sharing the 2nd window's block
+    ReferenceIndexStats stats;
+    stats.has_reads = true;
+    stats.end = uint64_t(1000) << 16;
+    const std::vector<std::vector<uint64_t>> windows = {{0, uint64_t(100) << 16, 0, uint64_t(400) << 16}};
+    const WindowCosts costs({"chr1"}, {stats}, windows);
+    const uint64_t window = 1 << shard_window_shift;
+    EXPECT_EQ(101, costs.cost("chr1", 0, window));
+    EXPECT_EQ(302, costs.cost("chr1", window, 3*window));
+    EXPECT_EQ(1006, costs.cost("chr1", 0, 6*window)); // the windows past the index cost 1
+    EXPECT_EQ(2, costs.cost("chr2", 0, window + 1));
+    EXPECT_EQ(0, costs.cost("chr1", 5, 5));
+
+    const std::vector<std::pair<std::string, size_t>> lengths = {{"chr1", 4*window}, {"chr2", 2*window}};
+    const std::vector<BinSpan> first = shard_bin_spans(lengths, window, 0, 2, costs);
+    ASSERT_EQ(1, first.size());
+    EXPECT_EQ("chr1", first[0].chromosome);
+    EXPECT_EQ(0, first[0].first_bin);
+    EXPECT_EQ(3, first[0].end_bin);
+    const std::vector<BinSpan> second = shard_bin_spans(lengths, window, 1, 2, costs);
+    ASSERT_EQ(2, second.size());
+    EXPECT_EQ("chr1", second[0].chromosome);
+    EXPECT_EQ(3, second[0].first_bin);
+    EXPECT_EQ(4, second[0].end_bin);
+    EXPECT_EQ("chr2", second[1].chromosome);
+    EXPECT_EQ(0, second[1].first_bin);
+    EXPECT_EQ(2, second[1].end_bin);
+
+    const std::vector<BinSpan> ranges = parse_bin_spans(lengths, 1000, "chr1:0-2500,chr1:2500-70000,chr2");
+    ASSERT_EQ(3, ranges.size());
+    EXPECT_EQ(0, ranges[0].first_bin);
+    EXPECT_EQ(3, ranges[0].end_bin);
+    EXPECT_EQ(3, ranges[1].first_bin);
+    EXPECT_EQ(66, ranges[1].end_bin);
+    EXPECT_EQ("chr2", ranges[2].chromosome);
+    EXPECT_EQ(33, ranges[2].end_bin);
+    EXPECT_THROW(parse_bin_spans(lengths, 1000, "chr3"), std::runtime_error);
+
+    size_t index, count;
+    EXPECT_TRUE(parse_shard_fraction("3/8", index, count));
+    EXPECT_EQ(3, index);
+    EXPECT_EQ(8, count);
+    EXPECT_FALSE(parse_shard_fraction("chr1:0-10", index, count));
+    EXPECT_THROW(parse_shard_fraction("8/8", index, count), std::runtime_error);
+
+    char program[] = "bamliquidator_bins", option[] = "--shard", shard[] = "1/2", threads[] = "4";
+    char* args[] = {program, option, shard, threads};
+    int argc = 4;
+    char** argv = args;
+    EXPECT_EQ("1/2", extract_shard_option(argc, argv));
+    ASSERT_EQ(2, argc);
+    EXPECT_STREQ(program, argv[0]);
+    EXPECT_STREQ(threads, argv[1]);
+}
+
+TEST(Regions, sort_into_tiles)
+{
+    auto region = [](const char* chromosome, uint64_t start, uint64_t stop) {
+        Region region = Region();
+        std::strcpy(region.chromosome, chromosome);
+        region.start = start;
+        region.stop = stop;
+        region.strand = '.';
+        return region;
+    };
+    const std::vector<Region> regions = {
+        region("chr2", 100, 200),
+        region("chr1", 2300, 2400), // exactly tile_gap after the stop of the regions before it
+        region("chr1", 0, 300),
+        region("chr1", 150, 250),   // overlapping
+        region("chr1", 300, 350),   // adjacent
+        region("chr1", 4401, 4500), // just more than tile_gap after
+        region("chr1", 6500, 6600)
+    };
+
+    std::vector<Tile> tiles;
+    const std::vector<size_t> sorted = sort_into_tiles(regions, tiles);
+    EXPECT_EQ(std::vector<size_t>({2, 3, 4, 1, 5, 6, 0}), sorted);
+    ASSERT_EQ(3, tiles.size());
+    EXPECT_EQ(0, tiles[0].begin);
+    EXPECT_EQ(4, tiles[0].end);
+    EXPECT_EQ(4, tiles[1].begin);
+    EXPECT_EQ(6, tiles[1].end);
+    EXPECT_EQ(6, tiles[2].begin);
+    EXPECT_EQ(7, tiles[2].end);
+
+    // a tile stops growing once it spans max_tile_length
+    std::vector<Region> spread;
+    for (uint64_t start = 0; start <= max_tile_length + 4000; start += 1000)
+    {
+        spread.push_back(region("chr1", start, start + 500));
+    }
+    sort_into_tiles(spread, tiles);
+    ASSERT_EQ(2, tiles.size());
+    EXPECT_EQ(max_tile_length/1000 + 1, tiles[0].end);
+}
+
+TEST(Regions, count)
+{
+    // reads sorted by position, each with a name and cigar but no sequence
+    struct Read
+    {
+        uint32_t pos;
+        std::vector<uint32_t> cigar;
+        bool reverse;
+    };
+    const std::vector<Read> reads = {
+        {0, {50 << BAM_CIGAR_SHIFT | BAM_CMATCH}, false},
+        {20, {10 << BAM_CIGAR_SHIFT | BAM_CMATCH, 3000 << BAM_CIGAR_SHIFT | BAM_CREF_SKIP,
+              10 << BAM_CIGAR_SHIFT | BAM_CMATCH}, false}, // long spliced read, ending at 3040
+        {90, {20 << BAM_CIGAR_SHIFT | BAM_CMATCH}, true},
+        {140, {20 << BAM_CIGAR_SHIFT | BAM_CMATCH}, false},
+        {2290, {20 << BAM_CIGAR_SHIFT | BAM_CMATCH}, true}
+    };
+
+    std::vector<LiquidatedRegion> regions = {
+        {0, 100, '.', 0},     // starting at 0
+        {50, 150, '+', 0},
+        {150, 300, '.', 0},   // adjacent
+        {2300, 2400, '.', 0}, // only reached by the spliced read and the read just before it
+        {4401, 4500, '.', 0}
+    };
+    RegionsCounter counter(regions.data(), regions.size(), 0);
+    bam1_t read = bam1_t();
+    for (const Read& r : reads)
+    {
+        read.core.tid = 0;
+        read.core.pos = r.pos;
+        read.core.flag = r.reverse ? BAM_FREVERSE : 0;
+        read.core.l_qname = 2;
+        read.core.n_cigar = r.cigar.size();
+        std::vector<uint8_t> data(2 + 4*r.cigar.size(), 'r');
+        data[1] = '\0';
+        std::memcpy(&data[2], r.cigar.data(), 4*r.cigar.size());
+        read.data = data.data();
+        read.data_len = data.size();
+        counter.count(&read);
+    }
+    read.data = nullptr;
+
+    // each count is the bases of the reads (for the strand) within the region, as liquidate counts them
+    EXPECT_EQ(50 + 80 + 10, regions[0].count);
+    EXPECT_EQ(0 + 100 + 10, regions[1].count);
+    EXPECT_EQ(150 + 10, regions[2].count);
+    EXPECT_EQ(100 + 10, regions[3].count);
+    EXPECT_EQ(0, regions[4].count);
+}
+
+TEST(Regions, parse_regions_chunks)
+{
+    // enough lines for a few chunks, with excluded regions (warnings) on lines 5, 35000 and 37000,
+    // and a line without enough columns on line 36000 in a later chunk
+    const std::string path = testing::TempDir() + "liquidator_parse_regions_test.gff";
+    size_t line_35000_offset = 0;
+    {
+        std::ofstream gff(path);
+        size_t offset = 0;
+        for (int line_number = 1; line_number <= 40000; ++line_number)
+        {
+            std::ostringstream line;
+            if (line_number == 36000)
+            {
+                line << "chr1\tshort\n";
+            }
+            else
+            {
+                const bool excluded = line_number == 5 || line_number == 35000 || line_number == 37000;
+                line << (excluded ? "chrX" : "chr1") << "\tregion" << line_number << "\tbench\t" << line_number
+                     << '\t' << line_number + 100 << "\t.\t+\n";
+            }
+            if (line_number == 35000)
+            {
+                line_35000_offset = offset;
+            }
+            gff << line.str();
+            offset += line.str().size();
+        }
+    }
+    ASSERT_GT(line_35000_offset, detail::region_chunk_size);
+
+    std::ostringstream log;
+    std::streambuf* const stderr_buffer = std::cerr.rdbuf(log.rdbuf());
+    std::string error;
+    try
+    {
+        parse_regions(path, "gff", 0, {{"chr1", 1000000}});
+    }
+    catch (const std::runtime_error& e)
+    {
+        error = e.what();
+    }
+    std::cerr.rdbuf(stderr_buffer);
+    std::remove(path.c_str());
+
+    EXPECT_EQ(0, error.find("Not enough columns parsing line 36000 'chr1\tshort'")) << error;
+
+    // the warnings before the error are logged in order, and none after it
+    const std::string logged = log.str();
+    const size_t first = logged.find("Excluding invalid region on line 5:");
+    const size_t second = logged.find("Excluding invalid region on line 35000:");
+    EXPECT_NE(std::string::npos, first) << logged;
+    EXPECT_NE(std::string::npos, second) << logged;
+    EXPECT_LT(first, second);
+    EXPECT_EQ(std::string::npos, logged.find("line 37000")) << logged;
+}
+
+TEST(BgzfReadAhead, read_ahead)
+{
+    // reads of many lengths (one longer than a chunk), after 10 bytes that stand in for the header
+    std::vector<std::string> reads;
+    std::string inflated(10, 'h');
+    for (size_t i=0; i < 200; ++i)
+    {
+        const int32_t data_length = i == 100 ? int32_t(BGZF_CHUNK_BYTES + 1000) : int32_t(i*37 % 500 + 1);
+        std::string read(4 + 32 + data_length, '\0');
+        const int32_t block_length = 32 + data_length;
+        const uint32_t core[8] = {uint32_t(i % 3), uint32_t(i*10), 4681 << 16 | 60 << 8 | 1, 16 << 16 | 0,
+                                  0, uint32_t(-1), uint32_t(-1), 0};
+        std::memcpy(&read[0], &block_length, 4);
+        std::memcpy(&read[4], core, sizeof(core));
+        for (int32_t j=0; j < data_length; ++j)
+        {
+            read[36 + j] = char(i + j);
+        }
+        reads.push_back(read);
+        inflated += read;
+    }
+
+    // BGZF blocks of 1000 inflated bytes each (so reads span blocks), then the empty end of file block
+    std::string bam;
+    auto append_block = [&](const std::string& data) {
+        std::string compressed(compressBound(data.size()) + 100, '\0');
+        z_stream stream = z_stream();
+        ASSERT_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY));
+        stream.next_in = (Bytef*) data.data();
+        stream.avail_in = data.size();
+        stream.next_out = (Bytef*) &compressed[0];
+        stream.avail_out = compressed.size();
+        ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        const uint16_t block_size_minus_1 = 18 + compressed.size() + 8 - 1;
+        const uint32_t crc = crc32(crc32(0, Z_NULL, 0), (const Bytef*) data.data(), data.size());
+        const uint32_t size = data.size();
+        bam += std::string("\x1f\x8b\x08\x04\0\0\0\0\0\xff\x06\0BC\x02\0", 16);
+        bam.append(reinterpret_cast<const char*>(&block_size_minus_1), 2);
+        bam += compressed;
+        bam.append(reinterpret_cast<const char*>(&crc), 4);
+        bam.append(reinterpret_cast<const char*>(&size), 4);
+    };
+    for (size_t begin = 0; begin < inflated.size(); begin += 1000)
+    {
+        append_block(inflated.substr(begin, 1000));
+    }
+    append_block("");
+
+    const std::string bam_path = testing::TempDir() + "liquidator_bgzf_read_ahead_test.bam";
+    std::ofstream(bam_path, std::ios::binary) << bam;
+
+    struct Reads
+    {
+        bam1_t& next_read()
+        {
+            if (size == reads.size())
+            {
+                reads.push_back(bam1_t());
+            }
+            return reads[size];
+        }
+
+        std::vector<bam1_t> reads;
+        size_t size = 0;
+    };
+    auto read_all = [&](BgzfReadAhead& read_ahead, Reads& parsed) {
+        bool reading = true;
+        while (reading)
+        {
+            BgzfChunk chunk;
+            reading = read_ahead.read(chunk);
+            BgzfReadAhead::inflate(chunk);
+            read_ahead.parse(chunk, parsed);
+        }
+        read_ahead.finish();
+    };
+    auto free_reads = [](Reads& parsed) {
+        for (size_t i=0; i < parsed.size; ++i)
+        {
+            free(parsed.reads[i].data);
+        }
+    };
+
+    {
+        Reads parsed;
+        BgzfReadAhead read_ahead(bam_path, 10);
+        read_all(read_ahead, parsed);
+        ASSERT_EQ(reads.size(), parsed.size);
+        for (size_t i=0; i < reads.size(); ++i)
+        {
+            const bam1_t& read = parsed.reads[i];
+            EXPECT_EQ(int(i % 3), read.core.tid);
+            EXPECT_EQ(int(i*10), read.core.pos);
+            EXPECT_EQ(4681, read.core.bin);
+            EXPECT_EQ(60, read.core.qual);
+            EXPECT_EQ(1, read.core.l_qname);
+            EXPECT_EQ(16, read.core.flag);
+            EXPECT_EQ(-1, read.core.mtid);
+            ASSERT_EQ(int(reads[i].size()) - 36, read.data_len);
+            EXPECT_EQ(read.data_len - 1, read.l_aux);
+            EXPECT_EQ(0, std::memcmp(reads[i].data() + 36, read.data, read.data_len));
+        }
+        free_reads(parsed);
+    }
+
+    // a corrupt block fails its crc check
+    std::string corrupt = bam;
+    corrupt[corrupt.size() - 28 - 9] ^= 1;
+    std::ofstream(bam_path, std::ios::binary | std::ios::trunc) << corrupt;
+    {
+        Reads parsed;
+        BgzfReadAhead read_ahead(bam_path, 10);
+        EXPECT_THROW(read_all(read_ahead, parsed), std::runtime_error);
+        free_reads(parsed);
+    }
+
+    // a block with more extra subfields than just BC isn't read
+    std::string extra = bam;
+    extra[10] = 10;
+    std::ofstream(bam_path, std::ios::binary | std::ios::trunc) << extra;
+    {
+        Reads parsed;
+        BgzfReadAhead read_ahead(bam_path, 10);
+        BgzfChunk chunk;
+        EXPECT_THROW(read_ahead.read(chunk), std::runtime_error);
+    }
+
+    // a bam ending in the middle of a read is truncated
+    std::ofstream(bam_path, std::ios::binary | std::ios::trunc) << bam.substr(0, bam.size() - 28 - 1);
+    {
+        Reads parsed;
+        BgzfReadAhead wrong_size(bam_path, 10);
+        EXPECT_THROW(read_all(wrong_size, parsed), std::runtime_error);
+        free_reads(parsed);
+    }
+    bam.clear();
+    inflated.resize(inflated.size() - 5);
+    for (size_t begin = 0; begin < inflated.size(); begin += 1000)
+    {
+        append_block(inflated.substr(begin, 1000));
+    }
+    std::ofstream(bam_path, std::ios::binary | std::ios::trunc) << bam;
+    {
+        Reads parsed;
+        BgzfReadAhead truncated(bam_path, 10);
+        EXPECT_THROW(read_all(truncated, parsed), std::runtime_error);
+        EXPECT_EQ(reads.size() - 1, parsed.size);
+        free_reads(parsed);
+    }
+
+    // full blocks filling exactly one chunk, so that the end of file block is alone in the next chunk
+    inflated.assign(10, 'h');
+    const size_t chunk_size = 17*64000;
+    ASSERT_GE(chunk_size, BGZF_CHUNK_BYTES);
+    ASSERT_LT(chunk_size - 64000, BGZF_CHUNK_BYTES);
+    size_t read_count = 0;
+    while (inflated.size() < chunk_size)
+    {
+        const size_t left = chunk_size - inflated.size();
+        const int32_t block_length = left < 2*1036 ? int32_t(left - 4) : 1032;
+        std::string read(4 + block_length, char(read_count));
+        const uint32_t core[8] = {0, uint32_t(read_count), 4681 << 16 | 60 << 8 | 1, 0, 0, uint32_t(-1), uint32_t(-1), 0};
+        std::memcpy(&read[0], &block_length, 4);
+        std::memcpy(&read[4], core, sizeof(core));
+        inflated += read;
+        ++read_count;
+    }
+    bam.clear();
+    for (size_t begin = 0; begin < inflated.size(); begin += 64000)
+    {
+        append_block(inflated.substr(begin, 64000));
+    }
+    append_block("");
+    std::ofstream(bam_path, std::ios::binary | std::ios::trunc) << bam;
+    {
+        Reads parsed;
+        BgzfReadAhead read_ahead(bam_path, 10);
+        BgzfChunk chunk;
+        ASSERT_TRUE(read_ahead.read(chunk));
+        EXPECT_EQ(17, chunk.block_ends.size());
+        BgzfReadAhead::inflate(chunk);
+        read_ahead.parse(chunk, parsed);
+        EXPECT_EQ(read_count, parsed.size);
+
+        BgzfChunk end_of_file;
+        EXPECT_FALSE(read_ahead.read(end_of_file));
+        ASSERT_EQ(1, end_of_file.block_ends.size());
+        BgzfReadAhead::inflate(end_of_file);
+        EXPECT_TRUE(end_of_file.inflated.empty());
+        read_ahead.parse(end_of_file, parsed);
+        EXPECT_NO_THROW(read_ahead.finish());
+        EXPECT_EQ(read_count, parsed.size);
+        EXPECT_EQ(int(read_count - 1), parsed.reads[read_count - 1].core.pos);
+        free_reads(parsed);
+    }
+    std::remove(bam_path.c_str());
+}
+
+TEST(FastaReader, read_wrapped_fasta)
+{
+    std::istringstream fasta(">one line\nACGT\n>wrapped\r\nAC\r\nGT\r\nA\n>last\nGG");
+    FastaReader reader(fasta);
+
+    std::string sequence;
+    std::string name;
+    ASSERT_TRUE(reader.next_read(sequence, name));
+    EXPECT_EQ("one line", name);
+    EXPECT_EQ("ACGT", sequence);
+    ASSERT_TRUE(reader.next_read(sequence, name));
+    EXPECT_EQ("wrapped", name);
+    EXPECT_EQ("ACGTA", sequence);
+    ASSERT_TRUE(reader.next_read(sequence, name));
+    EXPECT_EQ("last", name);
+    EXPECT_EQ("GG", sequence);
+    EXPECT_FALSE(reader.next_read(sequence, name));
+}
+
 TEST(ScoreMatrix, probability_distribution)
 {
     using namespace detail;
@@ -319,6 +1198,43 @@ TEST(ScoreMatrix, probability_distribution)
     EXPECT_FLOAT_EQ(.25, probabilities[0]);
     EXPECT_FLOAT_EQ(.50, probabilities[1]);
     EXPECT_FLOAT_EQ(.25, probabilities[2]);
+
+    // only the reachable span of scores is computed, which must be exactly the same as computing every score
+    const std::array<double, AlphabetSize> skewed_bg { {.1, .2, .3, .4} };
+    unsigned seed = 7;
+    auto next_random = [&]() { seed = seed * 1103515245 + 12345; return (seed >> 16) % 1000; };
+    for (size_t length = 1; length <= 12; ++length)
+    {
+        std::vector<std::array<unsigned, AlphabetSize>> matrix(length);
+        for (auto& row : matrix)
+        {
+            for (auto& value : row)
+            {
+                value = next_random();
+            }
+        }
+
+        const unsigned max_matrix_value = max(matrix);
+        std::vector<double> expected(max_matrix_value*length + 1, 0);
+        expected[0] = 1;
+        for (const auto& row : matrix)
+        {
+            std::vector<double> next(expected.size(), 0);
+            for (size_t column=0; column < AlphabetSize; ++column)
+            {
+                for (size_t score=0; score + row[column] < expected.size(); ++score)
+                {
+                    if (expected[score] != 0)
+                    {
+                        next[score + row[column]] += expected[score] * skewed_bg[column];
+                    }
+                }
+            }
+            expected = next;
+        }
+
+        EXPECT_EQ(expected, probability_distribution(matrix, skewed_bg));
+    }
 }
 
 TEST(ScoreMatrix, pvalues)
@@ -478,6 +1394,13 @@ std::string fimo_style_line(const ScoreMatrix& matrix, const std::string& sequen
     std::stringstream ss;
     FimoStylePrinter printer(ss, false);
     matrix.score(sequence, printer);
+
+    // the threshold overload, which only gives the printer the hits, prints the same
+    std::stringstream threshold_ss;
+    FimoStylePrinter threshold_printer(threshold_ss, false);
+    matrix.score(sequence, matrix.min_scaled_score(threshold_printer.threshold()), threshold_printer);
+    EXPECT_EQ(ss.str(), threshold_ss.str());
+
     return ss.str();
 }
 